@@ -0,0 +1,63 @@
+#include <stdexcept>
+
+#include "AVFramePool.hh"
+
+AVFramePool::AVFramePool(int width, int height, AVPixelFormat pixelFormat, uint32_t frameCount, bool buffers) :
+    m_frameCount(frameCount),
+    m_frames(),
+    m_free(),
+    m_mutex()
+{
+    m_frames.reserve(frameCount);
+    m_free.reserve(frameCount);
+
+    for (uint32_t i = 0; i < frameCount; i++)
+        {
+            AVFrame* frame = av_frame_alloc();
+            if (frame != NULL)
+                {
+                    frame->format = pixelFormat;
+                    frame->width = width;
+                    frame->height = height;
+                }
+
+            // rows 64 byte aligned, for the AVX-512 kernels as much as the codec
+            if (frame == NULL || (buffers && av_frame_get_buffer(frame, 64) < 0))
+                {
+                    av_frame_free(&frame);
+                    for (AVFrame* created : m_frames)
+                        av_frame_free(&created);
+                    throw std::runtime_error("AVFramePool: could not allocate frame");
+                }
+
+            m_frames.push_back(frame);
+            m_free.push_back(frame);
+        }
+}
+
+AVFramePool::~AVFramePool()
+{
+    for (AVFrame* frame : m_frames)
+        av_frame_free(&frame);
+}
+
+AVFrame* AVFramePool::Acquire()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+
+    if (m_free.empty())
+        return NULL;
+
+    AVFrame* frame = m_free.back();
+    m_free.pop_back();
+    return frame;
+}
+
+void AVFramePool::Release(AVFrame* frame)
+{
+    if (frame == NULL)
+        return;
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_free.push_back(frame);
+}
@@ -0,0 +1,37 @@
+#ifndef __AV_FRAME_POOL_HH__
+#define __AV_FRAME_POOL_HH__
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include "libavutil/frame.h"
+}
+
+// Fixed set of AVFrames with their own buffers, handed between pipeline
+// stages instead of being allocated per frame. Whoever takes a frame off
+// the free list owns it until it calls Release. Without buffers, the
+// frames are only there for a decoder to hand its own buffers out in.
+class AVFramePool
+{
+public:
+    AVFramePool(int width, int height, AVPixelFormat pixelFormat, uint32_t frameCount, bool buffers = true);
+    ~AVFramePool();
+
+    AVFrame*        Acquire();                      // NULL when every frame is in use
+    void            Release(AVFrame* frame);
+
+    uint32_t        Capacity() const { return m_frameCount; }
+
+    AVFramePool(const AVFramePool&) = delete;
+    AVFramePool& operator=(const AVFramePool&) = delete;
+
+private:
+    uint32_t                m_frameCount;
+    std::vector<AVFrame*>   m_frames;
+    std::vector<AVFrame*>   m_free;
+    std::mutex              m_mutex;
+};
+
+#endif
@@ -25,10 +25,11 @@
 ** -LICENSE-END-
 */
 
+#include <atomic>
+#include <functional>
 #include <mutex>
 #include <queue>
 #include <thread>
-#include <list>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -42,6 +43,8 @@
 #include <ctime>
 #include <csignal>
 #include <iostream>
+#include <sstream>
+#include <string>
 
 extern "C"{
 #include "libavcodec/avcodec.h"
@@ -53,6 +56,15 @@ extern "C"{
 #include "Capture.hh"
 #include "Config.hh"
 #include "chunk.hh"
+#include "frame_pool.hh"
+#include "eventfd.hh"
+#include "epoll.hh"
+#include "signalfd.hh"
+#include "unix_socket.hh"
+#include "recorder.hh"
+#include "Recording.hh"
+#include "RecordingCodec.hh"
+#include "TracePoints.hh"
 
 #include "Playback.hh"
 #include "h264_degrader.hh"
@@ -65,15 +77,18 @@ using std::chrono::microseconds;
 std::queue<IDeckLinkVideoInputFrame*> frame_queue;
 std::mutex frame_queue_lock;
 
-std::list<high_resolution_clock::time_point> delay_queue;
-
 const BMDTimeScale ticks_per_second = (BMDTimeScale)1000000; /* microsecond resolution */
 static BMDTimeScale prev_frame_recieved_time = (BMDTimeScale)0;
 
-static pthread_mutex_t  g_sleepMutex;
-static pthread_cond_t   g_sleepCond;
 static int              g_videoOutputFile = -1;
-static bool             g_do_exit = false;
+static int              g_beforeFile = -1;
+static int              g_afterFile = -1;
+static Recorder*        g_recorder = NULL;      // writes both, across sessions
+static RecordingWriter* g_beforeRecording = NULL;
+static RecordingWriter* g_afterRecording = NULL;
+static EventFD*         g_exitEvent = NULL;     // signalled once m_maxFrames have arrived
+static EventFD*         g_formatChanged = NULL; // signalled when the input detects a new display mode
+static std::atomic<BMDDisplayMode> g_detectedMode(0);
 
 static BMDConfig        g_config;
 
@@ -81,33 +96,128 @@ static IDeckLinkInput*  g_deckLinkInput = NULL;
 static std::ofstream    logfile;
 
 static int64_t  g_frameCount = 0;
-std::list<uint8_t*>     output;
-std::mutex              output_mutex;
 
-const size_t width = 1280;
-const size_t height = 720;
-const size_t bytes_per_pixel = 4;
-const size_t frame_size = width*height*bytes_per_pixel;
 size_t dropped_frame_count = 0;
 
-int bitrate, quantization;
-
-H264_degrader *degrade1 = NULL, *degrade2 = NULL;
+/* retained input frames stop (and copying resumes) once the driver is down
+   to this many free buffers, so the card always has somewhere to DMA into */
+const uint32_t driver_reserve_frames = 4;
 
 static bool display_frame = true;
 static int display_frame_count = 0;
 
-static void sigfunc(int signum)
+// Everything sized by the input's display mode: built when capture
+// starts, and torn down and built again when the input changes mode.
+struct CaptureSession
 {
-    if (signum == SIGINT || signum == SIGTERM){
-        g_do_exit = true;
-    }
+    BMDDisplayMode              displayMode;
+    int                         framesPerSecond;
+    FramePool*                  framePool;
+    SPSCRing<CapturedFrame>*    output;
+    InputFrameAllocator*        inputAllocator;
+    EventFD*                    frameReady;
+    DeckLinkCaptureDelegate*    delegate;
+    Playback*                   playback;
+    std::thread                 playbackThread;
+
+    CaptureSession() : displayMode(0), framesPerSecond(0), framePool(NULL), output(NULL), inputAllocator(NULL), frameReady(NULL),
+                       delegate(NULL), playback(NULL), playbackThread() {}
+
+    CaptureSession(const CaptureSession&) = delete;
+    CaptureSession& operator=(const CaptureSession&) = delete;
+};
+
+// Block until SIGINT/SIGTERM/SIGHUP arrives (they are masked in every
+// thread and read through a signalfd) or capture has seen enough frames.
+// formatChanged runs on this thread whenever the input detects a new
+// display mode, and returns false if capture cannot carry on. Each
+// connection to the control socket (if there is one) is read to the end
+// and answered with whatever command makes of it.
+static void WaitForExit(EventFD& exitEvent, EventFD& formatEvent, const std::function<bool()>& formatChanged,
+                        UnixListener* control, const std::function<std::string(const std::string&)>& command)
+{
+    SignalFD    signalFD(SignalMask({ SIGINT, SIGTERM, SIGHUP }));
+    EPoll       poller;
+    bool        exiting = false;
+
+    poller.add(signalFD.fd(), [&]() {
+            const signalfd_siginfo sig = signalFD.read_signal();
+            fprintf(stderr, "Got signal %s\n", strsignal(sig.ssi_signo));
+            exiting = true;
+        });
+    poller.add(exitEvent.fd(), [&]() {
+            exitEvent.drain();
+            exiting = true;
+        });
+    poller.add(formatEvent.fd(), [&]() {
+            formatEvent.drain();
+            if (!formatChanged())
+                exiting = true;
+        });
+    if (control != NULL)
+        poller.add(control->fd(), [&]() {
+                // a client that stalls only holds us up for a second
+                try {
+                    FileDescriptor  connection = control->accept(1000);
+                    std::string     commands;
+
+                    while (!connection.eof() && commands.size() < 4096)
+                        commands += connection.read(4096 - commands.size());
+                    connection.write(command(commands));
+                } catch (const std::exception& e) {
+                    fprintf(stderr, "Control connection: %s\n", e.what());
+                }
+            });
+
+    while (!exiting)
+        poller.wait();
 }
 
-DeckLinkCaptureDelegate::DeckLinkCaptureDelegate(int framesDelay, int framerate) :
+InputFrameAllocator::InputFrameAllocator(size_t frameSize, uint32_t frameCount, bool hugePages) :
+    m_refCount(1),
+    m_framePool(frameSize, frameCount, hugePages, hugePages)
+{}
+
+ULONG InputFrameAllocator::AddRef(void)
+{
+    return __sync_add_and_fetch(&m_refCount, 1);
+}
+
+ULONG InputFrameAllocator::Release(void)
+{
+    int32_t newRefValue = __sync_sub_and_fetch(&m_refCount, 1);
+    if (newRefValue == 0)
+        {
+            delete this;
+            return 0;
+        }
+    return newRefValue;
+}
+
+HRESULT InputFrameAllocator::AllocateBuffer(uint32_t bufferSize, void **allocatedBuffer)
+{
+    if (bufferSize > m_framePool.frame_size())
+        return E_OUTOFMEMORY;
+
+    *allocatedBuffer = m_framePool.acquire();
+    return *allocatedBuffer ? S_OK : E_OUTOFMEMORY;
+}
+
+HRESULT InputFrameAllocator::ReleaseBuffer(void *buffer)
+{
+    m_framePool.release((uint8_t*)buffer);
+    return S_OK;
+}
+
+DeckLinkCaptureDelegate::DeckLinkCaptureDelegate(int framesDelay, int framerate, size_t frameSize, FramePool& framePool, SPSCRing<CapturedFrame>& output, EventFD& frameReady, InputFrameAllocator* inputAllocator) :
     framesDelay(framesDelay),
     framerate(framerate),
-    m_refCount(1)
+    m_refCount(1),
+    m_frameSize(frameSize),
+    m_framePool(framePool),
+    m_output(output),
+    m_frameReady(frameReady),
+    m_inputAllocator(inputAllocator)
 {}
 
 ULONG DeckLinkCaptureDelegate::AddRef(void)
@@ -130,6 +240,9 @@ void DeckLinkCaptureDelegate::preview(void*, int) {}
 
 HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame* videoFrame, IDeckLinkAudioInputPacket*){
     void* frameBytes;
+    uint8_t* out_buffer;
+    BMDTimeValue frameDuration;
+    CapturedFrame captured;
     
     if (videoFrame)
         {
@@ -139,33 +252,50 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
             if (videoFrame->GetFlags() & bmdFrameHasNoInputSource){
                 printf("Frame received (#%lu) - No input signal detected\n", g_frameCount);
             }
+            else if ((size_t)videoFrame->GetRowBytes() * videoFrame->GetHeight() != m_frameSize){
+                // still in the old mode after a format change; nothing is
+                // sized for it, and the session is about to be rebuilt
+                Trace::event(kTraceCaptureDropped, g_frameCount);
+                dropped_frame_count++;
+            }
             else {
 
                 videoFrame->GetBytes(&frameBytes);
                 if (display_frame_count % framerate == 0) {
-                    size_t output_size;
-                    { 
-                        std::lock_guard<std::mutex> lg(output_mutex);
-                        output_size = output.size();
+                    if(m_output.size() > (unsigned) framesDelay){
+                        Trace::event(kTraceCaptureDropped, g_frameCount);
+                        dropped_frame_count++;
+                    }
+                    else if(m_inputAllocator != NULL && m_inputAllocator->available() > driver_reserve_frames){
+                        // zero-copy: hold on to the driver's frame until it
+                        // has been converted and recorded
+                        videoFrame->AddRef();
+                        captured.bytes = (uint8_t*)frameBytes;
+                        captured.inputFrame = videoFrame;
                     }
-		    
-                    if(output_size > (unsigned) framesDelay){
-                        std::cerr << "CAPTURE: dropped a frame (dropped_count=" << dropped_frame_count << ")" << std::endl; 
+                    else if((out_buffer = m_framePool.acquire()) == NULL){
+                        Trace::event(kTraceCaptureDropped, g_frameCount);
                         dropped_frame_count++;
                     }
                     else{
-                        delay_queue.push_back(std::chrono::high_resolution_clock::now());
+                        std::memcpy(out_buffer, frameBytes, m_frameSize);
+                        captured.bytes = out_buffer;
+                    }
 
-                        auto mem_alloct1 = std::chrono::high_resolution_clock::now();
-                        uint8_t* out_buffer = new uint8_t[frame_size];
-                        auto mem_alloct2 = std::chrono::high_resolution_clock::now();
-                        auto mem_alloctime = std::chrono::duration_cast<std::chrono::duration<double>>(mem_alloct2 - mem_alloct1);
-                        std::cout << "CAPTURE (mem alloc) " << mem_alloctime.count() << "\n";
+                    if(captured.bytes != NULL){
+                        captured.record.id = g_frameCount;
+                        captured.record.captureTime = std::chrono::high_resolution_clock::now();
+                        if (videoFrame->GetHardwareReferenceTimestamp(ticks_per_second, &captured.record.captureHardwareTime, &frameDuration) != S_OK)
+                            captured.record.captureHardwareTime = 0;
 
-                        std::memcpy(out_buffer, frameBytes, frame_size);
-                        {
-                            std::lock_guard<std::mutex> lg(output_mutex);
-                            output.push_back((uint8_t*)out_buffer);
+                        if (!m_output.push(captured)) {
+                            Trace::event(kTraceCaptureDropped, g_frameCount);
+                            ReleaseCapturedFrame(captured, m_framePool);
+                            dropped_frame_count++;
+                        }
+                        else {
+                            m_frameReady.signal();
+                            Trace::event(kTraceCaptured, captured.record.id, m_output.size());
                         }
                     }
                 }
@@ -175,10 +305,8 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
             g_frameCount++;
         }
 
-    if (g_config.m_maxFrames > 0 && videoFrame && g_frameCount >= g_config.m_maxFrames) {
-        g_do_exit = true;
-        pthread_cond_signal(&g_sleepCond);
-    }
+    if (g_config.m_maxFrames > 0 && videoFrame && g_frameCount == g_config.m_maxFrames)
+        g_exitEvent->signal();
 
     return S_OK;
 }
@@ -186,13 +314,10 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
 HRESULT DeckLinkCaptureDelegate::VideoInputFormatChanged(BMDVideoInputFormatChangedEvents, IDeckLinkDisplayMode *mode, BMDDetectedVideoInputFormatFlags formatFlags)
 {
     // This only gets called if bmdVideoInputEnableFormatDetection was set
-    // when enabling video input
-    HRESULT result;
+    // when enabling video input. The main thread rebuilds the session for
+    // the new mode; the pixel format stays the configured one, which the
+    // degrader is built for, whatever the source sends.
     char*   displayModeName = NULL;
-    BMDPixelFormat  pixelFormat = bmdFormat10BitYUV;
-
-    if (formatFlags & bmdDetectedVideoInputRGB444)
-        pixelFormat = bmdFormat10BitRGB;
 
     mode->GetName((const char**)&displayModeName);
     printf("Video format changed to %s %s\n", displayModeName, formatFlags & bmdDetectedVideoInputRGB444 ? "RGB" : "YUV");
@@ -200,22 +325,254 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFormatChanged(BMDVideoInputFormatChan
     if (displayModeName)
         free(displayModeName);
 
-    if (g_deckLinkInput)
-        {
-            g_deckLinkInput->StopStreams();
+    g_detectedMode = mode->GetDisplayMode();
+    g_formatChanged->signal();
 
-            result = g_deckLinkInput->EnableVideoInput(mode->GetDisplayMode(), pixelFormat, g_config.m_inputFlags);
+    return S_OK;
+}
+
+// Build the frame pools, the capture callback and playback (with its
+// degrader) for a display mode, and start capturing in it.
+static bool StartSession(CaptureSession& session, IDeckLinkDisplayMode* displayMode)
+{
+    HRESULT         result;
+    BMDTimeValue    frameDuration;
+    BMDTimeScale    timeScale;
+    const long      width = displayMode->GetWidth();
+    const long      height = displayMode->GetHeight();
+    const size_t    frameSize = GetRowBytes(g_config.m_pixelFormat, width) * height;
+
+    displayMode->GetFrameRate(&frameDuration, &timeScale);
+    const int       framesPerSecond = (int)((timeScale + frameDuration - 1) / frameDuration);
+
+    session.displayMode = displayMode->GetDisplayMode();
+    session.framesPerSecond = framesPerSecond;
+    fprintf(stderr, "Capturing %ldx%ld at %d fps\n", width, height, framesPerSecond);
+
+    // Captured frames come from this pool: the delay line, the frames in
+    // the degrade pipeline, and one held with each output frame until the
+    // pair is recorded. (Degraded frames live in recycled DeckLink output
+    // frames.) With -E the delay line holds access units instead, and only
+    // a before recording keeps the captured frames for as long.
+    const int heldFrames = g_config.m_encodedDelay && g_beforeRecording == NULL ? 0 : g_config.m_framesDelay;
+    try {
+        session.framePool = new FramePool(frameSize,
+                                          heldFrames + 2 + 3 * pipeline_depth + output_frame_count + 1,
+                                          g_config.m_hugePages, g_config.m_hugePages);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Could not allocate the frame pool: %s\n", e.what());
+        return false;
+    }
+
+    // Frames wait here for playback; capture stops adding past framesDelay + 1
+    session.output = new SPSCRing<CapturedFrame>(g_config.m_framesDelay + 2);
+
+    // Retained input frames come out of a driver-side pool sized to the
+    // delay line; when it runs low capture falls back to copying
+    if (g_config.m_zeroCopy)
+        {
+            session.inputAllocator = new InputFrameAllocator(frameSize,
+                                                             heldFrames + 4 + 3 * pipeline_depth + driver_reserve_frames,
+                                                             g_config.m_hugePages);
+            result = g_deckLinkInput->SetVideoInputFrameMemoryAllocator(session.inputAllocator);
             if (result != S_OK)
                 {
-                    fprintf(stderr, "Failed to switch video mode\n");
-                    goto bail;
+                    fprintf(stderr, "Could not set the input frame allocator, copying frames instead\n");
+                    session.inputAllocator->Release();
+                    session.inputAllocator = NULL;
                 }
+        }
+
+    // Capture wakes playback through this as soon as a frame is queued
+    session.frameReady = new EventFD();
+
+    // Configure the capture callback
+    session.delegate = new DeckLinkCaptureDelegate(g_config.m_framesDelay, g_config.m_framerate, frameSize, *session.framePool,
+                                                   *session.output, *session.frameReady, session.inputAllocator);
+    g_deckLinkInput->SetCallback(session.delegate);
+
+    // Output runs in the same mode, so the degraded stream keeps the source's geometry and rate
+    session.playback = new Playback(0, session.displayMode, bmdVideoOutputFlagDefault, g_config.m_pixelFormat, "/drive-nvme/video3_720p60.playback.raw",
+                                    *session.output, *session.frameReady, *session.framePool, framesPerSecond / g_config.m_framerate,
+                                    g_config.m_framesDelay, g_config.m_preroll, g_config.m_bitrate, g_config.m_quantization,
+                                    g_config.m_bands, g_config.m_bandOverlap, g_config.m_encodedDelay,
+                                    g_beforeRecording, g_afterRecording,
+                                    g_config.m_recordingWorkers);
+    session.playbackThread = std::thread(&Playback::Run, session.playback);
 
-            g_deckLinkInput->StartStreams();
+    // Start capturing
+    result = g_deckLinkInput->EnableVideoInput(session.displayMode, g_config.m_pixelFormat, g_config.m_inputFlags);
+    if (result != S_OK)
+        {
+            fprintf(stderr, "Failed to enable video input. Is another application using the card?\n");
+            return false;
         }
 
- bail:
-    return S_OK;
+    result = g_deckLinkInput->StartStreams();
+    if (result != S_OK)
+        return false;
+
+    return true;
+}
+
+// Stop capturing and tear down everything StartSession built; every
+// frame goes back to its pool before the pools go. Does nothing for a
+// session already stopped.
+static void StopSession(CaptureSession& session)
+{
+    if (session.framePool == NULL && session.output == NULL && session.inputAllocator == NULL &&
+        session.frameReady == NULL && session.delegate == NULL && session.playback == NULL)
+        return;
+
+    g_deckLinkInput->StopStreams();
+    g_deckLinkInput->DisableVideoInput();
+    g_deckLinkInput->SetCallback(NULL);
+
+    if (session.playback != NULL)
+        {
+            session.playback->Stop();
+            if (session.playbackThread.joinable())
+                session.playbackThread.join();
+            delete session.playback;
+            session.playback = NULL;
+        }
+
+    if (session.delegate != NULL)
+        {
+            session.delegate->Release();
+            session.delegate = NULL;
+        }
+
+    // frames captured but never taken by playback
+    if (session.output != NULL)
+        {
+            CapturedFrame queued;
+            while (session.output->pop(queued))
+                ReleaseCapturedFrame(queued, *session.framePool);
+        }
+    delete session.output;
+    session.output = NULL;
+
+    delete session.frameReady;
+    session.frameReady = NULL;
+
+    if (session.inputAllocator != NULL)
+        {
+            session.inputAllocator->Release();
+            session.inputAllocator = NULL;
+        }
+
+    if (session.framePool != NULL)
+        {
+            fprintf(stderr, "Frame pool: %u frames%s, %lu acquired, %lu exhausted\n",
+                    session.framePool->capacity(), session.framePool->huge_pages() ? " (huge pages)" : "",
+                    session.framePool->acquired_count(), session.framePool->exhausted_count());
+            delete session.framePool;
+            session.framePool = NULL;
+        }
+}
+
+// Tear the session down and build it again in a display mode: for a
+// format change, or for settings the session was sized for. Returns false
+// if capture cannot carry on.
+static bool RestartSession(CaptureSession& session, BMDDisplayMode mode)
+{
+    IDeckLinkDisplayMode*   newMode = NULL;
+    BMDDisplayModeSupport   supported;
+    bool                    started;
+
+    if (g_deckLinkInput->DoesSupportVideoMode(mode, g_config.m_pixelFormat, bmdVideoInputFlagDefault, &supported, &newMode) != S_OK ||
+        supported == bmdDisplayModeNotSupported || newMode == NULL)
+        {
+            fprintf(stderr, "The display mode is not supported with the selected pixel format\n");
+            if (newMode != NULL)
+                newMode->Release();
+            return true;
+        }
+
+    StopSession(session);
+    started = StartSession(session, newMode);
+    newMode->Release();
+    return started;
+}
+
+// Apply the commands from a control connection, one "<setting> <value>"
+// per line in the units of the command line option of the same letter:
+// d (delay, frames), f (keep 1 frame in f), b (bitrate) and q
+// (quantization). All of them take effect, or none if any is bad. Delay
+// and frame rate apply from the next frame, and bitrate and quantization
+// from the first frame after a degrader for them is built, so playback
+// carries on throughout; only a delay longer than the queues were sized
+// for rebuilds the session. With -E the delay is held in the degrader,
+// so it changes with a new degrader too. The reply is the settings now
+// in force.
+static std::string ChangeSettings(CaptureSession& session, const std::string& commands)
+{
+    int                 framesDelay = g_config.m_framesDelay;
+    int                 framerate = g_config.m_framerate;
+    int                 bitrate = g_config.m_bitrate;
+    int                 quantization = g_config.m_quantization;
+    std::istringstream  lines(commands);
+    std::string         line;
+    char                reply[160];
+
+    while (std::getline(lines, line))
+        {
+            char    setting;
+            int     value;
+            char    extra;
+
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+            if (sscanf(line.c_str(), " %c %d %c", &setting, &value, &extra) != 2)
+                return "error: expected <setting> <value>, got \"" + line + "\"\n";
+
+            switch (setting)
+                {
+                case 'd': framesDelay = value; break;
+                case 'f': framerate = value; break;
+                case 'b': bitrate = value; break;
+                case 'q': quantization = value; break;
+                default:
+                    return std::string("error: unknown setting '") + setting + "'\n";
+                }
+        }
+
+    if (framesDelay < 0 || framerate < 1 || bitrate < 1 || quantization < 0)
+        return "error: setting out of range\n";
+
+    const bool degraderChanged = bitrate != g_config.m_bitrate || quantization != g_config.m_quantization ||
+                                 (g_config.m_encodedDelay && framesDelay != g_config.m_framesDelay);
+    const bool resize = framesDelay > (int)session.output->capacity() - 2;
+
+    g_config.m_framesDelay = framesDelay;
+    g_config.m_framerate = framerate;
+    g_config.m_bitrate = bitrate;
+    g_config.m_quantization = quantization;
+
+    if (resize)
+        {
+            fprintf(stderr, "Delay of %d frames needs larger queues, restarting capture\n", framesDelay);
+            if (!RestartSession(session, session.displayMode))
+                {
+                    g_exitEvent->signal();
+                    return "error: could not restart capture\n";
+                }
+        }
+    else
+        {
+            session.delegate->framesDelay = framesDelay;
+            session.delegate->framerate = framerate;
+            session.playback->framesDelay = framesDelay;
+            session.playback->frame_rate = session.framesPerSecond / framerate;
+            if (degraderChanged)
+                session.playback->ChangeDegrader(bitrate, quantization);
+        }
+
+    snprintf(reply, sizeof(reply), "delay %d, frame rate 1/%d, bitrate %d, quantization %d\n",
+             framesDelay, framerate, bitrate, quantization);
+    fprintf(stderr, "Settings: %s", reply);
+    return reply;
 }
 
 int main(int argc, char *argv[])
@@ -235,22 +592,16 @@ int main(int argc, char *argv[])
     char*                           displayModeName = NULL;
     BMDDisplayModeSupport           displayModeSupported;
 
-    DeckLinkCaptureDelegate*        delegate = NULL;
-
-    Playback *my_playback;
+    CaptureSession                  session;
+    Trace*                          trace = NULL;
+    UnixListener*                   control = NULL;
 
-    BMDVideoOutputFlags m_outputFlags(bmdVideoOutputFlagDefault);
-    std::thread t;
 
-    int ret;
-    
-
-    pthread_mutex_init(&g_sleepMutex, NULL);
-    pthread_cond_init(&g_sleepCond, NULL);
-
-    signal(SIGINT, sigfunc);
-    signal(SIGTERM, sigfunc);
-    signal(SIGHUP, sigfunc);
+    // Mask the exit signals before the driver or we start any threads, so
+    // they only ever arrive through WaitForExit's signalfd
+    SignalMask({ SIGINT, SIGTERM, SIGHUP }).set_as_mask();
+    g_exitEvent = new EventFD();
+    g_formatChanged = new EventFD();
 
     // Process the command line arguments
     if (!g_config.ParseArguments(argc, argv))
@@ -258,8 +609,15 @@ int main(int argc, char *argv[])
             g_config.DisplayUsage(exitStatus);
             goto bail;
         }
-    bitrate = g_config.m_bitrate;
-    quantization = g_config.m_quantization;
+
+    // Frames go to the encoder and back out to the card in the capture
+    // format, so it has to be one the degrader can convert
+    if (g_config.m_pixelFormat != bmdFormat8BitYUV && g_config.m_pixelFormat != bmdFormat10BitYUV &&
+        g_config.m_pixelFormat != bmdFormat8BitBGRA)
+        {
+            fprintf(stderr, "Only 8 bit YUV (-p 0), 10 bit YUV (-p 1) and 8 bit BGRA (-p 3) can be degraded\n");
+            goto bail;
+        }
 
     // Get the DeckLink device
     deckLinkIterator = CreateDeckLinkIteratorInstance();
@@ -357,9 +715,25 @@ int main(int argc, char *argv[])
     // Print the selected configuration
     g_config.DisplayConfiguration();
 
-    // Configure the capture callback
-    delegate = new DeckLinkCaptureDelegate(g_config.m_framesDelay, g_config.m_framerate);
-    g_deckLinkInput->SetCallback(delegate);
+    if (g_config.m_traceFilename != NULL)
+        {
+            try {
+                trace = new Trace(g_config.m_traceFilename);
+            } catch (const std::exception& e) {
+                fprintf(stderr, "Could not start tracing: %s\n", e.what());
+                goto bail;
+            }
+        }
+
+    if (g_config.m_controlSocket != NULL)
+        {
+            try {
+                control = new UnixListener(g_config.m_controlSocket);
+            } catch (const std::exception& e) {
+                fprintf(stderr, "Could not open the control socket: %s\n", e.what());
+                goto bail;
+            }
+        }
 
     // Open output files
     if (g_config.m_videoOutputFile != NULL)
@@ -372,79 +746,101 @@ int main(int argc, char *argv[])
                 }
         }
 
-    my_playback = new Playback(0, 14, m_outputFlags, bmdFormat8BitBGRA, "/drive-nvme/video3_720p60.playback.raw", output, output_mutex, 60/g_config.m_framerate, g_config.m_framesDelay, g_config.m_bitrate, g_config.m_quantization,  g_config.m_beforeFilename, g_config.m_afterFilename);
-    t = std::move( std::thread([&](){my_playback->Run();}) );
-
-    // Block main thread until signal occurs
-    // Start capturing
-    result = g_deckLinkInput->EnableVideoInput(displayMode->GetDisplayMode(), g_config.m_pixelFormat, g_config.m_inputFlags);
-    if (result != S_OK)
+    // The recordings, if asked for, stay open across sessions; after a
+    // mode change they carry on in the new frame size
+    if (g_config.m_beforeFilename != NULL || g_config.m_afterFilename != NULL)
         {
-            fprintf(stderr, "Failed to enable video input. Is another application using the card?\n");
-            goto bail;
+            g_beforeFile = g_config.m_beforeFilename ? open(g_config.m_beforeFilename, O_WRONLY|O_CREAT|O_TRUNC, 0664) : -1;
+            g_afterFile = g_config.m_afterFilename ? open(g_config.m_afterFilename, O_WRONLY|O_CREAT|O_TRUNC, 0664) : -1;
+            if (g_beforeFile < 0 || g_afterFile < 0)
+                {
+                    fprintf(stderr, "Could not open the before and after files (-B and -A go together)\n");
+                    goto bail;
+                }
+
+            // check FFV1 can be opened now, rather than on the first frame the compressor codes
+            if (g_config.m_recordingCodec == kRecordingFFV1 || g_config.m_afterRecordingCodec == kRecordingFFV1)
+                {
+                    try {
+                        RecordingEncoder check(kRecordingFFV1, g_config.m_pixelFormat);
+                    } catch (const std::exception& e) {
+                        fprintf(stderr, "Could not code the recordings with %s: %s\n", RecordingCodecName(kRecordingFFV1), e.what());
+                        goto bail;
+                    }
+                }
+
+            // so the after recording decodes the way playback converted it
+            uint32_t afterFlags = 0;
+            if (H264_degrader::bgra_convert_kernel() == kColorConvertScalar)
+                afterFlags |= kRecordingSwscale;
+
+            try {
+                g_recorder = new Recorder(g_config.m_recorderEngine, { g_beforeFile, g_afterFile }, g_config.m_recorderDepth);
+                g_beforeRecording = new RecordingWriter(*g_recorder, 0, g_config.m_pixelFormat, g_config.m_recordingCodec);
+                g_afterRecording = new RecordingWriter(*g_recorder, 1, g_config.m_pixelFormat, g_config.m_afterRecordingCodec, afterFlags);
+            } catch (const std::exception& e) {
+                fprintf(stderr, "Could not start the %s recorder: %s\n", Recorder::engine_name(g_config.m_recorderEngine), e.what());
+                goto bail;
+            }
         }
 
-    result = g_deckLinkInput->StartStreams();
-    if (result != S_OK)
+    if (!StartSession(session, displayMode))
         goto bail;
 
-    while (!g_do_exit) {
-        usleep(1000);
-    }
-    //     char input;
-    //     int value;
-    //     std::cin >> input >> value;
-    //     switch(tolower(input))
-    //         {
-    //         case 'd':
-    //             my_playback->framesDelay = value;
-    //             delegate->framesDelay = value;
-    //             break;
-    //         case 'b':
-    //             degrade1 = my_playback->degrader;
-    //             degrade2 = new H264_degrader(width, height, value*1000, quantization);
-    //             {
-    //                 std::lock_guard<std::mutex> lg(degrade1->degrader_mutex);
-    //                 my_playback->degrader = degrade2;
-    //             }
-    //             delete degrade1;
-    //             bitrate = value;
-
-    //             break;
-    //         case 'f':
-    //             delegate->framerate = value;
-    //             break;
-    //         case 'q':
-    //             degrade1 = my_playback->degrader;
-    //             degrade2 = new H264_degrader(width, height, bitrate, value);
-    //             {
-    //                 std::lock_guard<std::mutex> lg(degrade1->degrader_mutex);
-    //                 my_playback->degrader = degrade2;
-    //             }
-    //             delete degrade1;
-    //             quantization = value;
-
-    //             break;
-    //         }
-    // }
-
-    delete my_playback;
+    // Block main thread until signal occurs, following the input from
+    // mode to mode
+    WaitForExit(*g_exitEvent, *g_formatChanged, [&]() {
+            const BMDDisplayMode    mode = g_detectedMode;
+
+            if (mode == session.displayMode)
+                return true;
+            return RestartSession(session, mode);
+        }, control, [&](const std::string& commands) {
+            return ChangeSettings(session, commands);
+        });
 
     fprintf(stderr, "Stopping Capture\n");
-    g_deckLinkInput->StopStreams();
-    g_deckLinkInput->DisableVideoInput();
+    StopSession(session);
+
+    fprintf(stderr, "Capture: %lu frames, %lu dropped\n", g_frameCount, dropped_frame_count);
 
     // All Okay.
     exitStatus = 0;
 
-    pthread_mutex_lock(&g_sleepMutex);
-    pthread_cond_wait(&g_sleepCond, &g_sleepMutex);
-    pthread_mutex_unlock(&g_sleepMutex);
-    
  bail:
+    if (g_deckLinkInput != NULL)
+        StopSession(session);
+
     if (g_videoOutputFile != 0)
         close(g_videoOutputFile);
 
+    // the indexes go at the end of the recordings
+    for (RecordingWriter** recording : { &g_beforeRecording, &g_afterRecording })
+        if (*recording != NULL)
+            {
+                (*recording)->Finish();
+                delete *recording;
+                *recording = NULL;
+            }
+
+    if (g_recorder != NULL)
+        {
+            g_recorder->finish();
+            const Recorder::Stats stats = g_recorder->stats();
+            fprintf(stderr, "Recorder (%s): %.0f MB in %.1f s, %.1f MB/s, at most %u of %u chunks in flight, %lu stalls, %lu errors\n",
+                    Recorder::engine_name(g_recorder->engine()), stats.bytes_written / 1e6, stats.seconds,
+                    stats.bytes_written / 1e6 / stats.seconds, stats.max_in_flight, stats.chunk_count,
+                    stats.stalls, stats.errors);
+            delete g_recorder;
+            g_recorder = NULL;
+        }
+
+    if (g_beforeFile >= 0)
+        close(g_beforeFile);
+
+    if (g_afterFile >= 0)
+        close(g_afterFile);
+
     if (displayModeName != NULL)
         free(displayModeName);
 
@@ -454,8 +850,14 @@ int main(int argc, char *argv[])
     if (displayModeIterator != NULL)
         displayModeIterator->Release();
 
-    if (delegate != NULL)
-        delegate->Release();
+    delete control;
+
+    if (trace != NULL)
+        {
+            if (trace->dropped() > 0)
+                fprintf(stderr, "Trace: %lu events dropped\n", trace->dropped());
+            delete trace;
+        }
 
     if (g_deckLinkInput != NULL)
         {
@@ -475,5 +877,8 @@ int main(int argc, char *argv[])
     if (logfile.is_open())
         logfile.close();
 
+    delete g_formatChanged;
+    delete g_exitEvent;
+
     return exitStatus;
 }
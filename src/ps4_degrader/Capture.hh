@@ -28,16 +28,48 @@
 #ifndef __CAPTURE_H__
 #define __CAPTURE_H__
 
+#include <atomic>
+
 #include "DeckLinkAPI.h"
+#include "frame_pool.hh"
+#include "spsc_ring.hh"
+#include "eventfd.hh"
+#include "Frame.hh"
+
+// Backs the driver's input frames with a FramePool so captured frames can
+// be retained (and the pool size bounds how many are outstanding).
+class InputFrameAllocator : public IDeckLinkMemoryAllocator
+{
+public:
+    InputFrameAllocator(size_t frameSize, uint32_t frameCount, bool hugePages);
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID, LPVOID *) { return E_NOINTERFACE; }
+    virtual ULONG STDMETHODCALLTYPE AddRef(void);
+    virtual ULONG STDMETHODCALLTYPE Release(void);
+
+    virtual HRESULT STDMETHODCALLTYPE AllocateBuffer(uint32_t bufferSize, void **allocatedBuffer);
+    virtual HRESULT STDMETHODCALLTYPE ReleaseBuffer(void *buffer);
+    virtual HRESULT STDMETHODCALLTYPE Commit(void) { return S_OK; }
+    virtual HRESULT STDMETHODCALLTYPE Decommit(void) { return S_OK; }
+
+    uint32_t available(void) const { return m_framePool.available(); }
+
+protected:
+    virtual ~InputFrameAllocator() {} // call Release method to drop reference count
+
+private:
+    int32_t             m_refCount;
+    FramePool           m_framePool;
+};
 
 class DeckLinkCaptureDelegate : public IDeckLinkInputCallback
 {
 public:
 
-    int                 framesDelay;
-    int                 framerate;
+    std::atomic<int>    framesDelay;        // both changed live by the control socket,
+    std::atomic<int>    framerate;          // and read once per frame
 
-    DeckLinkCaptureDelegate(int framesDelay, int framerate);
+    DeckLinkCaptureDelegate(int framesDelay, int framerate, size_t frameSize, FramePool& framePool, SPSCRing<CapturedFrame>& output, EventFD& frameReady, InputFrameAllocator* inputAllocator);
 
     virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID, LPVOID *) { return E_NOINTERFACE; }
     virtual ULONG STDMETHODCALLTYPE AddRef(void);
@@ -47,6 +79,14 @@ public:
     virtual void preview(void*, int);
 private:
     int32_t             m_refCount;
+    const size_t        m_frameSize;        // of the display mode the pool was sized for
+    FramePool&          m_framePool;
+    SPSCRing<CapturedFrame>& m_output;
+    EventFD&            m_frameReady;       // wakes playback after each push
+    InputFrameAllocator* m_inputAllocator;   // NULL unless input frames are retained
+
+    DeckLinkCaptureDelegate(const DeckLinkCaptureDelegate&) = delete;
+    DeckLinkCaptureDelegate& operator=(const DeckLinkCaptureDelegate&) = delete;
 };
 
 #endif
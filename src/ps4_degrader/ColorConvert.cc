@@ -0,0 +1,615 @@
+#include <cstddef>
+#include <cstring>
+
+#include "ColorConvert.hh"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COLOR_CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+// Fixed point BT.601 coefficients. The RGB -> YUV ones are scaled by 2^15
+// and already include the 219/255 and 224/255 limited range factors; each
+// chroma row sums to zero so greys come out at exactly 128. The YUV -> RGB
+// ones are scaled by 2^13 so that every product fits the 16 bit pairs of
+// pmaddwd.
+static const int kYB = 3208, kYG = 16519, kYR = 8414;
+static const int kUB = 14392, kUG = -9535, kUR = -4857;
+static const int kVB = -2340, kVG = -12052, kVR = 14392;
+static const int kLumaOffset = (16 << 15) + (1 << 14);
+static const int kChromaOffset = (128 << 16) + (1 << 15);     // chroma is the sum of two pixels, hence one more bit
+
+static const int kYC = 9539, kRV = 13075, kGU = -3209, kGV = -6660, kBU = 16525;
+static const int kRGBRound = 1 << 12;
+
+static inline uint8_t Clamp(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// Scalar rows, from pixel x on. The vector kernels do the same integer
+// arithmetic, so they use these for whatever does not fill a whole vector.
+static void BGRAToYUV422PRow(const uint8_t* bgra, uint8_t* y, uint8_t* u, uint8_t* v, int x, int width)
+{
+    for (; x < width; x += 2)
+        {
+            const uint8_t* p = bgra + 4*x;
+            const int b = p[0] + p[4], g = p[1] + p[5], r = p[2] + p[6];
+
+            y[x]     = (kYB*p[0] + kYG*p[1] + kYR*p[2] + kLumaOffset) >> 15;
+            y[x + 1] = (kYB*p[4] + kYG*p[5] + kYR*p[6] + kLumaOffset) >> 15;
+            u[x/2] = (kUB*b + kUG*g + kUR*r + kChromaOffset) >> 16;
+            v[x/2] = (kVB*b + kVG*g + kVR*r + kChromaOffset) >> 16;
+        }
+}
+
+static void YUV422PToBGRARow(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* bgra, int x, int width)
+{
+    for (; x < width; x++)
+        {
+            const int c = kYC*(y[x] - 16), d = u[x/2] - 128, e = v[x/2] - 128;
+            uint8_t* p = bgra + 4*x;
+
+            p[0] = Clamp((c + kBU*d + kRGBRound) >> 13);
+            p[1] = Clamp((c + kGU*d + kGV*e + kRGBRound) >> 13);
+            p[2] = Clamp((c + kRV*e + kRGBRound) >> 13);
+            p[3] = 255;
+        }
+}
+
+static void UYVYToYUV422PRow(const uint8_t* uyvy, uint8_t* y, uint8_t* u, uint8_t* v, int x, int width)
+{
+    for (; x < width; x += 2)
+        {
+            const uint8_t* p = uyvy + 2*x;
+
+            u[x/2] = p[0];
+            y[x] = p[1];
+            v[x/2] = p[2];
+            y[x + 1] = p[3];
+        }
+}
+
+static void YUV422PToUYVYRow(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* uyvy, int x, int width)
+{
+    for (; x < width; x += 2)
+        {
+            uint8_t* p = uyvy + 2*x;
+
+            p[0] = u[x/2];
+            p[1] = y[x];
+            p[2] = v[x/2];
+            p[3] = y[x + 1];
+        }
+}
+
+// v210 holds three 10 bit samples in the low 30 bits of each little
+// endian word; a group of four words is
+//   Cb0 Y0 Cr0 | Y1 Cb1 Y2 | Cr1 Y3 Cb2 | Y4 Cr2 Y5
+// x is always a multiple of 6 here. A row whose width is not ends part
+// way through a group; the rest of that group is padding.
+static void V210ToYUV422P10Row(const uint8_t* v210, uint16_t* y, uint16_t* u, uint16_t* v, int x, int width)
+{
+    for (; x < width; x += 6)
+        {
+            uint32_t w[4];
+            memcpy(w, v210 + x / 6 * 16, sizeof(w));
+
+            const uint16_t luma[6] = { (uint16_t)((w[0] >> 10) & 0x3ff), (uint16_t)(w[1] & 0x3ff), (uint16_t)((w[1] >> 20) & 0x3ff),
+                                       (uint16_t)((w[2] >> 10) & 0x3ff), (uint16_t)(w[3] & 0x3ff), (uint16_t)((w[3] >> 20) & 0x3ff) };
+            const uint16_t cb[3] = { (uint16_t)(w[0] & 0x3ff), (uint16_t)((w[1] >> 10) & 0x3ff), (uint16_t)((w[2] >> 20) & 0x3ff) };
+            const uint16_t cr[3] = { (uint16_t)((w[0] >> 20) & 0x3ff), (uint16_t)(w[2] & 0x3ff), (uint16_t)((w[3] >> 10) & 0x3ff) };
+
+            const int count = width - x < 6 ? width - x : 6;
+            for (int i = 0; i < count; i++)
+                y[x + i] = luma[i];
+            for (int i = 0; i < count / 2; i++)
+                {
+                    u[x/2 + i] = cb[i];
+                    v[x/2 + i] = cr[i];
+                }
+        }
+}
+
+// the padding at the end of the last group is black
+static void YUV422P10ToV210Row(const uint16_t* y, const uint16_t* u, const uint16_t* v, uint8_t* v210, int x, int width)
+{
+    for (; x < width; x += 6)
+        {
+            uint32_t luma[6] = { 64, 64, 64, 64, 64, 64 }, cb[3] = { 512, 512, 512 }, cr[3] = { 512, 512, 512 };
+
+            const int count = width - x < 6 ? width - x : 6;
+            for (int i = 0; i < count; i++)
+                luma[i] = y[x + i];
+            for (int i = 0; i < count / 2; i++)
+                {
+                    cb[i] = u[x/2 + i];
+                    cr[i] = v[x/2 + i];
+                }
+
+            const uint32_t w[4] = { cb[0] | luma[0] << 10 | cr[0] << 20,
+                                    luma[1] | cb[1] << 10 | luma[2] << 20,
+                                    cr[1] | luma[3] << 10 | cb[2] << 20,
+                                    luma[4] | cr[2] << 10 | luma[5] << 20 };
+            memcpy(v210 + x / 6 * 16, w, sizeof(w));
+        }
+}
+
+#ifdef COLOR_CONVERT_X86
+
+// two 16 bit coefficients for one pmaddwd pair, lo applied to the even element
+static inline int Pair(int lo, int hi)
+{
+    return (int)((uint32_t)(uint16_t)lo | ((uint32_t)(uint16_t)hi << 16));
+}
+
+// Both vector widths work on 128 bit lanes of four BGRA pixels, which is
+// all pshufb and pmaddwd can see. Luma spreads B,G and R of each pixel
+// into 16 bit pairs and sums two pmaddwd's into one 32 bit value per
+// pixel. Chroma first adds each horizontal pair of pixels, then leaves
+// [u0 u1 v0 v1] in the lane.
+#define SHUFFLE_BG      0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1
+#define SHUFFLE_R       2, -1, -1, -1, 6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1
+#define SHUFFLE_EVEN    0, -1, 1, -1, 8, -1, 9, -1, 2, -1, -1, -1, 10, -1, -1, -1
+#define SHUFFLE_ODD     4, -1, 5, -1, 12, -1, 13, -1, 6, -1, -1, -1, 14, -1, -1, -1
+#define SHUFFLE_UV      0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15   // [u0 u1 v0 v1 ...] -> u0..u7 v0..v7
+
+__attribute__((target("avx2")))
+static inline __m256i LumaAVX2(__m256i pixels)
+{
+    const __m256i bg = _mm256_shuffle_epi8(pixels, _mm256_setr_epi8(SHUFFLE_BG, SHUFFLE_BG));
+    const __m256i r = _mm256_shuffle_epi8(pixels, _mm256_setr_epi8(SHUFFLE_R, SHUFFLE_R));
+    const __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(bg, _mm256_set1_epi32(Pair(kYB, kYG))),
+                                         _mm256_madd_epi16(r, _mm256_set1_epi32(Pair(kYR, 0))));
+    return _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(kLumaOffset)), 15);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i ChromaAVX2(__m256i pixels)
+{
+    const __m256i sums = _mm256_add_epi16(_mm256_shuffle_epi8(pixels, _mm256_setr_epi8(SHUFFLE_EVEN, SHUFFLE_EVEN)),
+                                          _mm256_shuffle_epi8(pixels, _mm256_setr_epi8(SHUFFLE_ODD, SHUFFLE_ODD)));
+    const __m256i u = _mm256_madd_epi16(sums, _mm256_setr_epi32(Pair(kUB, kUG), Pair(kUB, kUG), Pair(kUR, 0), Pair(kUR, 0),
+                                                                Pair(kUB, kUG), Pair(kUB, kUG), Pair(kUR, 0), Pair(kUR, 0)));
+    const __m256i v = _mm256_madd_epi16(sums, _mm256_setr_epi32(Pair(kVB, kVG), Pair(kVB, kVG), Pair(kVR, 0), Pair(kVR, 0),
+                                                                Pair(kVB, kVG), Pair(kVB, kVG), Pair(kVR, 0), Pair(kVR, 0)));
+    const __m256i uv = _mm256_add_epi32(_mm256_unpacklo_epi64(u, v), _mm256_unpackhi_epi64(u, v));
+    return _mm256_srai_epi32(_mm256_add_epi32(uv, _mm256_set1_epi32(kChromaOffset)), 16);
+}
+
+__attribute__((target("avx2")))
+static int BGRAToYUV422PRowAVX2(const uint8_t* bgra, uint8_t* y, uint8_t* u, uint8_t* v, int width)
+{
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 0, 4, 1, 5);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16)
+        {
+            const __m256i p0 = _mm256_loadu_si256((const __m256i*)(bgra + 4*x));
+            const __m256i p1 = _mm256_loadu_si256((const __m256i*)(bgra + 4*x + 32));
+
+            // packing works within lanes, so the 4 pixel groups come out as 0 2 1 3
+            __m256i luma = _mm256_packs_epi32(LumaAVX2(p0), LumaAVX2(p1));
+            luma = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(luma, luma), order);
+            _mm_storeu_si128((__m128i*)(y + x), _mm256_castsi256_si128(luma));
+
+            __m256i chroma = _mm256_packs_epi32(ChromaAVX2(p0), ChromaAVX2(p1));
+            chroma = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(chroma, chroma), order);
+            const __m128i planar = _mm_shuffle_epi8(_mm256_castsi256_si128(chroma), _mm_setr_epi8(SHUFFLE_UV));
+            _mm_storel_epi64((__m128i*)(u + x/2), planar);
+            _mm_storel_epi64((__m128i*)(v + x/2), _mm_srli_si128(planar, 8));
+        }
+    return x;
+}
+
+// [C D] and [C E] pairs of four pixels per lane -> those pixels as BGRA
+__attribute__((target("avx2")))
+static inline __m256i PixelsAVX2(__m256i cd, __m256i ce)
+{
+    const __m256i round = _mm256_set1_epi32(kRGBRound);
+    const __m256i b = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(cd, _mm256_set1_epi32(Pair(kYC, kBU))), round), 13);
+    const __m256i r = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(ce, _mm256_set1_epi32(Pair(kYC, kRV))), round), 13);
+    const __m256i g = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(cd, _mm256_set1_epi32(Pair(kYC, kGU))),
+                                                                          _mm256_madd_epi16(ce, _mm256_set1_epi32(Pair(0, kGV)))), round), 13);
+
+    const __m256i bg = _mm256_packs_epi32(b, g);                                // b0..b3 g0..g3
+    const __m256i ra = _mm256_packs_epi32(r, _mm256_set1_epi32(255));           // r0..r3 255
+    const __m256i br = _mm256_unpacklo_epi16(bg, ra);
+    const __m256i ga = _mm256_unpackhi_epi16(bg, ra);
+    return _mm256_packus_epi16(_mm256_unpacklo_epi16(br, ga), _mm256_unpackhi_epi16(br, ga));
+}
+
+__attribute__((target("avx2")))
+static int YUV422PToBGRARowAVX2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* bgra, int width)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16)
+        {
+            const __m128i u8 = _mm_loadl_epi64((const __m128i*)(u + x/2));
+            const __m128i v8 = _mm_loadl_epi64((const __m128i*)(v + x/2));
+            const __m256i c = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(y + x))), _mm256_set1_epi16(16));
+            const __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(u8, u8)), _mm256_set1_epi16(128));
+            const __m256i e = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(v8, v8)), _mm256_set1_epi16(128));
+
+            // lo holds pixels 0-3 and 8-11, hi 4-7 and 12-15
+            const __m256i lo = PixelsAVX2(_mm256_unpacklo_epi16(c, d), _mm256_unpacklo_epi16(c, e));
+            const __m256i hi = PixelsAVX2(_mm256_unpackhi_epi16(c, d), _mm256_unpackhi_epi16(c, e));
+            _mm256_storeu_si256((__m256i*)(bgra + 4*x), _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i*)(bgra + 4*x + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+    return x;
+}
+
+// GCC 12's AVX-512 headers build results on _mm512_undefined_epi32(),
+// which -Wmaybe-uninitialized reports at every inlined call
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// UYVY is only repacked, so these are bound by memory and the AVX-512
+// kernel uses them too. pshufb splits each lane of 8 pixels into
+// [y0..y7 u0..u3 v0..v3]; the dword and lane permutes gather those into
+// whole rows of Y, U and V.
+__attribute__((target("avx2")))
+static int UYVYToYUV422PRowAVX2(const uint8_t* uyvy, uint8_t* y, uint8_t* u, uint8_t* v, int width)
+{
+    const __m256i split = _mm256_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, 0, 4, 8, 12, 2, 6, 10, 14,
+                                           1, 3, 5, 7, 9, 11, 13, 15, 0, 4, 8, 12, 2, 6, 10, 14);
+    const __m256i gather = _mm256_setr_epi32(0, 1, 4, 5, 2, 6, 3, 7);     // -> [y0..y15 | u0..u7 v0..v7]
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32)
+        {
+            const __m256i a = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(uyvy + 2*x)), split), gather);
+            const __m256i b = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(uyvy + 2*x + 32)), split), gather);
+            const __m256i chroma = _mm256_permute4x64_epi64(_mm256_permute2x128_si256(a, b, 0x31), 0xd8);
+
+            _mm256_storeu_si256((__m256i*)(y + x), _mm256_permute2x128_si256(a, b, 0x20));
+            _mm_storeu_si128((__m128i*)(u + x/2), _mm256_castsi256_si128(chroma));
+            _mm_storeu_si128((__m128i*)(v + x/2), _mm256_extracti128_si256(chroma, 1));
+        }
+    return x;
+}
+
+// U and V are interleaved into one stream of chroma bytes, which then
+// interleaves byte for byte with Y
+__attribute__((target("avx2")))
+static int YUV422PToUYVYRowAVX2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* uyvy, int width)
+{
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32)
+        {
+            const __m128i u16 = _mm_loadu_si128((const __m128i*)(u + x/2));
+            const __m128i v16 = _mm_loadu_si128((const __m128i*)(v + x/2));
+            const __m256i chroma = _mm256_set_m128i(_mm_unpackhi_epi8(u16, v16), _mm_unpacklo_epi8(u16, v16));
+            const __m256i luma = _mm256_loadu_si256((const __m256i*)(y + x));
+
+            // lo holds pixels 0-7 and 16-23, hi 8-15 and 24-31
+            const __m256i lo = _mm256_unpacklo_epi8(chroma, luma);
+            const __m256i hi = _mm256_unpackhi_epi8(chroma, luma);
+            _mm256_storeu_si256((__m256i*)(uyvy + 2*x), _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i*)(uyvy + 2*x + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+    return x;
+}
+
+// v210 works on one group of 6 pixels per 128 bit lane. Each word is
+// split into its three 10 bit fields, the first two as a 16 bit pair
+// [a b] and the third alone, and two pshufb's per plane pick the samples
+// out. A lane gives 6 Y, 3 U and 3 V, which are stored with overlapping
+// stores; the loop stops early enough that the extra samples written
+// always land inside the row and are overwritten afterwards.
+#define V210_Y_AB       2, 3, 4, 5, -1, -1, 10, 11, 12, 13, -1, -1, -1, -1, -1, -1
+#define V210_Y_C        -1, -1, -1, -1, 4, 5, -1, -1, -1, -1, 12, 13, -1, -1, -1, -1
+#define V210_UV_AB      0, 1, 6, 7, -1, -1, -1, -1, -1, -1, 8, 9, 14, 15, -1, -1    // [u0 u1 u2 - v0 v1 v2 -]
+#define V210_UV_C       -1, -1, -1, -1, 8, 9, -1, -1, 0, 1, -1, -1, -1, -1, -1, -1
+
+__attribute__((target("avx2")))
+static int V210ToYUV422P10RowAVX2(const uint8_t* v210, uint16_t* y, uint16_t* u, uint16_t* v, int width)
+{
+    const __m256i mask = _mm256_set1_epi32(0x3ff);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 12)
+        {
+            const __m256i words = _mm256_loadu_si256((const __m256i*)(v210 + x / 6 * 16));
+            const __m256i ab = _mm256_or_si256(_mm256_and_si256(words, mask),
+                                               _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(words, 10), mask), 16));
+            const __m256i c = _mm256_and_si256(_mm256_srli_epi32(words, 20), mask);
+
+            const __m256i luma = _mm256_or_si256(_mm256_shuffle_epi8(ab, _mm256_setr_epi8(V210_Y_AB, V210_Y_AB)),
+                                                 _mm256_shuffle_epi8(c, _mm256_setr_epi8(V210_Y_C, V210_Y_C)));
+            const __m256i chroma = _mm256_or_si256(_mm256_shuffle_epi8(ab, _mm256_setr_epi8(V210_UV_AB, V210_UV_AB)),
+                                                   _mm256_shuffle_epi8(c, _mm256_setr_epi8(V210_UV_C, V210_UV_C)));
+
+            _mm_storeu_si128((__m128i*)(y + x), _mm256_castsi256_si128(luma));
+            _mm_storeu_si128((__m128i*)(y + x + 6), _mm256_extracti128_si256(luma, 1));
+            _mm_storel_epi64((__m128i*)(u + x/2), _mm256_castsi256_si128(chroma));
+            _mm_storel_epi64((__m128i*)(u + x/2 + 3), _mm256_extracti128_si256(chroma, 1));
+            _mm_storel_epi64((__m128i*)(v + x/2), _mm_srli_si128(_mm256_castsi256_si128(chroma), 8));
+            _mm_storel_epi64((__m128i*)(v + x/2 + 3), _mm_srli_si128(_mm256_extracti128_si256(chroma, 1), 8));
+        }
+    return x;
+}
+
+// The reverse: the samples of each word's first, second and third field
+// are gathered into three 32 bit vectors and shifted into place
+#define V210_A_Y        -1, -1, -1, -1, 2, 3, -1, -1, -1, -1, -1, -1, 8, 9, -1, -1     // [u0 y1 v1 y4]
+#define V210_A_UV       0, 1, -1, -1, -1, -1, -1, -1, 10, 11, -1, -1, -1, -1, -1, -1
+#define V210_B_Y        0, 1, -1, -1, -1, -1, -1, -1, 6, 7, -1, -1, -1, -1, -1, -1      // [y0 u1 y3 v2]
+#define V210_B_UV       -1, -1, -1, -1, 2, 3, -1, -1, -1, -1, -1, -1, 12, 13, -1, -1
+#define V210_C_Y        -1, -1, -1, -1, 4, 5, -1, -1, -1, -1, -1, -1, 10, 11, -1, -1    // [v0 y2 u2 y5]
+#define V210_C_UV       8, 9, -1, -1, -1, -1, -1, -1, 4, 5, -1, -1, -1, -1, -1, -1
+
+__attribute__((target("avx2")))
+static int YUV422P10ToV210RowAVX2(const uint16_t* y, const uint16_t* u, const uint16_t* v, uint8_t* v210, int width)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 12)
+        {
+            const __m256i luma = _mm256_set_m128i(_mm_loadu_si128((const __m128i*)(y + x + 6)), _mm_loadu_si128((const __m128i*)(y + x)));
+            const __m256i chroma = _mm256_set_m128i(_mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(u + x/2 + 3)), _mm_loadl_epi64((const __m128i*)(v + x/2 + 3))),
+                                                    _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(u + x/2)), _mm_loadl_epi64((const __m128i*)(v + x/2))));
+
+            const __m256i a = _mm256_or_si256(_mm256_shuffle_epi8(luma, _mm256_setr_epi8(V210_A_Y, V210_A_Y)),
+                                              _mm256_shuffle_epi8(chroma, _mm256_setr_epi8(V210_A_UV, V210_A_UV)));
+            const __m256i b = _mm256_or_si256(_mm256_shuffle_epi8(luma, _mm256_setr_epi8(V210_B_Y, V210_B_Y)),
+                                              _mm256_shuffle_epi8(chroma, _mm256_setr_epi8(V210_B_UV, V210_B_UV)));
+            const __m256i c = _mm256_or_si256(_mm256_shuffle_epi8(luma, _mm256_setr_epi8(V210_C_Y, V210_C_Y)),
+                                              _mm256_shuffle_epi8(chroma, _mm256_setr_epi8(V210_C_UV, V210_C_UV)));
+
+            _mm256_storeu_si256((__m256i*)(v210 + x / 6 * 16),
+                                _mm256_or_si256(a, _mm256_or_si256(_mm256_slli_epi32(b, 10), _mm256_slli_epi32(c, 20))));
+        }
+    return x;
+}
+
+#define AVX512_TARGET __attribute__((target("avx512f,avx512bw")))
+
+AVX512_TARGET
+static inline __m512i LumaAVX512(__m512i pixels)
+{
+    const __m512i bg = _mm512_shuffle_epi8(pixels, _mm512_broadcast_i32x4(_mm_setr_epi8(SHUFFLE_BG)));
+    const __m512i r = _mm512_shuffle_epi8(pixels, _mm512_broadcast_i32x4(_mm_setr_epi8(SHUFFLE_R)));
+    const __m512i sum = _mm512_add_epi32(_mm512_madd_epi16(bg, _mm512_set1_epi32(Pair(kYB, kYG))),
+                                         _mm512_madd_epi16(r, _mm512_set1_epi32(Pair(kYR, 0))));
+    return _mm512_srai_epi32(_mm512_add_epi32(sum, _mm512_set1_epi32(kLumaOffset)), 15);
+}
+
+AVX512_TARGET
+static inline __m512i ChromaAVX512(__m512i pixels)
+{
+    const __m512i sums = _mm512_add_epi16(_mm512_shuffle_epi8(pixels, _mm512_broadcast_i32x4(_mm_setr_epi8(SHUFFLE_EVEN))),
+                                          _mm512_shuffle_epi8(pixels, _mm512_broadcast_i32x4(_mm_setr_epi8(SHUFFLE_ODD))));
+    const __m512i u = _mm512_madd_epi16(sums, _mm512_broadcast_i32x4(_mm_setr_epi32(Pair(kUB, kUG), Pair(kUB, kUG), Pair(kUR, 0), Pair(kUR, 0))));
+    const __m512i v = _mm512_madd_epi16(sums, _mm512_broadcast_i32x4(_mm_setr_epi32(Pair(kVB, kVG), Pair(kVB, kVG), Pair(kVR, 0), Pair(kVR, 0))));
+    const __m512i uv = _mm512_add_epi32(_mm512_unpacklo_epi64(u, v), _mm512_unpackhi_epi64(u, v));
+    return _mm512_srai_epi32(_mm512_add_epi32(uv, _mm512_set1_epi32(kChromaOffset)), 16);
+}
+
+AVX512_TARGET
+static int BGRAToYUV422PRowAVX512(const uint8_t* bgra, uint8_t* y, uint8_t* u, uint8_t* v, int width)
+{
+    int x = 0;
+
+    // vpmovdb narrows the 32 bit results in order, so no lane fix-ups here
+    for (; x + 16 <= width; x += 16)
+        {
+            const __m512i pixels = _mm512_loadu_si512(bgra + 4*x);
+
+            _mm_storeu_si128((__m128i*)(y + x), _mm512_cvtepi32_epi8(LumaAVX512(pixels)));
+
+            const __m128i planar = _mm_shuffle_epi8(_mm512_cvtepi32_epi8(ChromaAVX512(pixels)), _mm_setr_epi8(SHUFFLE_UV));
+            _mm_storel_epi64((__m128i*)(u + x/2), planar);
+            _mm_storel_epi64((__m128i*)(v + x/2), _mm_srli_si128(planar, 8));
+        }
+    return x;
+}
+
+AVX512_TARGET
+static inline __m512i PixelsAVX512(__m512i cd, __m512i ce)
+{
+    const __m512i round = _mm512_set1_epi32(kRGBRound);
+    const __m512i b = _mm512_srai_epi32(_mm512_add_epi32(_mm512_madd_epi16(cd, _mm512_set1_epi32(Pair(kYC, kBU))), round), 13);
+    const __m512i r = _mm512_srai_epi32(_mm512_add_epi32(_mm512_madd_epi16(ce, _mm512_set1_epi32(Pair(kYC, kRV))), round), 13);
+    const __m512i g = _mm512_srai_epi32(_mm512_add_epi32(_mm512_add_epi32(_mm512_madd_epi16(cd, _mm512_set1_epi32(Pair(kYC, kGU))),
+                                                                          _mm512_madd_epi16(ce, _mm512_set1_epi32(Pair(0, kGV)))), round), 13);
+
+    const __m512i bg = _mm512_packs_epi32(b, g);
+    const __m512i ra = _mm512_packs_epi32(r, _mm512_set1_epi32(255));
+    const __m512i br = _mm512_unpacklo_epi16(bg, ra);
+    const __m512i ga = _mm512_unpackhi_epi16(bg, ra);
+    return _mm512_packus_epi16(_mm512_unpacklo_epi16(br, ga), _mm512_unpackhi_epi16(br, ga));
+}
+
+AVX512_TARGET
+static int YUV422PToBGRARowAVX512(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* bgra, int width)
+{
+    const __m512i first = _mm512_setr_epi64(0, 1, 8, 9, 2, 3, 10, 11);
+    const __m512i second = _mm512_setr_epi64(4, 5, 12, 13, 6, 7, 14, 15);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32)
+        {
+            const __m128i u16 = _mm_loadu_si128((const __m128i*)(u + x/2));
+            const __m128i v16 = _mm_loadu_si128((const __m128i*)(v + x/2));
+            const __m512i c = _mm512_sub_epi16(_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(y + x))), _mm512_set1_epi16(16));
+            const __m512i d = _mm512_sub_epi16(_mm512_cvtepu8_epi16(_mm256_set_m128i(_mm_unpackhi_epi8(u16, u16), _mm_unpacklo_epi8(u16, u16))),
+                                               _mm512_set1_epi16(128));
+            const __m512i e = _mm512_sub_epi16(_mm512_cvtepu8_epi16(_mm256_set_m128i(_mm_unpackhi_epi8(v16, v16), _mm_unpacklo_epi8(v16, v16))),
+                                               _mm512_set1_epi16(128));
+
+            // lo holds pixels 0-3, 8-11, 16-19 and 24-27, hi the four after each
+            const __m512i lo = PixelsAVX512(_mm512_unpacklo_epi16(c, d), _mm512_unpacklo_epi16(c, e));
+            const __m512i hi = PixelsAVX512(_mm512_unpackhi_epi16(c, d), _mm512_unpackhi_epi16(c, e));
+            _mm512_storeu_si512(bgra + 4*x, _mm512_permutex2var_epi64(lo, first, hi));
+            _mm512_storeu_si512(bgra + 4*x + 64, _mm512_permutex2var_epi64(lo, second, hi));
+        }
+    return x;
+}
+
+#pragma GCC diagnostic pop
+
+#endif // COLOR_CONVERT_X86
+
+bool ColorConvertSupported(ColorConvertKernel kernel)
+{
+    switch (kernel)
+        {
+        case kColorConvertScalar:
+            return true;
+#ifdef COLOR_CONVERT_X86
+        case kColorConvertAVX2:
+            return __builtin_cpu_supports("avx2");
+        case kColorConvertAVX512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+        default:
+            return false;
+        }
+}
+
+ColorConvertKernel ColorConvertBestKernel()
+{
+    static const ColorConvertKernel best =
+        ColorConvertSupported(kColorConvertAVX512) ? kColorConvertAVX512 :
+        ColorConvertSupported(kColorConvertAVX2) ? kColorConvertAVX2 : kColorConvertScalar;
+    return best;
+}
+
+const char* ColorConvertKernelName(ColorConvertKernel kernel)
+{
+    switch (kernel)
+        {
+        case kColorConvertScalar:   return "scalar";
+        case kColorConvertAVX2:     return "avx2";
+        case kColorConvertAVX512:   return "avx512";
+        }
+    return "unknown";
+}
+
+void BGRAToYUV422P(ColorConvertKernel kernel, const uint8_t* bgra, int bgraStride,
+                   uint8_t* const planes[3], const int strides[3],
+                   int width, int firstRow, int lastRow)
+{
+    for (int row = firstRow; row < lastRow; row++)
+        {
+            const uint8_t* src = bgra + (ptrdiff_t)row * bgraStride;
+            uint8_t* y = planes[0] + (ptrdiff_t)row * strides[0];
+            uint8_t* u = planes[1] + (ptrdiff_t)row * strides[1];
+            uint8_t* v = planes[2] + (ptrdiff_t)row * strides[2];
+            int x = 0;
+
+#ifdef COLOR_CONVERT_X86
+            if (kernel == kColorConvertAVX512)
+                x = BGRAToYUV422PRowAVX512(src, y, u, v, width);
+            else if (kernel == kColorConvertAVX2)
+                x = BGRAToYUV422PRowAVX2(src, y, u, v, width);
+#endif
+            BGRAToYUV422PRow(src, y, u, v, x, width);
+        }
+}
+
+void UYVYToYUV422P(ColorConvertKernel kernel, const uint8_t* uyvy, int uyvyStride,
+                   uint8_t* const planes[3], const int strides[3],
+                   int width, int firstRow, int lastRow)
+{
+    for (int row = firstRow; row < lastRow; row++)
+        {
+            const uint8_t* src = uyvy + (ptrdiff_t)row * uyvyStride;
+            uint8_t* y = planes[0] + (ptrdiff_t)row * strides[0];
+            uint8_t* u = planes[1] + (ptrdiff_t)row * strides[1];
+            uint8_t* v = planes[2] + (ptrdiff_t)row * strides[2];
+            int x = 0;
+
+#ifdef COLOR_CONVERT_X86
+            if (kernel == kColorConvertAVX512 || kernel == kColorConvertAVX2)
+                x = UYVYToYUV422PRowAVX2(src, y, u, v, width);
+#endif
+            UYVYToYUV422PRow(src, y, u, v, x, width);
+        }
+}
+
+void YUV422PToUYVY(ColorConvertKernel kernel, const uint8_t* const planes[3], const int strides[3],
+                   uint8_t* uyvy, int uyvyStride,
+                   int width, int firstRow, int lastRow)
+{
+    for (int row = firstRow; row < lastRow; row++)
+        {
+            const uint8_t* y = planes[0] + (ptrdiff_t)row * strides[0];
+            const uint8_t* u = planes[1] + (ptrdiff_t)row * strides[1];
+            const uint8_t* v = planes[2] + (ptrdiff_t)row * strides[2];
+            uint8_t* dst = uyvy + (ptrdiff_t)row * uyvyStride;
+            int x = 0;
+
+#ifdef COLOR_CONVERT_X86
+            if (kernel == kColorConvertAVX512 || kernel == kColorConvertAVX2)
+                x = YUV422PToUYVYRowAVX2(y, u, v, dst, width);
+#endif
+            YUV422PToUYVYRow(y, u, v, dst, x, width);
+        }
+}
+
+void V210ToYUV422P10(ColorConvertKernel kernel, const uint8_t* v210, int v210Stride,
+                     uint8_t* const planes[3], const int strides[3],
+                     int width, int firstRow, int lastRow)
+{
+    for (int row = firstRow; row < lastRow; row++)
+        {
+            const uint8_t* src = v210 + (ptrdiff_t)row * v210Stride;
+            uint16_t* y = (uint16_t*)(planes[0] + (ptrdiff_t)row * strides[0]);
+            uint16_t* u = (uint16_t*)(planes[1] + (ptrdiff_t)row * strides[1]);
+            uint16_t* v = (uint16_t*)(planes[2] + (ptrdiff_t)row * strides[2]);
+            int x = 0;
+
+#ifdef COLOR_CONVERT_X86
+            if (kernel == kColorConvertAVX512 || kernel == kColorConvertAVX2)
+                x = V210ToYUV422P10RowAVX2(src, y, u, v, width);
+#endif
+            V210ToYUV422P10Row(src, y, u, v, x, width);
+        }
+}
+
+void YUV422P10ToV210(ColorConvertKernel kernel, const uint8_t* const planes[3], const int strides[3],
+                     uint8_t* v210, int v210Stride,
+                     int width, int firstRow, int lastRow)
+{
+    for (int row = firstRow; row < lastRow; row++)
+        {
+            const uint16_t* y = (const uint16_t*)(planes[0] + (ptrdiff_t)row * strides[0]);
+            const uint16_t* u = (const uint16_t*)(planes[1] + (ptrdiff_t)row * strides[1]);
+            const uint16_t* v = (const uint16_t*)(planes[2] + (ptrdiff_t)row * strides[2]);
+            uint8_t* dst = v210 + (ptrdiff_t)row * v210Stride;
+            int x = 0;
+
+#ifdef COLOR_CONVERT_X86
+            if (kernel == kColorConvertAVX512 || kernel == kColorConvertAVX2)
+                x = YUV422P10ToV210RowAVX2(y, u, v, dst, width);
+#endif
+            YUV422P10ToV210Row(y, u, v, dst, x, width);
+        }
+}
+
+void YUV422PToBGRA(ColorConvertKernel kernel, const uint8_t* const planes[3], const int strides[3],
+                   uint8_t* bgra, int bgraStride,
+                   int width, int firstRow, int lastRow)
+{
+    for (int row = firstRow; row < lastRow; row++)
+        {
+            const uint8_t* y = planes[0] + (ptrdiff_t)row * strides[0];
+            const uint8_t* u = planes[1] + (ptrdiff_t)row * strides[1];
+            const uint8_t* v = planes[2] + (ptrdiff_t)row * strides[2];
+            uint8_t* dst = bgra + (ptrdiff_t)row * bgraStride;
+            int x = 0;
+
+#ifdef COLOR_CONVERT_X86
+            if (kernel == kColorConvertAVX512)
+                x = YUV422PToBGRARowAVX512(y, u, v, dst, width);
+            else if (kernel == kColorConvertAVX2)
+                x = YUV422PToBGRARowAVX2(y, u, v, dst, width);
+#endif
+            YUV422PToBGRARow(y, u, v, dst, x, width);
+        }
+}
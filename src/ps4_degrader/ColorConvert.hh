@@ -0,0 +1,53 @@
+#ifndef __COLOR_CONVERT_HH__
+#define __COLOR_CONVERT_HH__
+
+#include <cstdint>
+
+// BGRA <-> yuv422p (BT.601, limited range), the two conversions every
+// degraded frame goes through when capturing BGRA, and UYVY <-> yuv422p
+// and v210 <-> yuv422p10, which only move samples between the card's
+// packed layouts and the encoder's planes (plane strides are in bytes
+// either way). The vector kernels give exactly the same bytes as the
+// scalar one and stay within a few levels of swscale. Every function
+// converts a range of rows [firstRow, lastRow), so one frame can be split
+// between threads. width must be even, and the kernel must be one that
+// ColorConvertSupported() accepts on this CPU.
+enum ColorConvertKernel
+{
+    kColorConvertScalar,
+    kColorConvertAVX2,
+    kColorConvertAVX512
+};
+
+bool                ColorConvertSupported(ColorConvertKernel kernel);
+ColorConvertKernel  ColorConvertBestKernel();               // kColorConvertScalar when there is no vector kernel
+const char*         ColorConvertKernelName(ColorConvertKernel kernel);
+
+void    BGRAToYUV422P(ColorConvertKernel kernel, const uint8_t* bgra, int bgraStride,
+                      uint8_t* const planes[3], const int strides[3],
+                      int width, int firstRow, int lastRow);
+void    YUV422PToBGRA(ColorConvertKernel kernel, const uint8_t* const planes[3], const int strides[3],
+                      uint8_t* bgra, int bgraStride,
+                      int width, int firstRow, int lastRow);
+
+void    UYVYToYUV422P(ColorConvertKernel kernel, const uint8_t* uyvy, int uyvyStride,
+                      uint8_t* const planes[3], const int strides[3],
+                      int width, int firstRow, int lastRow);
+void    YUV422PToUYVY(ColorConvertKernel kernel, const uint8_t* const planes[3], const int strides[3],
+                      uint8_t* uyvy, int uyvyStride,
+                      int width, int firstRow, int lastRow);
+
+// v210 packs 6 pixels into 16 bytes and pads each row to 48 pixels
+inline int V210RowBytes(int width)
+{
+    return (width + 47) / 48 * 128;
+}
+
+void    V210ToYUV422P10(ColorConvertKernel kernel, const uint8_t* v210, int v210Stride,
+                        uint8_t* const planes[3], const int strides[3],
+                        int width, int firstRow, int lastRow);
+void    YUV422P10ToV210(ColorConvertKernel kernel, const uint8_t* const planes[3], const int strides[3],
+                        uint8_t* v210, int v210Stride,
+                        int width, int firstRow, int lastRow);
+
+#endif
@@ -25,12 +25,15 @@
 ** -LICENSE-END-
 */
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <pthread.h>
 #include <unistd.h>
+#include <string>
 #include "Config.hh"
+#include "RecordingCodec.hh"
 
 BMDConfig::BMDConfig() :
     m_deckLinkIndex(0),
@@ -39,11 +42,24 @@ BMDConfig::BMDConfig() :
     m_inputFlags(bmdVideoInputFlagDefault),
     m_pixelFormat(bmdFormat8BitBGRA),
     m_framesDelay(0),
+    m_preroll(2),
     m_bitrate(1 << 20),
     m_framerate(2),
     m_quantization(32),
+    m_bands(1),
+    m_bandOverlap(0),
+    m_hugePages(false),
+    m_zeroCopy(false),
+    m_encodedDelay(false),
+    m_recorderEngine(Recorder::Engine::BUFFERED),
+    m_recorderDepth(8),
+    m_recordingCodec(kRecordingRaw),
+    m_afterRecordingCodec(kRecordingRaw),
+    m_recordingWorkers(4),
     m_videoOutputFile(),
     m_logFilename(),
+    m_traceFilename(),
+    m_controlSocket(),
     m_deckLinkName(),
     m_displayModeName()
 {
@@ -63,7 +79,7 @@ bool BMDConfig::ParseArguments(int argc,  char** argv)
     int     ch;
     bool    displayHelp = false;
 
-    while ((ch = getopt(argc, argv, "d:hm:p:l:D:b:f:q:B:A:")) != -1)
+    while ((ch = getopt(argc, argv, "d:hm:p:l:D:r:b:f:q:B:A:t:HzES:c:w:Z:")) != -1)
     {
         switch (ch)
         {
@@ -99,6 +115,9 @@ bool BMDConfig::ParseArguments(int argc,  char** argv)
 	    case 'D':
 	      m_framesDelay = atoi(optarg);
 	      break;
+	    case 'r':
+	      m_preroll = atoi(optarg);
+	      break;
 	    case 'b':
 	      m_bitrate = atoi(optarg);
 	      break;
@@ -114,6 +133,73 @@ bool BMDConfig::ParseArguments(int argc,  char** argv)
 	    case 'A':
 	      m_afterFilename = optarg;
 	      break;
+	    case 't':
+	      m_traceFilename = optarg;
+	      break;
+	    case 'H':
+	      m_hugePages = true;
+	      break;
+	    case 'z':
+	      m_zeroCopy = true;
+	      break;
+	    case 'E':
+	      m_encodedDelay = true;
+	      break;
+	    case 'S':
+	      if (sscanf(optarg, "%d:%d", &m_bands, &m_bandOverlap) < 1 || m_bands < 1 || m_bandOverlap < 0)
+	      {
+	          fprintf(stderr, "Invalid argument: -S takes <bands>[:<overlap rows>]\n");
+	          return false;
+	      }
+	      break;
+	    case 'c':
+	      m_controlSocket = optarg;
+	      break;
+	    case 'w':
+	      {
+	          std::string engine(optarg);
+	          const size_t colon = engine.find(':');
+	          if (colon != std::string::npos)
+	          {
+	              m_recorderDepth = atoi(engine.c_str() + colon + 1);
+	              engine.resize(colon);
+	          }
+
+	          try {
+	              m_recorderEngine = Recorder::engine_from_name(engine);
+	          } catch (const std::exception& e) {
+	              fprintf(stderr, "Invalid argument: %s\n", e.what());
+	              return false;
+	          }
+	          if (m_recorderDepth < 1)
+	          {
+	              fprintf(stderr, "Invalid argument: -w takes <engine>[:<queue depth>]\n");
+	              return false;
+	          }
+	      }
+	      break;
+	    case 'Z':
+	      {
+	          std::string codec(optarg);
+	          const size_t colon = codec.find(':');
+	          if (colon != std::string::npos)
+	          {
+	              m_recordingWorkers = atoi(codec.c_str() + colon + 1);
+	              codec.resize(colon);
+	          }
+	          const size_t comma = codec.find(',');
+	          const std::string after = comma != std::string::npos ? codec.substr(comma + 1) : codec;
+	          codec.resize(std::min(comma, codec.size()));
+
+	          if (!RecordingCodecFromName(codec.c_str(), &m_recordingCodec) ||
+	              !RecordingCodecFromName(after.c_str(), &m_afterRecordingCodec) ||
+	              m_recordingCodec == kRecordingH264 || m_recordingWorkers < 1)
+	          {
+	              fprintf(stderr, "Invalid argument: -Z takes raw or ffv1[,raw|ffv1|h264][:<workers>]\n");
+	              return false;
+	          }
+	      }
+	      break;
         }
     }
 
@@ -132,6 +218,18 @@ bool BMDConfig::ParseArguments(int argc,  char** argv)
     if (displayHelp)
         DisplayUsage(0);
 
+    // a band has no bitstream of the whole frame to record, or to hold
+    if (m_afterRecordingCodec == kRecordingH264 && m_bands > 1)
+    {
+        fprintf(stderr, "Invalid argument: an h264 -A recording cannot be made with -S\n");
+        return false;
+    }
+    if (m_encodedDelay && m_bands > 1)
+    {
+        fprintf(stderr, "Invalid argument: -E cannot be used with -S\n");
+        return false;
+    }
+
     // Get device and display mode names
     IDeckLink* deckLink = GetDeckLink(m_deckLinkIndex);
     if (deckLink != NULL)
@@ -304,7 +402,7 @@ void BMDConfig::DisplayUsage(int status)
     {
         result = deckLinkAttributes->GetFlag(BMDDeckLinkSupportsInputFormatDetection, &formatDetectionSupported);
         if (result == S_OK && formatDetectionSupported)
-            fprintf(stderr, "        -1:  auto detect format\n");
+            fprintf(stderr, "        -1:  auto detect format, and follow the source when it changes\n");
     }
 
     result = deckLinkSelected->QueryInterface(IID_IDeckLinkInput, (void**)&deckLinkInput);
@@ -344,18 +442,64 @@ void BMDConfig::DisplayUsage(int status)
 bail:
     fprintf(stderr,
         "    -p <pixelformat>\n"
-        "         0:  8 bit YUV (4:2:2) (default)\n"
-        "         1:  10 bit YUV (4:2:2)\n"
+        "         0:  8 bit YUV (4:2:2), degraded without any colour conversion\n"
+        "         1:  10 bit YUV (4:2:2), degraded at 10 bits\n"
         "         2:  10 bit RGB (4:4:4)\n"
-        "         3:  8 bit BGRA (4:4:4:x)\n"
+        "         3:  8 bit BGRA (4:4:4:x) (default)\n"
         "         4:  8 bit ARGB (4:4:4:4)\n"
         "    -v <filename>        Filename raw video will be written to\n"
         "    -n <frames>          Number of frames to capture (default is unlimited)\n"
+        "    -r <slots>           Schedule output this many frame slots ahead of the display (default 2)\n"
+        "    -t <filename>        Write a binary timing trace (read it with trace_report)\n"
+        "    -H                   Back the frame pool with 2 MB huge pages and mlock it\n"
+        "    -z                   Retain input frames instead of copying them (zero-copy capture)\n"
+        "    -E                   Hold the frames of the delay (-D) as the degrader's encoded access\n"
+        "                         units, decoding each just before it is due, so a long delay takes\n"
+        "                         a few MB rather than a frame each (but -B still keeps every\n"
+        "                         frame until it is recorded); not with -S\n"
+        "    -S <bands>[:<rows>]  Degrade each frame as this many horizontal bands on separate cores,\n"
+        "                         each coded with <rows> of its neighbours to hide the seams (default 1)\n"
+        "    -B <filename>        Record every frame as captured,\n"
+        "    -A <filename>        and as degraded and played out; both or neither (see below)\n"
+        "    -c <path>            Take setting changes on this UNIX socket while running (see below)\n"
+        "    -w <engine>[:<depth>] Write the -B and -A recordings with this engine, with up to <depth>\n"
+        "                         4 MB writes in flight (default buffered:8)\n"
+        "         buffered:  through the page cache, dropping what has been written from it\n"
+        "         direct:    O_DIRECT, from <depth> threads\n"
+        "         io_uring:  O_DIRECT, from registered buffers through one io_uring\n"
+        "    -Z <codec>[,<codec>][:<workers>] Code the -B and -A frames before writing them, each on\n"
+        "                         its own, on this many threads; the second codec is for -A (default\n"
+        "                         raw; 4 workers)\n"
+        "         raw:       as they are\n"
+        "         ffv1:      losslessly with FFV1; not for 10 bit RGB\n"
+        "         h264:      -A only: the degrader's own bitstream, with a checksum of each frame\n"
         "\n"
         "Capture video to a file. Raw video can be viewed with mplayer eg:\n"
         "\n"
         "    Capture -d 0 -m 2 -n 50 -v video.raw\n"
         "    mplayer video.raw -demuxer rawvideo -rawvideo h=1280:w=720:format=bgra:fps=60\n"
+        "\n"
+        "With -p 0 the files are UYVY; use format=uyvy instead. With -p 1 they are\n"
+        "v210, with each row padded to a multiple of 48 pixels.\n"
+        "\n"
+        "The -B and -A recordings index each frame with its id and capture and display\n"
+        "times, and entry i of one pairs with entry i of the other. recording_report\n"
+        "summarises a pair, and extracts frames to view them the same way, eg:\n"
+        "\n"
+        "    recording_report -x 0:600 after.rec | mplayer - -demuxer rawvideo ...\n"
+        "\n"
+        "Coded recordings are extracted as the frames they were coded from. The\n"
+        "compression ratio and the CPU the workers took are printed at the end; if\n"
+        "they cannot keep up, playback runs short of output frames and drops them.\n"
+        "An h264 -A recording is a fraction of the size, and is decoded again to\n"
+        "extract it; recording_report -v checks every frame comes back as played out.\n"
+        "\n"
+        "With -c, each connection sends lines of \"d|f|b|q <value>\", meaning the same\n"
+        "as -D, -f, -b and -q, applied together once it closes its end, eg:\n"
+        "\n"
+        "    printf 'b 2000000\\nq 28\\n' | nc -NU /tmp/degrader.sock\n"
+        "\n"
+        "The reply is the settings now in force. Playback carries on throughout.\n"
     );
 
     if (deckLinkIterator != NULL)
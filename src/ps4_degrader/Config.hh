@@ -29,6 +29,8 @@
 #define BMD_CONFIG_H
 
 #include "DeckLinkAPI.h"
+#include "recorder.hh"
+#include "Recording.hh"
 
 class BMDConfig
 {
@@ -49,12 +51,25 @@ public:
     BMDPixelFormat          m_pixelFormat;
 
     int                     m_framesDelay;
+    int                     m_preroll;
     int                     m_bitrate;
     int                     m_framerate;
     int                     m_quantization;
+    int                     m_bands;
+    int                     m_bandOverlap;
+    bool                    m_hugePages;
+    bool                    m_zeroCopy;
+    bool                    m_encodedDelay;
+    Recorder::Engine        m_recorderEngine;
+    int                     m_recorderDepth;
+    RecordingCodec          m_recordingCodec;       // of -B, and of -A unless given its own
+    RecordingCodec          m_afterRecordingCodec;
+    int                     m_recordingWorkers;
 
     const char*             m_videoOutputFile;
     const char*             m_logFilename;
+    const char*             m_traceFilename;
+    const char*             m_controlSocket;
   
     char*                   m_beforeFilename;
     char*                   m_afterFilename;
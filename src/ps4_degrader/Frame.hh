@@ -0,0 +1,68 @@
+#ifndef __FRAME_HH__
+#define __FRAME_HH__
+
+#include <chrono>
+#include <cstdint>
+
+#include "DeckLinkAPI.h"
+#include "frame_pool.hh"
+
+/* frames the recorder may fall behind by before frames start being dropped */
+const uint32_t record_backlog_frames = 32;
+
+/* output frames: enough for the few frames queued on the card plus the recorder backlog */
+const uint32_t output_frame_count = record_backlog_frames + 8;
+
+/* frames each degrade pipeline stage may hold (being worked on or queued for the next stage) */
+const uint32_t pipeline_depth = 2;
+
+// Everything we learn about one frame on its way from capture to the
+// display. It travels with the pixels (in the CapturedFrame, then the
+// OutputFrame) and each stage fills in its own fields, so no lock or side
+// queue is needed to match timings to frames. Hardware times are DeckLink
+// reference clock microseconds.
+struct FrameRecord
+{
+    uint64_t        id;
+    BMDTimeValue    captureHardwareTime;
+    std::chrono::high_resolution_clock::time_point captureTime;
+    std::chrono::high_resolution_clock::time_point dequeueTime;    // taken off the capture ring
+    std::chrono::microseconds convertToTime;
+    std::chrono::microseconds degradeTime;
+    std::chrono::microseconds convertFromTime;
+    BMDTimeValue    scheduledHardwareTime;      // start of the slot it was aimed at
+    BMDTimeValue    completionHardwareTime;
+    BMDOutputFrameCompletionResult completionResult;
+
+    FrameRecord() : id(0), captureHardwareTime(0), captureTime(), dequeueTime(),
+                    convertToTime(0), degradeTime(0), convertFromTime(0),
+                    scheduledHardwareTime(0), completionHardwareTime(0),
+                    completionResult(bmdOutputFrameCompleted) {}
+};
+
+// A captured frame as handed from the capture callback to playback: the
+// buffer holding its pixels plus its record. The pixels either live in a
+// FramePool buffer (inputFrame == NULL) or are the retained DeckLink
+// input frame itself.
+struct CapturedFrame
+{
+    uint8_t*        bytes;
+    IDeckLinkVideoInputFrame* inputFrame;
+    FrameRecord     record;
+
+    CapturedFrame() : bytes(NULL), inputFrame(NULL), record() {}
+};
+
+// Hand a captured frame's pixels back to whoever owns them.
+inline void ReleaseCapturedFrame(CapturedFrame& frame, FramePool& framePool)
+{
+    if (frame.inputFrame != NULL)
+        frame.inputFrame->Release();
+    else
+        framePool.release(frame.bytes);
+
+    frame.bytes = NULL;
+    frame.inputFrame = NULL;
+}
+
+#endif
@@ -0,0 +1,80 @@
+#include <cassert>
+#include <stdexcept>
+
+#include "OutputFramePool.hh"
+
+OutputFramePool::OutputFramePool(IDeckLinkOutput* deckLinkOutput, long width, long height,
+                                 long rowBytes, BMDPixelFormat pixelFormat, uint32_t frameCount) :
+    m_frameCount(frameCount),
+    m_frames(new OutputFrame[frameCount]),
+    m_free(),
+    m_mutex(),
+    m_exhaustedCount(0)
+{
+    m_free.reserve(frameCount);
+
+    for (uint32_t i = 0; i < frameCount; i++)
+        {
+            OutputFrame& entry = m_frames[i];
+            void* bytes = NULL;
+
+            if (deckLinkOutput->CreateVideoFrame(width, height, rowBytes, pixelFormat,
+                                                 bmdFrameFlagDefault, &entry.frame) != S_OK)
+                {
+                    while (i-- > 0)
+                        m_frames[i].frame->Release();
+                    throw std::runtime_error("OutputFramePool: failed to create video frame");
+                }
+
+            entry.frame->GetBytes(&bytes);
+            entry.bytes = (uint8_t*)bytes;
+            m_free.push_back(&entry);
+        }
+}
+
+OutputFramePool::~OutputFramePool()
+{
+    for (uint32_t i = 0; i < m_frameCount; i++)
+        {
+            if (m_frames[i].frame != NULL)
+                m_frames[i].frame->Release();
+        }
+}
+
+OutputFrame* OutputFramePool::Acquire()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+
+    if (m_free.empty())
+        {
+            m_exhaustedCount++;
+            return NULL;
+        }
+
+    OutputFrame* frame = m_free.back();
+    m_free.pop_back();
+    frame->inUse = true;
+    return frame;
+}
+
+void OutputFramePool::Release(OutputFrame* frame)
+{
+    if (frame == NULL)
+        return;
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+
+    assert(frame->inUse);
+    frame->inUse = false;
+    m_free.push_back(frame);
+}
+
+OutputFrame* OutputFramePool::Find(IDeckLinkVideoFrame* frame)
+{
+    for (uint32_t i = 0; i < m_frameCount; i++)
+        {
+            if (m_frames[i].frame == frame)
+                return &m_frames[i];
+        }
+    return NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef __OUTPUT_FRAME_POOL_HH__
+#define __OUTPUT_FRAME_POOL_HH__
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "Frame.hh"
+
+// A DeckLink output frame that is reused instead of being created per
+// frame. It is "in use" from Acquire() to Release(), held by one thing at
+// a time: its pending schedule on the card, then the recorder. record
+// belongs to the frame it currently shows, and source is the captured
+// frame it was degraded from, kept for the recorder until the card is done
+// with it. accessUnits is the after recording's payload when it takes
+// access units rather than pixels.
+struct OutputFrame
+{
+    IDeckLinkMutableVideoFrame* frame;
+    uint8_t*                    bytes;
+    bool                        inUse;
+    FrameRecord                 record;
+    CapturedFrame               source;
+    std::vector<uint8_t>        accessUnits;
+
+    OutputFrame() : frame(NULL), bytes(NULL), inUse(false), record(), source(), accessUnits() {}
+
+    OutputFrame(const OutputFrame&) = delete;
+    OutputFrame& operator=(const OutputFrame&) = delete;
+};
+
+// Fixed set of output frames created once when playback starts. Frames go
+// back on the free list when released, which normally happens once the
+// recorder has written them.
+class OutputFramePool
+{
+public:
+    OutputFramePool(IDeckLinkOutput* deckLinkOutput, long width, long height,
+                    long rowBytes, BMDPixelFormat pixelFormat, uint32_t frameCount);
+    ~OutputFramePool();
+
+    OutputFrame*    Acquire();                      // NULL when every frame is in use
+    void            Release(OutputFrame* frame);
+
+    // map a frame handed back by the driver to its pool entry
+    OutputFrame*    Find(IDeckLinkVideoFrame* frame);
+
+    uint32_t        Capacity() const { return m_frameCount; }
+    uint64_t        ExhaustedCount() const { return m_exhaustedCount; }
+
+    OutputFramePool(const OutputFramePool&) = delete;
+    OutputFramePool& operator=(const OutputFramePool&) = delete;
+
+private:
+    uint32_t                        m_frameCount;
+    std::unique_ptr<OutputFrame[]>  m_frames;
+    std::vector<OutputFrame*>       m_free;
+    std::mutex                      m_mutex;
+    uint64_t                        m_exhaustedCount;
+};
+
+#endif
@@ -53,11 +53,13 @@
 #include <utility>
 #include <random>
 #include <memory>
+#include <functional>
 #include "Playback.hh"
 #include "exception.hh"
 #include "chunk.hh"
 #include "child_process.hh"
 #include "system_runner.hh"
+#include "TracePoints.hh"
 
 #include "h264_degrader.hh"
 
@@ -66,12 +68,8 @@ using std::chrono::high_resolution_clock;
 using std::chrono::time_point_cast;
 using std::chrono::microseconds;
 
-extern std::list<high_resolution_clock::time_point> delay_queue;
-
 const BMDTimeScale ticks_per_second = (BMDTimeScale)1000000; /* microsecond resolution */
 
-void* frameBytes = NULL;
-
 pthread_mutex_t         sleepMutex;
 pthread_cond_t          sleepCond;
 bool                    do_exit = false;
@@ -83,48 +81,88 @@ const uint64_t prefetch_block_size = 1 << 28; // 0.25 GB
 const unsigned long     kAudioWaterlevel = 48000;
 // std::ofstream debugf;
 
-size_t frame_number = 0;
-size_t preroll = 30;
-BMDTimeValue prev_decklink_frame_completed_timestamp;
-BMDTimeValue prev_decklink_hardware_timestamp;
-
-const size_t width = 1280;
-const size_t height = 720;
-const size_t bytes_per_pixel = 4;
-const size_t frame_size = width*height*bytes_per_pixel;
-const AVPixelFormat pix_fmt = AV_PIX_FMT_YUV422P;
 
+// the planes each capture format is degraded in
+static AVPixelFormat GetDegradePixelFormat(BMDPixelFormat pixelFormat)
+{
+    return pixelFormat == bmdFormat10BitYUV ? AV_PIX_FMT_YUV422P10 : AV_PIX_FMT_YUV422P;
+}
 
-static uint8_t *previousFrame = new uint8_t[frame_size];
-std::thread runner;
 
 Playback::~Playback()
 {
-    this->end = true;
+    Stop();
 
+    for (std::thread* stage : { &m_convertThread, &m_degradeThread, &m_outputThread })
+        if (stage->joinable())
+            stage->join();
     t.join();
-    runner.join();
 
-    close(beforeFile);
-    close(afterFile);
+    if (m_compressor != NULL)
+        {
+            m_compressor->Finish();
+            const RecordingCompressor::Stats stats = m_compressor->GetStats();
+            if (stats.frames > 0)
+                fprintf(stderr, "Playback: recorded %lu frames with %s, %.0f MB into %.0f MB (%.1f:1), "
+                        "%.1f ms CPU a frame, %.1f of %u workers busy, at most %lu frames queued, %lu errors\n",
+                        (unsigned long)stats.frames, RecordingCodecName(m_compressor->Codec()),
+                        stats.rawBytes / 1e6, stats.codedBytes / 1e6, (double)stats.rawBytes / std::max<uint64_t>(stats.codedBytes, 1),
+                        stats.cpuSeconds * 1e3 / stats.frames, stats.cpuSeconds / stats.seconds, stats.workers,
+                        (unsigned long)stats.maxQueued, (unsigned long)stats.errors);
+            delete m_compressor;
+        }
+
+    // frames still in the pipeline go back to capture's pools (retained
+    // input frames to the driver), and hold on to their access units
+    PipelineFrame unfinished;
+    while (m_toDegrade.pop(unfinished))
+        ReleaseCapturedFrame(unfinished.captured, m_framePool);
+    for (PipelineFrame& degrading : m_degrading)
+        ReleaseCapturedFrame(degrading.captured, m_framePool);
+    m_degrading.clear();
+    while (m_toOutput.pop(unfinished))
+        {
+            ReleaseCapturedFrame(unfinished.captured, m_framePool);
+            av_packet_free(&unfinished.accessUnit);
+        }
 
-    delete degrader;
-    delete previousFrame;
+    // the writer may have finished before the card flushed its last frames
+    OutputFrame* unrecorded;
+    while (m_toRecord.pop(unrecorded))
+        {
+            ReleaseCapturedFrame(unrecorded->source, m_framePool);
+            m_outputFrames->Release(unrecorded);
+        }
+
+    // before the pools: a degrader may still hold frames from them
+    degrader.reset();
+    m_nextDegrader.reset();
+    m_retiring.reset();
+    FreeRetiredDegraders();
+    delete m_outputFrames;
+    delete m_encodeFrames;
+    delete m_decodedFrames;
 }
 
 Playback::Playback(int m_deckLinkIndex,
-                   int m_displayModeIndex,
+                   BMDDisplayMode m_displayModeId,
                    BMDVideoOutputFlags m_outputFlags,
                    BMDPixelFormat m_pixelFormat,
                    const char* m_videoInputFile,
-                   std::list<uint8_t*> &output,
-                   std::mutex &output_mutex,
+                   SPSCRing<CapturedFrame> &output,
+                   EventFD &frameReady,
+                   FramePool &framePool,
                    int frame_rate,
                    int framesDelay,
+                   int preroll,
                    int bitrate,
                    int quantization,
-                   char* beforeFilename,
-                   char* afterFilename) :
+                   int bands,
+                   int bandOverlap,
+                   bool encodedDelay,
+                   RecordingWriter* beforeRecording,
+                   RecordingWriter* afterRecording,
+                   int recordingWorkers) :
                                           end(false),
                                           m_refCount(1),
                                           m_running(false),
@@ -138,84 +176,215 @@ Playback::Playback(int m_deckLinkIndex,
                                           m_framesPerSecond(0),
                                           m_totalFramesScheduled(0),
                                           m_totalFramesDropped(0),
+                                          m_totalFramesLate(0),
                                           m_totalFramesCompleted(0),
+                                          m_preroll(preroll > 0 ? preroll : 1),
+                                          m_slotsPerFrame(1),
+                                          m_streamOrigin(0),
+                                          m_nextSlot(0),
                                           m_deckLinkIndex(m_deckLinkIndex),
-                                          m_displayModeIndex(m_displayModeIndex),
+                                          m_displayModeId(m_displayModeId),
                                           m_outputFlags(m_outputFlags),
                                           m_pixelFormat(m_pixelFormat),
+                                          m_frameBytes(0),
                                           m_videoInputFile(m_videoInputFile),
+                                          m_bitrate(bitrate),
+                                          m_quantization(quantization),
+                                          m_bands(bands > 0 ? bands : 1),
+                                          m_bandOverlap(bandOverlap > 0 ? bandOverlap : 0),
+                                          m_encodedDelay(encodedDelay),
                                           output(output),
-                                          output_mutex(output_mutex),
-                                          record(),
-                                          t(&Playback::WriteToDisk, this),
+                                          m_frameReady(frameReady),
+                                          m_controlEvent(),
+                                          degrader(),
+                                          m_nextDegrader(),
+                                          m_retiring(),
+                                          m_retiringFrames(0),
+                                          m_retiredMutex(),
+                                          m_retired(),
+                                          m_degraderStream(0),
+                                          m_retiringStream(0),
+                                          m_settingsMutex(),
+                                          m_settingsChanged(false),
+                                          m_encodeFrames(NULL),
+                                          m_decodedFrames(NULL),
+                                          m_toDegrade(pipeline_depth),
+                                          m_degrading(),
+                                          m_toOutput(pipeline_depth),
+                                          m_degradeReady(),
+                                          m_outputReady(),
+                                          m_convertThread(),
+                                          m_degradeThread(),
+                                          m_outputThread(),
+                                          m_framePool(framePool),
+                                          m_outputFrames(NULL),
+                                          m_toRecord(output_frame_count),
+                                          m_recordReady(),
+                                          t(),
                                           m_logfile(),
+                                          m_beforeRecording(beforeRecording),
+                                          m_afterRecording(afterRecording),
+                                          m_compressor(NULL),
+                                          m_recordUnits(afterRecording != NULL && afterRecording->Codec() == kRecordingH264),
+                                          m_lastStream(UINT64_MAX),
+                                          m_unrecordedUnits(),
+                                          m_unrecordedCount(0),
                                           scheduled_timestamp_cpu(),
                                           scheduled_timestamp_decklink(),
-                                          framesDelay(framesDelay),
-                                          frame_rate(frame_rate)
+                                          frame_rate(frame_rate),
+                                          framesDelay(framesDelay)
 {
-    degrader = new H264_degrader(width, height, bitrate, quantization);
+    // the degrader is built in StartRunning, once the display mode gives
+    // the frame size; the writer is started last so the writer sees a fully constructed object
+    if (beforeRecording != NULL && afterRecording != NULL &&
+        (beforeRecording->Codec() == kRecordingFFV1 || afterRecording->Codec() == kRecordingFFV1))
+        m_compressor = new RecordingCompressor(*beforeRecording, *afterRecording, recordingWorkers,
+                                               [this](void* frame) { ReleaseRecorded(static_cast<OutputFrame*>(frame)); });
+    t = std::thread(&Playback::WriteToDisk, this);
+}
 
-    beforeFile = open(beforeFilename, O_WRONLY|O_CREAT|O_TRUNC, 0664);
-    if (beforeFile < 0) {
-        std::cout << "Could not open file: " << beforeFilename << "\n";
-        exit(1);
+void Playback::Stop()
+{
+    this->end = true;
+    m_recordReady.signal();
+    m_frameReady.signal();
+    m_degradeReady.signal();
+    m_outputReady.signal();
+    m_controlEvent.signal();
+}
+
+void Playback::ChangeDegrader(int bitrate, int quantization)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_settingsMutex);
+        m_bitrate = bitrate;
+        m_quantization = quantization;
+        m_settingsChanged = true;
     }
+    m_controlEvent.signal();
+}
 
-    afterFile = open(afterFilename, O_WRONLY|O_CREAT|O_TRUNC, 0664);
-    if (afterFile < 0) {
-        std::cout << "Could not open file: " << afterFilename << "\n";
-        exit(1);
+// A degrader for the current mode, whose results wake the degrade stage.
+// With an encoded delay line it holds the frames back itself, as many as
+// the convert stage would have waited for, and hands each input frame
+// straight back once it is encoded.
+std::shared_ptr<H264_degrader> Playback::CreateDegrader(int bitrate, int quantization)
+{
+    const size_t packetDelay = m_encodedDelay ? std::max(framesDelay.load() - 1, 0) : 0;
+    std::shared_ptr<H264_degrader> created(new H264_degrader(m_frameWidth, m_frameHeight, bitrate, quantization, pipeline_depth, 0,
+                                                             GetDegradePixelFormat(m_pixelFormat), m_framesPerSecond,
+                                                             m_bands, m_bandOverlap, packetDelay),
+                                           [this](H264_degrader* retired) { RetireDegrader(retired); });
+    created->result_callback = [this]() { m_degradeReady.signal(); };
+    created->keep_packets = m_recordUnits;
+    if (m_encodedDelay)
+        created->input_released = [this](AVFrame* input) {
+            m_encodeFrames->Release(input);
+            m_frameReady.signal();
+        };
+    return created;
+}
+
+// Run thread: build a degrader for the latest settings and leave it for
+// the degrade stage to pick up. One still waiting there has not seen a
+// frame yet, and is simply replaced.
+void Playback::RebuildDegrader()
+{
+    int bitrate, quantization;
+    {
+        std::lock_guard<std::mutex> guard(m_settingsMutex);
+        if (!m_settingsChanged)
+            return;
+        m_settingsChanged = false;
+        bitrate = m_bitrate;
+        quantization = m_quantization;
+    }
+
+    const uint64_t start = Trace::now();
+    std::shared_ptr<H264_degrader> created = CreateDegrader(bitrate, quantization);
+    fprintf(stderr, "Playback: degrader for bitrate %d, quantization %d built in %.1f ms\n",
+            bitrate, quantization, (Trace::now() - start) / 1e6);
+
+    std::atomic_store(&m_nextDegrader, created);
+    m_degradeReady.signal();
+}
+
+// Deleter of every degrader, on whichever thread let go of it last: the
+// freeing (and the joining of its threads) is left to the Run thread
+void Playback::RetireDegrader(H264_degrader* retired)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_retiredMutex);
+        m_retired.push_back(retired);
+    }
+    m_controlEvent.signal();
+}
+
+// Run thread, and the destructor once the pipeline has stopped
+void Playback::FreeRetiredDegraders()
+{
+    std::vector<H264_degrader*> retired;
+    {
+        std::lock_guard<std::mutex> guard(m_retiredMutex);
+        retired.swap(m_retired);
     }
+    for (H264_degrader* unreferenced : retired)
+        delete unreferenced;
 }
 
+// Record each frame the card is done with, the captured frame with its
+// degraded version, indexed by its record. The recorder copies them and
+// writes them out on its own threads; to code them first, they are handed
+// to the compressor, which gives them back once they are recorded.
 void Playback::WriteToDisk()
 {
-    bool first = true;
-    uint8_t *beforeFrame = NULL, *afterFrame = NULL;
-    uint8_t *beforeFrameTmp = NULL;
-    while(true) {
-        int rec_size;
-        {
-            std::lock_guard<std::mutex> rec_guard(record_mutex);
-            rec_size = record.size();
+    OutputFrame* frame;
+
+    while (true) {
+        if (!m_toRecord.pop(frame)) {
+            if (this->end)
+                break;
+            m_recordReady.wait();
+            continue;
         }
-        if (rec_size > 0) {
-            {
-                std::lock_guard<std::mutex> rec_guard(record_mutex);
-                beforeFrameTmp = record.front().first;
-                afterFrame = record.front().second;
-                record.pop();
-            }
 
-            if(!first){
-                size_t ret = write(beforeFile, beforeFrame, frame_size);
-                if (ret < 0) {
-                    std::cout << "Cannot write to first file\n";
-                }
-                ret = write(afterFile, afterFrame, frame_size);
-                if (ret < 0) {
-                    std::cout << "Cannot write to second file\n";
-                }
-                delete[] beforeFrame;
-                delete[] afterFrame;
-            }
-            else{
-                first = false;
-                delete[] afterFrame;
-            }
-            beforeFrame = beforeFrameTmp;
+        // the after payload: the frame played out, or the units it was
+        // decoded from with a checksum of it
+        const uint8_t* after = frame->bytes;
+        size_t afterSize = m_frameBytes;
+        if (m_recordUnits) {
+            const uint64_t checksum = RecordingChecksum(frame->bytes, m_frameBytes);
+            memcpy(frame->accessUnits.data() + offsetof(RecordingUnitsHeader, checksum), &checksum, sizeof(checksum));
+            after = frame->accessUnits.data();
+            afterSize = frame->accessUnits.size();
         }
-        else {
-            usleep(1000);
-            if(this->end){
-                delete[] beforeFrameTmp;
-                break;
-            }
+
+        if (m_compressor != NULL) {
+            m_compressor->Submit(frame->record, m_frameWidth, m_frameHeight, frame->source.bytes, m_frameBytes,
+                                 after, afterSize, frame);
+            continue;
         }
+
+        if (m_beforeRecording != NULL && m_afterRecording != NULL) {
+            TraceSpan span(kTraceRecord, frame->record.id);
+            m_beforeRecording->Append(frame->record, m_frameWidth, m_frameHeight, frame->source.bytes, m_frameBytes);
+            m_afterRecording->Append(frame->record, m_frameWidth, m_frameHeight, after, afterSize);
+            Trace::event(kTraceRecordDepth, frame->record.id, m_afterRecording->GetRecorder().stats().in_flight);
+        }
+
+        ReleaseRecorded(frame);
     }
 }
 
+void Playback::ReleaseRecorded(OutputFrame* frame)
+{
+    ReleaseCapturedFrame(frame->source, m_framePool);
+    m_outputFrames->Release(frame);
+
+    // the output stage may be waiting for an output frame
+    m_outputReady.signal();
+}
+
 bool Playback::Run()
 {
     HRESULT                         result;
@@ -265,25 +434,23 @@ bool Playback::Run()
     if (m_deckLink->QueryInterface(IID_IDeckLinkOutput, (void**)&m_deckLinkOutput) != S_OK)
         goto bail;
 
-    // Get the display mode
-    idx = m_displayModeIndex;
-
+    // Get the display mode the input is running in
     result = m_deckLinkOutput->GetDisplayModeIterator(&displayModeIterator);
     if (result != S_OK)
         goto bail;
 
     while((result = displayModeIterator->Next(&m_displayMode)) == S_OK)
         {
-            if (idx == 0)
+            if (m_displayMode->GetDisplayMode() == m_displayModeId)
                 break;
-            --idx;
 
             m_displayMode->Release();
         }
 
     if (result != S_OK || m_displayMode == NULL)
         {
-            fprintf(stderr, "Unable to get display mode %d\n", m_displayModeIndex);
+            fprintf(stderr, "The output does not support the input's display mode\n");
+            m_displayMode = NULL;
             goto bail;
         }
 
@@ -292,7 +459,7 @@ bool Playback::Run()
     if (result != S_OK)
         {
             displayModeName = (char *)malloc(32);
-            snprintf(displayModeName, 32, "[index %d]", m_displayModeIndex);
+            snprintf(displayModeName, 32, "[mode %08x]", (unsigned)m_displayModeId);
         }
 
     if (m_videoInputFile == NULL) {
@@ -308,11 +475,19 @@ bool Playback::Run()
     // Start
     StartRunning();
 
-    while ( !this->end ) { 
-        usleep(1000);
+    // Everything slow about a settings change happens on this thread
+    while ( !this->end ) {
+        m_controlEvent.wait();
+        if (m_running && !this->end) {
+            RebuildDegrader();
+            FreeRetiredDegraders();
+        }
     }
 
-    m_running = false;
+    for (std::thread* stage : { &m_convertThread, &m_degradeThread, &m_outputThread })
+        if (stage->joinable())
+            stage->join();
+    StopRunning();
 
  bail:
     if (displayModeName != NULL)
@@ -351,6 +526,8 @@ const char* Playback::GetPixelFormatName(BMDPixelFormat pixelFormat)
             return "10 bit YUV (4:2:2)";
         case bmdFormat10BitRGB:
             return "10 bit RGB (4:4:4)";
+        case bmdFormat8BitBGRA:
+            return "8 bit BGRA (4:4:4:x)";
         }
     return "unknown";
 }
@@ -365,9 +542,8 @@ void Playback::StartRunning()
 
     // Calculate the number of frames per second, rounded up to the nearest integer.  For example, for NTSC (29.97 FPS), framesPerSecond == 30.
     m_framesPerSecond = (unsigned long)((m_frameTimescale + (m_frameDuration-1))  /  m_frameDuration);
-    assert(m_framesPerSecond == 60);
-    m_framesPerSecond = 60;
-    std::cout << "m_framesPerSecond: "  << m_framesPerSecond << std::endl;
+    m_frameBytes = GetRowBytes(m_pixelFormat, m_frameWidth) * m_frameHeight;
+    fprintf(stderr, "Playback: %lux%lu at %lu fps\n", m_frameWidth, m_frameHeight, m_framesPerSecond);
 
     // Set the video output mode
     result = m_deckLinkOutput->EnableVideoOutput(m_displayMode->GetDisplayMode(), m_outputFlags);
@@ -377,23 +553,66 @@ void Playback::StartRunning()
             goto bail;
         }
 
-    // Begin video preroll by scheduling a second of frames in hardware
+    {
+        // covers settings changed before we got this far, too
+        std::lock_guard<std::mutex> guard(m_settingsMutex);
+        degrader = CreateDegrader(m_bitrate, m_quantization);
+        m_settingsChanged = false;
+    }
+
+    // Output frames are created once and recycled from ScheduledFrameCompleted;
+    // the YUV frames between stages are recycled by the stages themselves
+    try {
+        m_outputFrames = new OutputFramePool(m_deckLinkOutput, m_frameWidth, m_frameHeight,
+                                             GetRowBytes(m_pixelFormat, m_frameWidth),
+                                             m_pixelFormat, output_frame_count);
+        m_encodeFrames = new AVFramePool(m_frameWidth, m_frameHeight, GetDegradePixelFormat(m_pixelFormat), 2 * pipeline_depth);
+        // held in the degraders for as long as the delay, the longest the
+        // queues were sized for, in an old and a new one at a change
+        if (m_encodedDelay)
+            m_decodedFrames = new AVFramePool(m_frameWidth, m_frameHeight, GetDegradePixelFormat(m_pixelFormat),
+                                              2 * pipeline_depth + 2 * output.capacity(), false);
+        else
+            m_decodedFrames = new AVFramePool(m_frameWidth, m_frameHeight, GetDegradePixelFormat(m_pixelFormat), 2 * pipeline_depth);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        goto bail;
+    }
+
+    // Nothing is prerolled: frames are scheduled as they come out of the
+    // degrader, each for the earliest slot it can still make
     m_totalFramesScheduled = 0;
     m_totalFramesDropped = 0;
+    m_totalFramesLate = 0;
     m_totalFramesCompleted = 0;
-    
-    runner = std::move(std::thread(
-                                   [this](){ 
-                                       while(!this->end){
-                                           ScheduleNextFrame(false);
-                                           usleep(5000);
-                                       }
-                                   }
-                                   ));
-    
-    m_deckLinkOutput->StartScheduledPlayback(0, m_frameTimescale, 1.0);
+
+    result = m_deckLinkOutput->StartScheduledPlayback(0, m_frameTimescale, 1.0);
+    if (result != S_OK)
+        {
+            fprintf(stderr, "Failed to start scheduled playback\n");
+            goto bail;
+        }
+
+    // Tie stream time to the hardware clock the scheduler reads
+    {
+        BMDTimeValue hardwareTime, timeInFrame, ticksPerFrame, streamTime;
+        double playbackSpeed;
+
+        if (m_deckLinkOutput->GetHardwareReferenceClock(m_frameTimescale, &hardwareTime, &timeInFrame, &ticksPerFrame) != S_OK ||
+            m_deckLinkOutput->GetScheduledStreamTime(m_frameTimescale, &streamTime, &playbackSpeed) != S_OK)
+            {
+                fprintf(stderr, "Could not read the output hardware clock\n");
+                goto bail;
+            }
+        m_streamOrigin = hardwareTime - streamTime;
+        m_nextSlot = 0;
+    }
     m_running = true;
 
+    m_convertThread = std::thread(&Playback::RunStage, this, std::ref(m_frameReady), &Playback::ConvertNextFrame);
+    m_degradeThread = std::thread(&Playback::RunStage, this, std::ref(m_degradeReady), &Playback::DegradeNextFrame);
+    m_outputThread = std::thread(&Playback::RunStage, this, std::ref(m_outputReady), &Playback::ScheduleNextFrame);
+
     return;
 
  bail:
@@ -408,110 +627,307 @@ void Playback::StopRunning()
     // debugf.close();
     m_deckLinkOutput->DisableVideoOutput();
 
+    fprintf(stderr, "Playback: scheduled %lu, completed %lu, late %lu, dropped %lu\n",
+            m_totalFramesScheduled, m_totalFramesCompleted, m_totalFramesLate, m_totalFramesDropped);
+
     // Success; update the UI
     m_running = false;
 }
 
-void Playback::ScheduleNextFrame(bool prerolling)
+// Body of each pipeline thread: whenever woken, run the stage's step
+// until it has nothing it can do.
+void Playback::RunStage(EventFD& wakeup, bool (Playback::*step)())
 {
-    uint8_t* pulledFrame = NULL;
-    uint8_t* degradedFrame = NULL;
-    size_t output_size;
-    {
-        std::lock_guard<std::mutex> guard(output_mutex);	
-        output_size = output.size();
+    while (!this->end) {
+        wakeup.wait();
+        while (!this->end && (this->*step)())
+            ;
+    }
+}
+
+// Stage 1 (woken by capture, and by stage 2 freeing an encode frame):
+// take the oldest frame past the delay line and convert it to YUV422P
+// (just a repacking when capturing 8 bit YUV). With an encoded delay line
+// every frame goes straight on, and, unless it is to be recorded, the
+// captured frame goes back to the pool as soon as it is converted.
+// Each step returns true if it moved a frame on, so the caller knows to
+// look for another.
+bool Playback::ConvertNextFrame()
+{
+    PipelineFrame frame;
+    const size_t output_size = output.size();
+    if (output_size == 0 || (!m_encodedDelay && output_size < (unsigned) framesDelay)) {
+        // Nothing new to show; the card keeps showing the last frame
+        return false;
     }
-    if (output_size >= (unsigned) framesDelay) {
+
+    // encode frames come back before the degrader takes the next frame
+    // when it holds the delay line, so they no longer bound this queue
+    if (m_toDegrade.size() >= m_toDegrade.capacity())
+        return false;
+
+    frame.yuv = m_encodeFrames->Acquire();
+    if (frame.yuv == NULL)
+        return false;
+
+    output.pop(frame.captured);
+    FrameRecord& frameRecord = frame.captured.record;
+    frameRecord.dequeueTime = std::chrono::high_resolution_clock::now();
+    Trace::event(kTraceQueued, frameRecord.id, std::chrono::duration_cast<std::chrono::nanoseconds>(frameRecord.dequeueTime - frameRecord.captureTime).count());
+
+    // any degrader converts the same way; this one stays alive for the step
+    const std::shared_ptr<H264_degrader> converter = std::atomic_load(&degrader);
+    const uint64_t start = Trace::now();
+    switch (m_pixelFormat)
         {
-            std::lock_guard<std::mutex> guard(output_mutex);
-            pulledFrame = output.front();
+        case bmdFormat8BitYUV:
+            converter->uyvy2yuv422p(frame.captured.bytes, frame.yuv, m_frameWidth, m_frameHeight);
+            break;
+        case bmdFormat10BitYUV:
+            converter->v2102yuv422p10(frame.captured.bytes, frame.yuv, m_frameWidth, m_frameHeight);
+            break;
+        default:
+            converter->bgra2yuv422p(frame.captured.bytes, frame.yuv, m_frameWidth, m_frameHeight);
+            break;
         }
+    const uint64_t end = Trace::now();
+    Trace::event(kTraceConvertTo, frameRecord.id, end - start, start);
+    frameRecord.convertToTime = microseconds((end - start) / 1000);
+
+    if (m_encodedDelay && m_beforeRecording == NULL)
+        ReleaseCapturedFrame(frame.captured, m_framePool);
 
-        auto mem_alloct1 = std::chrono::high_resolution_clock::now();
-        degradedFrame = new uint8_t[frame_size];
-        auto mem_alloct2 = std::chrono::high_resolution_clock::now();
-        auto mem_alloctime = std::chrono::duration_cast<std::chrono::duration<double>>(mem_alloct2 - mem_alloct1);
-        std::cout << "-----frame below (" << frame_number <<  ")-----\n";
-        std::cout << "mem_alloctime " << mem_alloctime.count() << "\n";
-        output.pop_front();
-        frame_number++;
+    m_toDegrade.push(frame);        // cannot fail: checked above, and only this stage fills it
+    m_degradeReady.signal();
+    return true;
+}
+
+// Stage 2 (woken by stage 1, by the degrader finishing a frame, and by
+// stage 3 freeing a decoded frame): collect the oldest frame the degrader
+// has finished and keep it fed. The degrader hands frames back in the
+// order they went in, so m_degrading lines them up with their records.
+bool Playback::DegradeNextFrame()
+{
+    bool progress = false;
+    DegradedFrame degraded;
+
+    // New settings take over between two frames: the frames already in
+    // the old degrader come back from it, ahead of any from the new one
+    if (!m_retiring && std::atomic_load(&m_nextDegrader)) {
+        m_retiring = degrader;
+        m_retiringFrames = m_degrading.size();
+        m_retiringStream = m_degraderStream++;
+        std::atomic_store(&degrader, std::atomic_exchange(&m_nextDegrader, std::shared_ptr<H264_degrader>()));
+
+        // a shorter delay lets the frames past it go at once, as the
+        // convert stage does when the delay line is frames
+        if (m_encodedDelay && m_retiring->delay() > degrader->delay())
+            m_retiring->release_held(m_retiring->delay() - degrader->delay());
     }
-    else {
-        return;
-    }    
 
-    IDeckLinkMutableVideoFrame* newFrame = NULL;
-    int bytesPerPixel = GetBytesPerPixel(m_pixelFormat);
-    HRESULT result = m_deckLinkOutput->CreateVideoFrame(m_frameWidth, m_frameHeight,
-                                                        m_frameWidth * bytesPerPixel,
-                                                        m_pixelFormat, bmdFrameFlagDefault, &newFrame);
-    
-    if (result != S_OK) {
-        fprintf(stderr, "Failed to create video frame\n");
-        return;
+    H264_degrader* source = m_retiringFrames > 0 ? m_retiring.get() : degrader.get();
+    if (m_toOutput.size() < m_toOutput.capacity() && source->poll(degraded)) {
+        PipelineFrame frame = m_degrading.front();
+        m_degrading.pop_front();
+        assert(degraded.id == frame.captured.record.id);
+
+        FrameRecord& frameRecord = frame.captured.record;
+        const uint64_t end = Trace::now();
+        Trace::event(kTraceDegrade, frameRecord.id, end - frame.degradeStart, frame.degradeStart);
+        frameRecord.degradeTime = microseconds((end - frame.degradeStart) / 1000);
+
+        // unless the degrader gave it back as soon as it was encoded
+        if (degraded.input != NULL) {
+            m_encodeFrames->Release(degraded.input);
+            m_frameReady.signal();
+        }
+
+        frame.yuv = degraded.output;
+        frame.accessUnit = degraded.packet;
+        frame.stream = m_retiringFrames > 0 ? m_retiringStream : m_degraderStream;
+        m_toOutput.push(frame);
+        m_outputReady.signal();
+        if (m_retiringFrames > 0)
+            m_retiringFrames--;
+        progress = true;
     }
-    newFrame->GetBytes(&frameBytes);
 
-    if (pulledFrame && degradedFrame) {
-        {
-            std::lock_guard<std::mutex> lg(degrader->degrader_mutex);
-          
-            auto convert_tot1 = std::chrono::high_resolution_clock::now();
-            degrader->bgra2yuv422p((uint8_t*)pulledFrame, degrader->encoder_frame, width, height);
-            auto convert_tot2 = std::chrono::high_resolution_clock::now();
-            auto convert_totime = std::chrono::duration_cast<std::chrono::duration<double>>(convert_tot2 - convert_tot1);
-            std::cout << "convert_totime " << convert_totime.count() << "\n";
-          
-            auto degrade_t1 = std::chrono::high_resolution_clock::now();
-            degrader->degrade(degrader->encoder_frame, degrader->decoder_frame);
-            auto degrade_t2 = std::chrono::high_resolution_clock::now();
-            auto degrade_time = std::chrono::duration_cast<std::chrono::duration<double>>(degrade_t2 - degrade_t1);
-            std::cout << "degrade_time " << degrade_time.count() << "\n";
-          
-            auto convert_fromt1 = std::chrono::high_resolution_clock::now();
-            degrader->yuv422p2bgra(degrader->decoder_frame, (uint8_t*)degradedFrame, width, height);
-            auto convert_fromt2 = std::chrono::high_resolution_clock::now();
-            auto convert_fromtime = std::chrono::duration_cast<std::chrono::duration<double>>(convert_fromt2 - convert_fromt1);
-            std::cout << "convert_fromtime " << convert_fromtime.count() << "\n";
+    // drained; freed by the Run thread once no stage uses it
+    if (m_retiring && m_retiringFrames == 0)
+        m_retiring.reset();
+
+    PipelineFrame* next = m_toDegrade.front();
+    if (next != NULL) {
+        AVFrame* decoded = m_decodedFrames->Acquire();
+        if (decoded != NULL) {
+            const uint64_t start = Trace::now();
+            if (degrader->submit(next->yuv, decoded, next->captured.record.id)) {
+                PipelineFrame frame;
+                m_toDegrade.pop(frame);
+                frame.degradeStart = start;
+                m_degrading.push_back(frame);
+                progress = true;
+
+                // an old degrader no longer sees frames to push its held ones out
+                if (m_encodedDelay && m_retiringFrames > 0)
+                    m_retiring->release_held();
+            } else {
+                m_decodedFrames->Release(decoded);
+            }
         }
-        auto memcpyt1 = std::chrono::high_resolution_clock::now();
-        std::memcpy(frameBytes, degradedFrame, frame_size);
-        std::memcpy(previousFrame, degradedFrame, frame_size);
-        auto memcpyt2 = std::chrono::high_resolution_clock::now();
-        auto memcpytime = std::chrono::duration_cast<std::chrono::duration<double>>(memcpyt2 - memcpyt1);
-        std::cout << "memcpytime " << memcpytime.count() << "\n";
+    }
+
+    return progress;
+}
+
+// Stage 3 (woken by stage 2, and by ScheduledFrameCompleted freeing an
+// output frame): convert back to the capture format straight into a DeckLink frame,
+// hand it to the recorder and schedule it.
+bool Playback::ScheduleNextFrame()
+{
+    PipelineFrame frame;
+    OutputFrame* outputFrame = NULL;
+
+    if (m_toOutput.front() == NULL)
+        return false;
+
+    outputFrame = m_outputFrames->Acquire();
+    if (outputFrame == NULL) {
+        // the recorder is holding every output frame; wait for it to catch up
+        Trace::event(kTraceOutputExhausted, m_toOutput.front()->captured.record.id, m_outputFrames->ExhaustedCount());
+        return false;
+    }
+
+    m_toOutput.pop(frame);
+    FrameRecord& frameRecord = frame.captured.record;
+
+    const std::shared_ptr<H264_degrader> converter = std::atomic_load(&degrader);
+    const uint64_t start = Trace::now();
+    switch (m_pixelFormat)
         {
-            std::lock_guard<std::mutex> rec_guard(record_mutex);		  
-            record.push(std::pair<uint8_t*, uint8_t*> (pulledFrame, degradedFrame));
+        case bmdFormat8BitYUV:
+            converter->yuv422p2uyvy(frame.yuv, outputFrame->bytes, m_frameWidth, m_frameHeight);
+            break;
+        case bmdFormat10BitYUV:
+            converter->yuv422p102v210(frame.yuv, outputFrame->bytes, m_frameWidth, m_frameHeight);
+            break;
+        default:
+            converter->yuv422p2bgra(frame.yuv, outputFrame->bytes, m_frameWidth, m_frameHeight);
+            break;
         }
+    const uint64_t end = Trace::now();
+    Trace::event(kTraceConvertFrom, frameRecord.id, end - start, start);
+    frameRecord.convertFromTime = microseconds((end - start) / 1000);
+
+    // the decoder's buffers go back to it; the frame goes back to the pool
+    av_frame_unref(frame.yuv);
+    m_decodedFrames->Release(frame.yuv);
+    m_degradeReady.signal();
+
+    outputFrame->record = frameRecord;
+    outputFrame->source = frame.captured;
+    if (m_recordUnits)
+        CollectUnits(outputFrame, frame);
+
+    ScheduleFrame(outputFrame);
+    return true;
+}
+
+// Output stage: the after recording's payload for a frame, but for the
+// checksum, which the writer adds. A unit from another degrader than the
+// last one starts a new stream.
+void Playback::CollectUnits(OutputFrame* outputFrame, PipelineFrame& frame)
+{
+    std::vector<uint8_t>& payload = outputFrame->accessUnits;
+    RecordingUnitsHeader header;
+
+    memset(&header, 0, sizeof(header));
+    header.unitCount = m_unrecordedCount;
+    payload.resize(sizeof(header));
+    payload.insert(payload.end(), m_unrecordedUnits.begin(), m_unrecordedUnits.end());
+    m_unrecordedUnits.clear();
+    m_unrecordedCount = 0;
+
+    if (frame.accessUnit != NULL) {
+        RecordingUnit unit;
+        unit.size = frame.accessUnit->size;
+        unit.flags = 0;
+        if (frame.stream != m_lastStream)
+            unit.flags |= kRecordingUnitNewStream;
+        if (frame.accessUnit->flags & AV_PKT_FLAG_KEY)
+            unit.flags |= kRecordingUnitKey;
+        m_lastStream = frame.stream;
+
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&unit);
+        payload.insert(payload.end(), bytes, bytes + sizeof(unit));
+        payload.insert(payload.end(), frame.accessUnit->data, frame.accessUnit->data + unit.size);
+        header.unitCount++;
+        av_packet_free(&frame.accessUnit);
     }
-    else {
-        std::memcpy(frameBytes, previousFrame, frame_size);
-    }
-      
-    auto schedulet1 = std::chrono::high_resolution_clock::now();
-    const unsigned int frame_time = m_totalFramesScheduled * m_frameDuration;
-    if (m_deckLinkOutput->ScheduleVideoFrame(newFrame, frame_time, m_frameDuration, m_frameTimescale) != S_OK){
+
+    memcpy(payload.data(), &header, sizeof(header));
+}
+
+// Earliest display slot a frame scheduled now can still make: m_preroll
+// slots past the one being scanned out, and never one already handed out.
+// Aiming from the clock every time means a frame that missed its slot
+// pushes only itself back instead of leaving a backlog on the card.
+BMDTimeValue Playback::NextDisplaySlot()
+{
+    BMDTimeValue hardwareTime, timeInFrame, ticksPerFrame;
+    BMDTimeValue slot = m_nextSlot;
+
+    if (m_deckLinkOutput->GetHardwareReferenceClock(m_frameTimescale, &hardwareTime, &timeInFrame, &ticksPerFrame) == S_OK)
+        {
+            const BMDTimeValue earliest = (hardwareTime - m_streamOrigin) / m_frameDuration + m_preroll;
+            if (earliest > slot)
+                slot = earliest;
+        }
+
+    return slot;
+}
+
+// Schedule a frame for the earliest slot it can make. The caller's
+// reference on the frame is handed to the schedule, and from there to the
+// recorder in ScheduledFrameCompleted.
+void Playback::ScheduleFrame(OutputFrame* outputFrame)
+{
+    TraceSpan span(kTraceSchedule, outputFrame->record.id);
+    const BMDTimeValue slot = NextDisplaySlot();
+    const int rate = frame_rate;
+
+    m_slotsPerFrame = rate > 0 && (unsigned long)rate < m_framesPerSecond ? m_framesPerSecond / rate : 1;
+
+    // stamped first: the frame may complete before ScheduleVideoFrame returns
+    outputFrame->record.scheduledHardwareTime = (m_streamOrigin + slot * m_frameDuration) * ticks_per_second / m_frameTimescale;
+    if (m_deckLinkOutput->ScheduleVideoFrame(outputFrame->frame, slot * m_frameDuration,
+                                             m_slotsPerFrame * m_frameDuration, m_frameTimescale) != S_OK){
+        // the next frame recorded carries its units
+        if (m_recordUnits) {
+            RecordingUnitsHeader header;
+            memcpy(&header, outputFrame->accessUnits.data(), sizeof(header));
+            m_unrecordedUnits.assign(outputFrame->accessUnits.begin() + sizeof(header), outputFrame->accessUnits.end());
+            m_unrecordedCount = header.unitCount;
+        }
+        ReleaseCapturedFrame(outputFrame->source, m_framePool);
+        m_outputFrames->Release(outputFrame);
         return;
     }
-    auto schedulet2 = std::chrono::high_resolution_clock::now();
-    auto scheduletime = std::chrono::duration_cast<std::chrono::duration<double>>(schedulet2 - schedulet1);
-    std::cout << "scheduletime " << scheduletime.count() << "\n";
 
+    m_nextSlot = slot + m_slotsPerFrame;
     m_totalFramesScheduled++;
 }
 
 HRESULT Playback::CreateFrame(IDeckLinkVideoFrame** frame, void (*fillFunc)(IDeckLinkVideoFrame*))
 {
     HRESULT                     result;
-    int                         bytesPerPixel = GetBytesPerPixel(m_pixelFormat);
     IDeckLinkMutableVideoFrame* newFrame = NULL;
     IDeckLinkMutableVideoFrame* referenceFrame = NULL;
     IDeckLinkVideoConversion*   frameConverter = NULL;
 
     *frame = NULL;
 
-    result = m_deckLinkOutput->CreateVideoFrame(m_frameWidth, m_frameHeight, m_frameWidth * bytesPerPixel, m_pixelFormat, bmdFrameFlagDefault, &newFrame);
+    result = m_deckLinkOutput->CreateVideoFrame(m_frameWidth, m_frameHeight, GetRowBytes(m_pixelFormat, m_frameWidth), m_pixelFormat, bmdFrameFlagDefault, &newFrame);
     if (result != S_OK)
         {
             fprintf(stderr, "Failed to create video frame\n");
@@ -592,82 +1008,54 @@ ULONG Playback::Release()
 
 HRESULT Playback::ScheduledFrameCompleted(IDeckLinkVideoFrame* completedFrame, BMDOutputFrameCompletionResult result)
 {
-    /* IMPORTANT: get the time stamps for when a frame is completed */
-    //time_point<high_resolution_clock> tp = high_resolution_clock::now();
-
-    BMDTimeValue decklink_hardware_timestamp;
-    BMDTimeValue decklink_time_in_frame;
-    BMDTimeValue decklink_ticks_per_frame;
-    HRESULT ret;
+    OutputFrame* outputFrame = m_outputFrames->Find(completedFrame);
 
     if (do_exit) {
         ++m_totalFramesCompleted;
-        completedFrame->Release();
+        ReleaseCapturedFrame(outputFrame->source, m_framePool);
+        m_outputFrames->Release(outputFrame);
         return S_OK;
     }
 
-    auto t1 = delay_queue.front();
-    delay_queue.pop_front();
-    
-    high_resolution_clock::time_point t2 = high_resolution_clock::now();
-    std::chrono::duration<double> time_span = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
-    std::cout << "frame delay" << time_span.count() << "\n";
-
-    if ( (ret = m_deckLinkOutput->GetHardwareReferenceClock(ticks_per_second,
-                                                            &decklink_hardware_timestamp,
-                                                            &decklink_time_in_frame,
-                                                            &decklink_ticks_per_frame) ) != S_OK) {
-        std::cerr << "ScheduledFrameCompleted: could not get GetHardwareReferenceClock timestamp" << std::endl;
-        return ret;
-    }
-
-    BMDTimeValue decklink_frame_completed_timestamp;
-    if( (ret = m_deckLinkOutput->GetFrameCompletionReferenceTimestamp(completedFrame,
-                                                                      ticks_per_second,
-                                                                      &decklink_frame_completed_timestamp) ) != S_OK ) {
-
-        std::cerr << "ScheduledFrameCompleted: could not get FrameCompletionReference timestamp" << std::endl;
-        return ret;
+    // Glass-to-glass latency from the frame's own record: capture and
+    // display are both stamped on the DeckLink hardware reference clock
+    if (outputFrame != NULL &&
+        m_deckLinkOutput->GetFrameCompletionReferenceTimestamp(completedFrame, ticks_per_second,
+                                                               &outputFrame->record.completionHardwareTime) == S_OK) {
+        const FrameRecord& r = outputFrame->record;
+        Trace::event(kTraceDisplayed, r.id, (r.completionHardwareTime - r.captureHardwareTime) * 1000);
+        Trace::event(kTraceSlotOffset, r.id, (r.completionHardwareTime - r.scheduledHardwareTime) * 1000);
     }
 
-    void *frameBytes = NULL;
-    completedFrame->GetBytes(&frameBytes);
-
-    if(!preroll) {
-        if (decklink_frame_completed_timestamp - prev_decklink_frame_completed_timestamp > 1000000*1.05*(1.0 / this->frame_rate)) {
-            std::cerr << "PLAYBACK (hw timestamp): Frame " << m_totalFramesCompleted << " Displayed Late. Expected (+/- 5%): " << 1000000*(1.0 / this->frame_rate) << std::endl;
-            std::cerr << "\tTimestamp delay: " << decklink_frame_completed_timestamp - prev_decklink_frame_completed_timestamp << std::endl;
-            std::cerr << "\tHardware timestamp delay: " << decklink_hardware_timestamp - prev_decklink_hardware_timestamp << std::endl;
-        }
-        else if (decklink_hardware_timestamp - prev_decklink_hardware_timestamp > 1000000*1.05*(1.0 / this->frame_rate)) {
-            std::cerr << "PLAYBACK (callback): Frame " << m_totalFramesCompleted << " Displayed Late. Expected (+/- 5%): " << 1000000*(1.0 / this->frame_rate) << std::endl;
-            std::cerr << "\tTimestamp delay: " << decklink_frame_completed_timestamp - prev_decklink_frame_completed_timestamp << std::endl;
-            std::cerr << "\tHardware timestamp delay: " << decklink_hardware_timestamp - prev_decklink_hardware_timestamp << std::endl;
-        }
-        
-        if (decklink_frame_completed_timestamp - prev_decklink_frame_completed_timestamp < 1000000*0.05*(1.0 / this->frame_rate)) {
-            std::cerr << "PLAYBACK (hw timestamp): Frame " << m_totalFramesCompleted << " Displayed early. Expected (+/- 5%): " << 1000000*(1.0 / this->frame_rate) << std::endl;
-            std::cerr << "\tTimestamp delay: " << decklink_frame_completed_timestamp - prev_decklink_frame_completed_timestamp << std::endl;
-            std::cerr << "\tHardware timestamp delay: " << decklink_hardware_timestamp - prev_decklink_hardware_timestamp << std::endl;
+    // A late or dropped frame needs no catching up here: the next frame is
+    // aimed from the hardware clock again
+    switch (result)
+        {
+        case bmdOutputFrameDisplayedLate:
+            m_totalFramesLate++;
+            Trace::event(kTraceDisplayedLate, outputFrame ? outputFrame->record.id : 0);
+            break;
+        case bmdOutputFrameDropped:
+            m_totalFramesDropped++;
+            Trace::event(kTraceDisplayDropped, outputFrame ? outputFrame->record.id : 0);
+            break;
+        default:
+            break;
         }
-        else if (decklink_hardware_timestamp - prev_decklink_hardware_timestamp < 1000000*0.05*(1.0 / this->frame_rate)) {
-            std::cerr << "PLAYBACK (callback): Frame " << m_totalFramesCompleted << " Displayed early. Expected (+/- 5%): " << 1000000*(1.0 / this->frame_rate) << std::endl;
-            std::cerr << "\tTimestamp delay: " << decklink_frame_completed_timestamp - prev_decklink_frame_completed_timestamp << std::endl;
-            std::cerr << "\tHardware timestamp delay: " << decklink_hardware_timestamp - prev_decklink_hardware_timestamp << std::endl;
+
+    // The card is done with it, so the record is complete: the recorder
+    // takes over the schedule's reference, and the source frame with it.
+    // Every output frame fits in the queue, so the push cannot fail.
+    if (outputFrame != NULL)
+        {
+            outputFrame->record.completionResult = result;
+            m_toRecord.push(outputFrame);
+            m_recordReady.signal();
         }
-    }
-    else {
-        preroll--;
-        prev_decklink_frame_completed_timestamp = decklink_frame_completed_timestamp;
-        prev_decklink_hardware_timestamp = decklink_hardware_timestamp;
-    }
-    completedFrame->Release();
     ++m_totalFramesCompleted;
-    
-    prev_decklink_frame_completed_timestamp = decklink_frame_completed_timestamp;
-    prev_decklink_hardware_timestamp = decklink_hardware_timestamp;
 
-    //ScheduleNextFrame(false);
+    // an output frame is free again; a frame waiting for one can go now
+    m_outputReady.signal();
 
     return S_OK;
 }
@@ -698,3 +1086,12 @@ int GetBytesPerPixel(BMDPixelFormat pixelFormat)
 
     return bytesPerPixel;
 }
+
+// v210 rows are padded to a whole number of 48 pixel blocks
+long GetRowBytes(BMDPixelFormat pixelFormat, long width)
+{
+    if (pixelFormat == bmdFormat10BitYUV)
+        return V210RowBytes(width);
+
+    return width * GetBytesPerPixel(pixelFormat);
+}
@@ -30,15 +30,25 @@
 
 #include "DeckLinkAPI.h"
 #include "file.hh"
+#include "eventfd.hh"
+#include "frame_pool.hh"
+#include "spsc_ring.hh"
+#include "Frame.hh"
+#include "OutputFramePool.hh"
+#include "AVFramePool.hh"
+#include "Recording.hh"
+#include "RecordingCodec.hh"
 #include <atomic>
+#include <deque>
 #include <fstream>
 #include <list>
 #include <chrono>
+#include <memory>
 #include <mutex>
 #include <random>
-#include <queue>
 #include <utility>
 #include <thread>
+#include <vector>
 #include "h264_degrader.hh"
 
 using std::chrono::time_point;
@@ -46,6 +56,21 @@ using std::chrono::high_resolution_clock;
 using std::chrono::time_point_cast;
 using std::chrono::microseconds;
 
+// A frame between pipeline stages: the captured pixels (kept for the
+// recorder) with its record, and the YUV frame the next stage works on.
+// When the after recording takes access units, a degraded frame also
+// carries the one it was decoded from, and which degrader that was.
+struct PipelineFrame
+{
+    CapturedFrame   captured;
+    AVFrame*        yuv;
+    uint64_t        degradeStart;   // when it was submitted to the degrader
+    AVPacket*       accessUnit;
+    uint64_t        stream;
+
+    PipelineFrame() : captured(), yuv(NULL), degradeStart(0), accessUnit(NULL), stream(0) {}
+};
+
 class Playback : public IDeckLinkVideoOutputCallback {
 private:
     int32_t                 m_refCount;
@@ -62,26 +87,93 @@ private:
     unsigned long           m_framesPerSecond;
     unsigned long           m_totalFramesScheduled;
     unsigned long           m_totalFramesDropped;
+    unsigned long           m_totalFramesLate;
     unsigned long           m_totalFramesCompleted;
 
+    // Just-in-time scheduling: a frame goes out m_preroll slots after the
+    // one the card is scanning out, read off the hardware reference clock,
+    // and is held for m_slotsPerFrame slots when capturing below 60 fps
+    // (worked out again from frame_rate for every frame).
+    int                     m_preroll;
+    BMDTimeValue            m_slotsPerFrame;
+    BMDTimeValue            m_streamOrigin;     // hardware clock at stream time 0
+    BMDTimeValue            m_nextSlot;         // first slot not already taken
+
     int m_deckLinkIndex;
-    int m_displayModeIndex;
+    BMDDisplayMode m_displayModeId;     // the capture's; output runs in the same mode
     BMDVideoOutputFlags m_outputFlags;
-    BMDPixelFormat m_pixelFormat;
+    BMDPixelFormat m_pixelFormat;   // of both capture and output: 8 or 10 bit YUV, or BGRA
+    size_t m_frameBytes;            // set with the frame size in StartRunning
     const char* m_videoInputFile;
-
-    std::list<uint8_t*>             &output;
-    std::mutex                      &output_mutex;
-
-    std::queue<std::pair<uint8_t*, uint8_t*> > record;
-    std::mutex record_mutex;
+    int m_bitrate;                  // the settings the degrader was last built for
+    int m_quantization;
+    int m_bands;                    // horizontal bands each frame is degraded in, side by side
+    int m_bandOverlap;              // rows of each neighbour coded along with a band
+    bool m_encodedDelay;            // hold the delay line in the degrader, as access units
+
+    SPSCRing<CapturedFrame>         &output;
+    EventFD                         &m_frameReady;      // signalled by capture for each new frame
+    EventFD                         m_controlEvent;     // wakes Run: to stop, or for a settings change
+
+    // Live degrader changes, RCU style: the degrader for the new settings
+    // is built on the Run thread while the old one carries on, and the
+    // degrade stage swaps it in between two frames. Every stage takes its
+    // own reference for a step, so the old one lives until the frames in
+    // it have come back and no stage still uses it. Whichever thread lets
+    // go of it last hands it to the Run thread, which frees it away from
+    // the pipeline.
+    std::shared_ptr<H264_degrader>  degrader;           // swapped by the degrade stage only
+    std::shared_ptr<H264_degrader>  m_nextDegrader;     // built, waiting for a frame boundary
+    std::shared_ptr<H264_degrader>  m_retiring;         // still has frames in flight (degrade stage only)
+    size_t                          m_retiringFrames;   // the oldest of m_degrading, in m_retiring
+    std::mutex                      m_retiredMutex;
+    std::vector<H264_degrader*>     m_retired;          // unreferenced, for the Run thread to free
+    uint64_t                        m_degraderStream;   // numbers each degrader's bitstream (degrade stage only)
+    uint64_t                        m_retiringStream;
+    std::mutex                      m_settingsMutex;
+    bool                            m_settingsChanged;  // m_bitrate or m_quantization, since the last build
+
+    // Degrade pipeline: convert -> degrade -> convert back and schedule,
+    // one thread each, so frame N+1 is converted while frame N encodes.
+    // The degrade stage only feeds the degrader, which encodes and decodes
+    // on threads of its own. Each stage waits on its own event; producers
+    // signal it after a push, consumers after giving back a frame the
+    // stage may be short of.
+    AVFramePool                     *m_encodeFrames;    // converted, waiting to be encoded
+    AVFramePool                     *m_decodedFrames;   // decoded, waiting to be converted back
+    SPSCRing<PipelineFrame>         m_toDegrade;
+    std::deque<PipelineFrame>       m_degrading;        // in the degrader, oldest first (degrade stage only)
+    SPSCRing<PipelineFrame>         m_toOutput;
+    EventFD                         m_degradeReady;
+    EventFD                         m_outputReady;
+    std::thread                     m_convertThread;
+    std::thread                     m_degradeThread;
+    std::thread                     m_outputThread;
+    FramePool                       &m_framePool;
+    OutputFramePool                 *m_outputFrames;
+
+    // Frames the card is done with, on their way to the recorder. While
+    // the recorder holds them the output stage is short of output frames,
+    // so a slow disk holds up playback rather than piling up frames.
+    SPSCRing<OutputFrame*>          m_toRecord;
+    EventFD                         m_recordReady;
     std::thread t;
 
     std::ofstream           m_logfile;
   //File                    m_infile;
 
-    int beforeFile;
-    int afterFile;
+    RecordingWriter*                m_beforeRecording;  // the caller's; recording carries on
+    RecordingWriter*                m_afterRecording;   // across sessions
+    RecordingCompressor*            m_compressor;       // codes them, unless they are raw
+
+    // The after recording can take each frame's access units instead of
+    // its pixels (kRecordingH264). The output stage puts them together in
+    // the output frame, carrying over those of frames it could not
+    // schedule, as they were decoded all the same.
+    bool                            m_recordUnits;
+    uint64_t                        m_lastStream;       // of the last unit recorded (output stage only)
+    std::vector<uint8_t>            m_unrecordedUnits;
+    uint32_t                        m_unrecordedCount;
     
     std::list<time_point<high_resolution_clock>> scheduled_timestamp_cpu;
     std::list<BMDTimeValue> scheduled_timestamp_decklink;
@@ -90,35 +182,56 @@ private:
     // Signal Generator Implementation
     void            StartRunning();
     void            StopRunning();
-    void            ScheduleNextFrame(bool prerolling);
+    void            RunStage(EventFD& wakeup, bool (Playback::*step)());
+    bool            ConvertNextFrame();
+    bool            DegradeNextFrame();
+    bool            ScheduleNextFrame();
+    void            ScheduleFrame(OutputFrame* outputFrame);
+    std::shared_ptr<H264_degrader> CreateDegrader(int bitrate, int quantization);
+    void            RebuildDegrader();
+    void            RetireDegrader(H264_degrader* retired);
+    void            FreeRetiredDegraders();
+    BMDTimeValue    NextDisplaySlot();
 
     const char*     GetPixelFormatName(BMDPixelFormat pixelFormat);
     void            PrintStatusLine(uint32_t queued);
 
     void WriteToDisk();
+    void ReleaseRecorded(OutputFrame* frame);
+    void CollectUnits(OutputFrame* outputFrame, PipelineFrame& frame);
 
 public:
-    int frame_rate; 
-    int framesDelay; 
-    H264_degrader* degrader;
-    bool end;
+    std::atomic<int> frame_rate;    // output frames per second; read for every frame
+    std::atomic<int> framesDelay;   // frames held back; read for every frame
+    std::atomic<bool> end;
 
     ~Playback();
     Playback(int m_deckLinkIndex,
-	     int m_displayModeIndex,
+	     BMDDisplayMode m_displayModeId,
 	     BMDVideoOutputFlags m_outputFlags,
 	     BMDPixelFormat m_pixelFormat,
 	     const char* m_videoInputFile,
-	     std::list<uint8_t*> &output,
-	     std::mutex &output_mutex,
+	     SPSCRing<CapturedFrame> &output,
+	     EventFD &frameReady,
+	     FramePool &framePool,
 	     int frames_rate,
 	     int framesDelay,
+	     int preroll,
          int bitrate,
          int quantization,
-	     char* beforeFilename,
-	     char* afterFilename);
+         int bands,
+         int bandOverlap,
+         bool encodedDelay,
+	     RecordingWriter* beforeRecording,
+	     RecordingWriter* afterRecording,
+	     int recordingWorkers);
 
     bool Run();
+    void Stop();    // wake every playback thread and have them finish
+
+    // Degrade every frame from some point on with new settings, without
+    // holding up the pipeline; returns at once
+    void ChangeDegrader(int bitrate, int quantization);
 
     // *** DeckLink API implementation of IDeckLinkVideoOutputCallback IDeckLinkAudioOutputCallback *** //
     // IUnknown
@@ -136,5 +249,6 @@ public:
 };
 
 int GetBytesPerPixel(BMDPixelFormat pixelFormat);
+long GetRowBytes(BMDPixelFormat pixelFormat, long width);
 
 #endif
@@ -0,0 +1,139 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "Recording.hh"
+
+static const uint8_t kZeros[kRecordingHeaderSize] = { 0 };
+
+// FNV-1a over 64 bit words rather than bytes, then the odd bytes at the end
+uint64_t RecordingChecksum(const uint8_t* data, size_t size)
+{
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t checksum = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        checksum = (checksum ^ word) * prime;
+    }
+    for (; i < size; i++)
+        checksum = (checksum ^ data[i]) * prime;
+
+    return checksum;
+}
+
+RecordingWriter::RecordingWriter(Recorder& recorder, size_t stream, BMDPixelFormat pixelFormat,
+                                 RecordingCodec codec, uint32_t flags, uint32_t alignment) :
+    m_recorder(recorder),
+    m_stream(stream),
+    m_pixelFormat(pixelFormat),
+    m_codec(codec),
+    m_alignment(alignment),
+    m_length(0),
+    m_index(),
+    m_finished(false)
+{
+    if (alignment == 0 || alignment > kRecordingHeaderSize || kRecordingHeaderSize % alignment != 0)
+        throw std::runtime_error("RecordingWriter: alignment must divide the header size");
+
+    RecordingHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kRecordingMagic, sizeof(header.magic));
+    header.version = kRecordingVersion;
+    header.headerSize = kRecordingHeaderSize;
+    header.pixelFormat = pixelFormat;
+    header.codec = codec;
+    header.alignment = alignment;
+    header.flags = flags;
+
+    Write(&header, sizeof(header));
+    Write(kZeros, kRecordingHeaderSize - sizeof(header));
+}
+
+void RecordingWriter::Write(const void* data, size_t size)
+{
+    m_recorder.append(m_stream, static_cast<const uint8_t*>(data), size);
+    m_length += size;
+}
+
+void RecordingWriter::Pad()
+{
+    const size_t padding = (m_alignment - m_length % m_alignment) % m_alignment;
+    Write(kZeros, padding);
+}
+
+void RecordingWriter::Append(const FrameRecord& record, uint32_t width, uint32_t height,
+                             const uint8_t* payload, size_t size)
+{
+    RecordingIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.frameId = record.id;
+    entry.captureHardwareTime = record.captureHardwareTime;
+    entry.scheduledHardwareTime = record.scheduledHardwareTime;
+    entry.displayHardwareTime = record.completionHardwareTime;
+    entry.offset = m_length;
+    entry.size = size;
+    entry.completionResult = record.completionResult;
+    entry.width = width;
+    entry.height = height;
+    m_index.push_back(entry);
+
+    Write(payload, size);
+    Pad();
+}
+
+void RecordingWriter::Finish()
+{
+    if (m_finished)
+        return;
+    m_finished = true;
+
+    RecordingFooter footer;
+    memset(&footer, 0, sizeof(footer));
+    footer.indexOffset = m_length;
+    footer.frameCount = m_index.size();
+    memcpy(footer.magic, kRecordingMagic, sizeof(footer.magic));
+
+    if (!m_index.empty())
+        Write(m_index.data(), m_index.size() * sizeof(RecordingIndexEntry));
+    Write(&footer, sizeof(footer));
+}
+
+RecordingReader::RecordingReader(const std::string& filename) :
+    m_file(filename),
+    m_header(),
+    m_frameCount(0),
+    m_index(NULL)
+{
+    const Chunk& chunk = m_file.chunk();
+    RecordingFooter footer;
+
+    if (chunk.size() < kRecordingHeaderSize + sizeof(footer))
+        throw std::runtime_error(filename + ": not a recording");
+
+    memcpy(&m_header, chunk.buffer(), sizeof(m_header));
+    if (memcmp(m_header.magic, kRecordingMagic, sizeof(m_header.magic)) != 0)
+        throw std::runtime_error(filename + ": not a recording");
+    if (m_header.version != kRecordingVersion)
+        throw std::runtime_error(filename + ": recording version " + std::to_string(m_header.version) + " is not supported");
+
+    memcpy(&footer, chunk.buffer() + chunk.size() - sizeof(footer), sizeof(footer));
+    if (memcmp(footer.magic, kRecordingMagic, sizeof(footer.magic)) != 0)
+        throw std::runtime_error(filename + ": recording has no index (was it cut short?)");
+    if (footer.indexOffset % sizeof(uint64_t) != 0 ||
+        footer.indexOffset + footer.frameCount * sizeof(RecordingIndexEntry) + sizeof(footer) != chunk.size())
+        throw std::runtime_error(filename + ": recording index is damaged");
+
+    m_frameCount = footer.frameCount;
+    m_index = reinterpret_cast<const RecordingIndexEntry*>(chunk.buffer() + footer.indexOffset);
+
+    for (uint64_t frame = 0; frame < m_frameCount; frame++)
+        if (m_index[frame].offset + m_index[frame].size > footer.indexOffset)
+            throw std::runtime_error(filename + ": recording index is damaged");
+}
+
+const uint8_t* RecordingReader::Payload(uint64_t frame) const
+{
+    return m_file.chunk().buffer() + m_index[frame].offset;
+}
@@ -0,0 +1,167 @@
+#ifndef __RECORDING_HH__
+#define __RECORDING_HH__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "file.hh"
+#include "recorder.hh"
+#include "Frame.hh"
+
+// The before and after recordings (-B and -A) are each one recording
+// file: a header page, then every frame's payload starting on an
+// alignment boundary, then an index with an entry per frame and a footer
+// saying where the index starts. Both files index the same frames in the
+// same order, so entry i of one and entry i of the other are a pair.
+// Payloads are whole frames, or each frame coded on its own, so they vary
+// in size. Everything is little endian, as written.
+//
+// The index is only written when recording finishes. A recording cut
+// short still has its payloads at their aligned places, but no index.
+
+static const char kRecordingMagic[8] = { 'E', 'O', 'R', 'E', 'C', 'O', 'R', 'D' };
+static const uint32_t kRecordingVersion = 1;
+static const uint32_t kRecordingHeaderSize = 4096;
+
+enum RecordingCodec : uint32_t
+{
+    kRecordingRaw = 0,              // the frame as captured or played out
+    kRecordingFFV1 = 1,             // that frame, losslessly coded on its own (see RecordingCodec.hh)
+    kRecordingH264 = 2,             // after only: the access units it was decoded from (see below)
+};
+
+enum RecordingFlags : uint32_t
+{
+    // playback converted BGRA back from H.264 with swscale rather than the
+    // ColorConvert kernels, so kRecordingH264 payloads decode the same way
+    kRecordingSwscale = 1,
+};
+
+struct RecordingHeader
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    headerSize;         // the first payload starts here
+    uint32_t    pixelFormat;        // BMDPixelFormat of every frame
+    uint32_t    codec;              // RecordingCodec of every payload
+    uint32_t    alignment;          // payloads start at multiples of this
+    uint32_t    flags;              // RecordingFlags
+};
+
+// Hardware times are DeckLink reference clock microseconds, as in FrameRecord
+struct RecordingIndexEntry
+{
+    uint64_t    frameId;
+    int64_t     captureHardwareTime;
+    int64_t     scheduledHardwareTime;  // start of the slot it was aimed at
+    int64_t     displayHardwareTime;    // when it completed on the card; 0 if it never did
+    uint64_t    offset;                 // of the payload, from the start of the file
+    uint32_t    size;                   // of the payload
+    uint32_t    completionResult;       // BMDOutputFrameCompletionResult
+    uint32_t    width;                  // the frame size can change with the source
+    uint32_t    height;
+};
+
+struct RecordingFooter
+{
+    uint64_t    indexOffset;
+    uint64_t    frameCount;
+    char        magic[8];
+};
+
+// A kRecordingH264 payload: a RecordingUnitsHeader, then unitCount units,
+// each a RecordingUnit followed by its bytes. The last unit is the one
+// the frame was decoded from; any before it were decoded since the frame
+// before, for frames that never made it into the recording. Decoding
+// every unit in order, starting over at kRecordingUnitNewStream, gives
+// back the frames exactly. A frame with no units was played out white.
+struct RecordingUnitsHeader
+{
+    uint64_t    checksum;           // RecordingChecksum() of the frame as played out
+    uint32_t    unitCount;
+    uint32_t    reserved;
+};
+
+enum RecordingUnitFlags : uint32_t
+{
+    kRecordingUnitNewStream = 1,    // from a new degrader: the decoder starts over
+    kRecordingUnitKey = 2,          // decodes without any unit before it
+};
+
+struct RecordingUnit
+{
+    uint32_t    size;               // of the bytes that follow
+    uint32_t    flags;              // RecordingUnitFlags
+};
+
+static_assert(sizeof(RecordingHeader) == 32, "RecordingHeader layout");
+static_assert(sizeof(RecordingIndexEntry) == 56, "RecordingIndexEntry layout");
+static_assert(sizeof(RecordingFooter) == 24, "RecordingFooter layout");
+static_assert(sizeof(RecordingUnitsHeader) == 16, "RecordingUnitsHeader layout");
+static_assert(sizeof(RecordingUnit) == 8, "RecordingUnit layout");
+
+// Cheap enough to run on every frame played out
+uint64_t RecordingChecksum(const uint8_t* data, size_t size);
+
+// Writes one recording into a stream of a Recorder, which it shares with
+// the other recording; the index builds up in memory until Finish.
+class RecordingWriter
+{
+public:
+    RecordingWriter(Recorder& recorder, size_t stream, BMDPixelFormat pixelFormat,
+                    RecordingCodec codec = kRecordingRaw, uint32_t flags = 0,
+                    uint32_t alignment = kRecordingHeaderSize);
+
+    void            Append(const FrameRecord& record, uint32_t width, uint32_t height,
+                           const uint8_t* payload, size_t size);
+
+    // write the index and footer; nothing can be appended afterwards
+    void            Finish();
+
+    Recorder&       GetRecorder() { return m_recorder; }
+    BMDPixelFormat  PixelFormat() const { return m_pixelFormat; }
+    RecordingCodec  Codec() const { return m_codec; }
+    uint64_t        FrameCount() const { return m_index.size(); }
+
+    RecordingWriter(const RecordingWriter&) = delete;
+    RecordingWriter& operator=(const RecordingWriter&) = delete;
+
+private:
+    Recorder&                           m_recorder;
+    size_t                              m_stream;
+    BMDPixelFormat                      m_pixelFormat;
+    RecordingCodec                      m_codec;
+    uint32_t                            m_alignment;
+    uint64_t                            m_length;       // written to the stream so far
+    std::vector<RecordingIndexEntry>    m_index;
+    bool                                m_finished;
+
+    void            Write(const void* data, size_t size);
+    void            Pad();                              // up to the next alignment boundary
+};
+
+// Any frame of a finished recording straight out of a read-only mapping:
+// opening it reads the header and footer, and the index is used in place.
+class RecordingReader
+{
+public:
+    explicit RecordingReader(const std::string& filename);     // throws std::runtime_error
+
+    const RecordingHeader&      Header() const { return m_header; }
+    uint64_t                    FrameCount() const { return m_frameCount; }
+    const RecordingIndexEntry&  Entry(uint64_t frame) const { return m_index[frame]; }
+    const uint8_t*              Payload(uint64_t frame) const;
+
+    RecordingReader(const RecordingReader&) = delete;
+    RecordingReader& operator=(const RecordingReader&) = delete;
+
+private:
+    File                        m_file;
+    RecordingHeader             m_header;
+    uint64_t                    m_frameCount;
+    const RecordingIndexEntry*  m_index;
+};
+
+#endif
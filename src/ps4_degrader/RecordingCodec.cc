@@ -0,0 +1,483 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+
+extern "C" {
+#include "libavutil/opt.h"
+#include "libswscale/swscale.h"
+}
+
+#include "RecordingCodec.hh"
+#include "TracePoints.hh"
+
+const char* RecordingCodecName(RecordingCodec codec)
+{
+    switch (codec) {
+    case kRecordingRaw:     return "raw";
+    case kRecordingFFV1:    return "ffv1";
+    case kRecordingH264:    return "h264";
+    default:                return "unknown";
+    }
+}
+
+bool RecordingCodecFromName(const char* name, RecordingCodec* codec)
+{
+    for (RecordingCodec candidate : { kRecordingRaw, kRecordingFFV1, kRecordingH264 }) {
+        if (strcmp(name, RecordingCodecName(candidate)) == 0) {
+            *codec = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// What FFV1 is given for each pixel format the card records in; the
+// degrader takes the same ones
+static AVPixelFormat GetCodedPixelFormat(BMDPixelFormat pixelFormat)
+{
+    switch (pixelFormat) {
+    case bmdFormat8BitYUV:      return AV_PIX_FMT_YUV422P;
+    case bmdFormat10BitYUV:     return AV_PIX_FMT_YUV422P10;
+    case bmdFormat8BitBGRA:     return AV_PIX_FMT_BGRA;
+    default:                    return AV_PIX_FMT_NONE;
+    }
+}
+
+bool RecordingCodecSupported(RecordingCodec codec, BMDPixelFormat pixelFormat)
+{
+    return codec == kRecordingRaw || GetCodedPixelFormat(pixelFormat) != AV_PIX_FMT_NONE;
+}
+
+size_t RecordingFrameBytes(BMDPixelFormat pixelFormat, uint32_t width, uint32_t height)
+{
+    switch (pixelFormat) {
+    case bmdFormat8BitYUV:      return (size_t)width * 2 * height;
+    case bmdFormat10BitYUV:     return (size_t)V210RowBytes(width) * height;
+    default:                    return (size_t)width * 4 * height;
+    }
+}
+
+static std::string AVErrorString(int error)
+{
+    char message[128] = "unknown error";
+    av_strerror(error, message, sizeof(message));
+    return message;
+}
+
+static AVCodec* FindCodec(AVCodecID id, bool encoder)
+{
+    avcodec_register_all();
+
+    AVCodec* codec = encoder ? avcodec_find_encoder(id) : avcodec_find_decoder(id);
+    if (codec == NULL)
+        throw std::runtime_error(std::string("libavcodec has no ") + (id == AV_CODEC_ID_FFV1 ? "FFV1" : "H.264") +
+                                 (encoder ? " encoder" : " decoder"));
+    return codec;
+}
+
+// FFV1 codes every frame as a key frame, so nothing carries over from
+// one frame to the next. One thread each: the frames are spread over the
+// workers, and the H.264 decoder has to be set up as the degrader's is,
+// which leaves it at one thread, so that every packet gives its picture
+// straight back.
+static AVCodecContext* OpenCodec(AVCodecID id, bool encoder, AVPixelFormat pixelFormat, uint32_t width, uint32_t height)
+{
+    AVCodec* codec = FindCodec(id, encoder);
+
+    AVCodecContext* context = avcodec_alloc_context3(codec);
+    if (context == NULL)
+        throw std::runtime_error("could not allocate a codec context");
+
+    context->width = width;
+    context->height = height;
+    context->pix_fmt = pixelFormat;
+    context->time_base.num = 1;
+    context->time_base.den = 60;
+    context->thread_count = 1;
+    if (encoder) {
+        context->gop_size = 1;
+        context->level = 1;
+        av_opt_set(context->priv_data, "coder", "range_def", 0);
+        av_opt_set(context->priv_data, "context", "0", 0);
+    }
+
+    const int result = avcodec_open2(context, codec, NULL);
+    if (result < 0) {
+        avcodec_free_context(&context);
+        throw std::runtime_error(std::string("could not open ") + (id == AV_CODEC_ID_FFV1 ? "FFV1 " : "H.264 ") +
+                                 std::to_string(width) + "x" + std::to_string(height) + ": " + AVErrorString(result));
+    }
+    return context;
+}
+
+RecordingEncoder::RecordingEncoder(RecordingCodec codec, BMDPixelFormat pixelFormat) :
+    m_codec(codec),
+    m_pixelFormat(pixelFormat),
+    m_kernel(ColorConvertBestKernel()),
+    m_context(NULL),
+    m_frame(av_frame_alloc()),
+    m_packet(av_packet_alloc())
+{
+    if (codec != kRecordingFFV1 || !RecordingCodecSupported(codec, pixelFormat))
+        throw std::runtime_error(std::string("cannot code recordings with ") + RecordingCodecName(codec) +
+                                 " in this pixel format");
+    FindCodec(AV_CODEC_ID_FFV1, true);
+}
+
+RecordingEncoder::~RecordingEncoder()
+{
+    avcodec_free_context(&m_context);
+    av_frame_free(&m_frame);
+    av_packet_free(&m_packet);
+}
+
+// A context is opened for each frame size: FFV1 takes it from the
+// context rather than the bitstream
+void RecordingEncoder::Open(uint32_t width, uint32_t height)
+{
+    if (m_context != NULL && m_context->width == (int)width && m_context->height == (int)height)
+        return;
+
+    avcodec_free_context(&m_context);
+    av_frame_unref(m_frame);
+    m_context = OpenCodec(AV_CODEC_ID_FFV1, true, GetCodedPixelFormat(m_pixelFormat), width, height);
+
+    if (m_context->pix_fmt != AV_PIX_FMT_BGRA) {
+        m_frame->width = width;
+        m_frame->height = height;
+        m_frame->format = m_context->pix_fmt;
+        if (av_frame_get_buffer(m_frame, 32) < 0)
+            throw std::runtime_error("could not allocate the planes to code a recording in");
+    }
+}
+
+void RecordingEncoder::Encode(const uint8_t* frame, uint32_t width, uint32_t height, std::vector<uint8_t>& payload)
+{
+    Open(width, height);
+
+    // BGRA is coded straight from the frame, which the encoder copies as
+    // it is not reference counted; the packed YUV layouts are unpacked
+    // into our planes, which the encoder gives back once it has handed
+    // over the packet
+    if (m_context->pix_fmt == AV_PIX_FMT_BGRA) {
+        m_frame->data[0] = const_cast<uint8_t*>(frame);
+        m_frame->linesize[0] = width * 4;
+        m_frame->width = width;
+        m_frame->height = height;
+        m_frame->format = AV_PIX_FMT_BGRA;
+    } else {
+        if (av_frame_make_writable(m_frame) < 0)
+            throw std::runtime_error("could not get the planes to code a recording in");
+        if (m_pixelFormat == bmdFormat10BitYUV)
+            V210ToYUV422P10(m_kernel, frame, V210RowBytes(width), m_frame->data, m_frame->linesize, width, 0, height);
+        else
+            UYVYToYUV422P(m_kernel, frame, width * 2, m_frame->data, m_frame->linesize, width, 0, height);
+    }
+
+    int result = avcodec_send_frame(m_context, m_frame);
+    if (result >= 0)
+        result = avcodec_receive_packet(m_context, m_packet);
+    if (result < 0)
+        throw std::runtime_error("could not code a frame: " + AVErrorString(result));
+
+    payload.assign(m_packet->data, m_packet->data + m_packet->size);
+    av_packet_unref(m_packet);
+}
+
+RecordingDecoder::RecordingDecoder(RecordingCodec codec, BMDPixelFormat pixelFormat, uint32_t flags) :
+    m_codec(codec),
+    m_pixelFormat(pixelFormat),
+    m_kernel(ColorConvertBestKernel()),
+    m_context(NULL),
+    m_frame(av_frame_alloc()),
+    m_packet(av_packet_alloc()),
+    m_swscale((flags & kRecordingSwscale) != 0),
+    m_scaler(NULL)
+{
+    if (codec == kRecordingRaw || !RecordingCodecSupported(codec, pixelFormat))
+        throw std::runtime_error(std::string("cannot decode recordings in ") + RecordingCodecName(codec) +
+                                 " with this pixel format");
+    FindCodec(codec == kRecordingFFV1 ? AV_CODEC_ID_FFV1 : AV_CODEC_ID_H264, false);
+}
+
+RecordingDecoder::~RecordingDecoder()
+{
+    avcodec_free_context(&m_context);
+    av_frame_free(&m_frame);
+    av_packet_free(&m_packet);
+    sws_freeContext(m_scaler);
+}
+
+void RecordingDecoder::Open(uint32_t width, uint32_t height)
+{
+    if (m_context != NULL && m_context->width == (int)width && m_context->height == (int)height)
+        return;
+
+    avcodec_free_context(&m_context);
+    sws_freeContext(m_scaler);
+    m_scaler = NULL;
+
+    if (m_codec == kRecordingFFV1) {
+        m_context = OpenCodec(AV_CODEC_ID_FFV1, false, GetCodedPixelFormat(m_pixelFormat), width, height);
+    } else {
+        const AVPixelFormat degraded = m_pixelFormat == bmdFormat10BitYUV ? AV_PIX_FMT_YUV422P10 : AV_PIX_FMT_YUV422P;
+        m_context = OpenCodec(AV_CODEC_ID_H264, false, degraded, width, height);
+        if (m_pixelFormat == bmdFormat8BitBGRA && m_swscale)
+            m_scaler = sws_getContext(width, height, AV_PIX_FMT_YUV422P, width, height, AV_PIX_FMT_BGRA, 0, 0, 0, 0);
+    }
+}
+
+// Returns whether the packet gave a picture
+bool RecordingDecoder::DecodePacket(const uint8_t* data, size_t size)
+{
+    // the packet only borrows the data, which the decoder copies as it
+    // has no padding after it
+    m_packet->data = const_cast<uint8_t*>(data);
+    m_packet->size = size;
+    int result = avcodec_send_packet(m_context, m_packet);
+    m_packet->data = NULL;
+    m_packet->size = 0;
+    if (result >= 0)
+        result = avcodec_receive_frame(m_context, m_frame);
+    if (result == AVERROR(EAGAIN))
+        return false;
+    if (result < 0)
+        throw std::runtime_error("could not decode a frame: " + AVErrorString(result));
+    return true;
+}
+
+// Decodes every unit, as the degrader did, and keeps the last one's
+// picture; the degrader played out white when that gave none
+void RecordingDecoder::DecodeUnits(const uint8_t* payload, size_t size, uint32_t width, uint32_t height)
+{
+    RecordingUnitsHeader header;
+    if (size < sizeof(header))
+        throw std::runtime_error("access units payload is cut short");
+    memcpy(&header, payload, sizeof(header));
+
+    size_t offset = sizeof(header);
+    bool picture = false;
+    for (uint32_t i = 0; i < header.unitCount; i++) {
+        RecordingUnit unit;
+        if (size - offset < sizeof(unit))
+            throw std::runtime_error("access units payload is cut short");
+        memcpy(&unit, payload + offset, sizeof(unit));
+        offset += sizeof(unit);
+        if (size - offset < unit.size)
+            throw std::runtime_error("access units payload is cut short");
+
+        if (unit.flags & kRecordingUnitNewStream)
+            avcodec_free_context(&m_context);
+        Open(width, height);
+        picture = DecodePacket(payload + offset, unit.size);
+        offset += unit.size;
+    }
+
+    if (!picture) {
+        Open(width, height);
+        av_frame_unref(m_frame);
+        m_frame->width = width;
+        m_frame->height = height;
+        m_frame->format = m_context->pix_fmt;
+        if (av_frame_get_buffer(m_frame, 32) < 0)
+            throw std::runtime_error("could not allocate a frame to decode into");
+
+        const bool highBitDepth = m_frame->format == AV_PIX_FMT_YUV422P10;
+        for (int plane = 0; plane < 3; plane++) {
+            const uint32_t samples = plane == 0 ? width : width / 2;
+            for (uint32_t row = 0; row < height; row++) {
+                uint8_t* line = m_frame->data[plane] + (size_t)row * m_frame->linesize[plane];
+                if (highBitDepth)
+                    std::fill_n((uint16_t*)line, samples, plane == 0 ? 1020 : 512);
+                else
+                    memset(line, plane == 0 ? 255 : 128, samples);
+            }
+        }
+    }
+}
+
+void RecordingDecoder::Decode(const uint8_t* payload, size_t size, uint32_t width, uint32_t height, uint8_t* frame)
+{
+    if (m_codec == kRecordingFFV1) {
+        Open(width, height);
+        if (!DecodePacket(payload, size))
+            throw std::runtime_error("could not decode a frame: no picture");
+    } else {
+        DecodeUnits(payload, size, width, height);
+    }
+    if (m_frame->width != (int)width || m_frame->height != (int)height)
+        throw std::runtime_error("a frame decoded to another size than it was recorded in");
+
+    // as the degrader converts back for the card, for H.264: the vector
+    // kernels give the same bytes as the scalar one, but not as swscale,
+    // so BGRA goes through whichever of the two playback used
+    if (m_pixelFormat == bmdFormat10BitYUV)
+        YUV422P10ToV210(m_kernel, m_frame->data, m_frame->linesize, frame, V210RowBytes(width), width, 0, height);
+    else if (m_pixelFormat == bmdFormat8BitYUV)
+        YUV422PToUYVY(m_kernel, m_frame->data, m_frame->linesize, frame, width * 2, width, 0, height);
+    else if (m_codec == kRecordingFFV1)
+        for (uint32_t row = 0; row < height; row++)
+            memcpy(frame + (size_t)row * width * 4, m_frame->data[0] + (size_t)row * m_frame->linesize[0], width * 4);
+    else if (m_scaler == NULL)
+        YUV422PToBGRA(kColorConvertScalar, m_frame->data, m_frame->linesize, frame, width * 4, width, 0, height);
+    else {
+        uint8_t* planes[1] = { frame };
+        int strides[1] = { (int)width * 4 };
+        sws_scale(m_scaler, m_frame->data, m_frame->linesize, 0, height, planes, strides);
+    }
+
+    av_frame_unref(m_frame);
+}
+
+RecordingCompressor::RecordingCompressor(RecordingWriter& before, RecordingWriter& after, unsigned int workers,
+                                         std::function<void(void*)> done) :
+    m_writers{ &before, &after },
+    m_coded{ before.Codec() == kRecordingFFV1, after.Codec() == kRecordingFFV1 },
+    m_codec(kRecordingFFV1),
+    m_pixelFormat(before.PixelFormat()),
+    m_done(done),
+    m_mutex(),
+    m_submitted(),
+    m_appended(),
+    m_queue(),
+    m_nextSequence(0),
+    m_nextAppend(0),
+    m_stopping(false),
+    m_stats(),
+    m_start(std::chrono::steady_clock::now()),
+    m_workers()
+{
+    // fail here, rather than on a worker, if the codec cannot be opened
+    RecordingEncoder check(m_codec, m_pixelFormat);
+
+    m_stats.workers = std::max(workers, 1u);
+    for (unsigned int i = 0; i < m_stats.workers; i++)
+        m_workers.emplace_back(&RecordingCompressor::Work, this);
+}
+
+RecordingCompressor::~RecordingCompressor()
+{
+    Finish();
+}
+
+void RecordingCompressor::Submit(const FrameRecord& record, uint32_t width, uint32_t height,
+                                 const uint8_t* before, size_t beforeSize, const uint8_t* after, size_t afterSize,
+                                 void* context)
+{
+    size_t queued;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_queue.push_back(Job{ record, width, height, { before, after }, { beforeSize, afterSize }, context, m_nextSequence++ });
+        queued = m_queue.size();
+        m_stats.maxQueued = std::max(m_stats.maxQueued, queued);
+    }
+    m_submitted.notify_one();
+    Trace::event(kTraceCompressQueue, record.id, queued);
+}
+
+void RecordingCompressor::Finish()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_stopping = true;
+    }
+    m_submitted.notify_all();
+
+    for (std::thread& worker : m_workers)
+        worker.join();
+    m_workers.clear();
+}
+
+RecordingCompressor::Stats RecordingCompressor::GetStats() const
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    Stats stats = m_stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    return stats;
+}
+
+static double ThreadCPUSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Takes the oldest frame, codes it while the other workers code the
+// next ones, then waits for its turn to append
+void RecordingCompressor::Work()
+{
+    RecordingEncoder encoder(m_codec, m_pixelFormat);
+    std::vector<uint8_t> payloads[2];
+
+    while (true) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_submitted.wait(lock, [this]() { return !m_queue.empty() || m_stopping; });
+        if (m_queue.empty())
+            break;
+        const Job job = m_queue.front();
+        m_queue.pop_front();
+        lock.unlock();
+
+        const double cpuStart = ThreadCPUSeconds();
+        const uint8_t* data[2];
+        size_t sizes[2];
+        bool coded = true;
+        {
+            TraceSpan span(kTraceCompress, job.record.id);
+            for (int stream = 0; stream < 2; stream++) {
+                data[stream] = job.payloads[stream];
+                sizes[stream] = job.sizes[stream];
+                if (!m_coded[stream] || !coded)
+                    continue;
+
+                try {
+                    encoder.Encode(job.payloads[stream], job.width, job.height, payloads[stream]);
+                    data[stream] = payloads[stream].data();
+                    sizes[stream] = payloads[stream].size();
+                } catch (const std::exception& e) {
+                    fprintf(stderr, "Recording: frame %lu not recorded: %s\n", (unsigned long)job.record.id, e.what());
+                    coded = false;
+                }
+            }
+        }
+        const double cpuSeconds = ThreadCPUSeconds() - cpuStart;
+
+        // a frame that could not be coded keeps its place in both
+        // recordings, with empty coded payloads
+        if (!coded)
+            for (int stream = 0; stream < 2; stream++)
+                if (m_coded[stream])
+                    sizes[stream] = 0;
+
+        lock.lock();
+        m_appended.wait(lock, [this, &job]() { return m_nextAppend == job.sequence; });
+        lock.unlock();
+
+        {
+            TraceSpan span(kTraceRecord, job.record.id);
+            for (int stream = 0; stream < 2; stream++)
+                m_writers[stream]->Append(job.record, job.width, job.height, data[stream], sizes[stream]);
+            Trace::event(kTraceRecordDepth, job.record.id, m_writers[1]->GetRecorder().stats().in_flight);
+        }
+        m_done(job.context);
+
+        lock.lock();
+        m_nextAppend++;
+        m_stats.frames++;
+        for (int stream = 0; stream < 2; stream++) {
+            if (m_coded[stream]) {
+                m_stats.rawBytes += job.sizes[stream];
+                m_stats.codedBytes += sizes[stream];
+            }
+        }
+        m_stats.cpuSeconds += cpuSeconds;
+        if (!coded)
+            m_stats.errors++;
+        lock.unlock();
+        m_appended.notify_all();
+    }
+}
@@ -0,0 +1,166 @@
+#ifndef __RECORDING_CODEC_HH__
+#define __RECORDING_CODEC_HH__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavutil/frame.h"
+#include "libswscale/swscale.h"
+}
+
+#include "DeckLinkAPI.h"
+#include "ColorConvert.hh"
+#include "Frame.hh"
+#include "Recording.hh"
+
+// Coding of recording payloads. kRecordingFFV1 codes every frame
+// on its own with FFV1 version 1 (no global header, every frame a key
+// frame), so any payload of a recording still decodes by itself. The
+// card's packed YUV layouts are unpacked into planes for FFV1 and packed
+// again on the way out, which moves samples without changing them; BGRA
+// goes in as it is. kRecordingH264 payloads are put together by playback
+// from the degrader's own packets, and only ever decoded here.
+
+const char*     RecordingCodecName(RecordingCodec codec);
+bool            RecordingCodecFromName(const char* name, RecordingCodec* codec);
+bool            RecordingCodecSupported(RecordingCodec codec, BMDPixelFormat pixelFormat);
+
+// Bytes of one uncoded frame, as the card lays it out
+size_t          RecordingFrameBytes(BMDPixelFormat pixelFormat, uint32_t width, uint32_t height);
+
+// Codes frames of one pixel format, of any size; one thread at a time
+class RecordingEncoder
+{
+public:
+    RecordingEncoder(RecordingCodec codec, BMDPixelFormat pixelFormat);    // throws std::runtime_error
+    ~RecordingEncoder();
+
+    // replaces payload with the coded frame; throws std::runtime_error
+    void            Encode(const uint8_t* frame, uint32_t width, uint32_t height, std::vector<uint8_t>& payload);
+
+    RecordingEncoder(const RecordingEncoder&) = delete;
+    RecordingEncoder& operator=(const RecordingEncoder&) = delete;
+
+private:
+    const RecordingCodec        m_codec;
+    const BMDPixelFormat        m_pixelFormat;
+    const ColorConvertKernel    m_kernel;
+    AVCodecContext*             m_context;      // for the current frame size
+    AVFrame*                    m_frame;
+    AVPacket*                   m_packet;
+
+    void            Open(uint32_t width, uint32_t height);
+};
+
+// Turns payloads back into frames as the card laid them out. H.264
+// payloads have to be decoded in order, from a key unit on; each comes
+// back as it was played out. flags are the recording's RecordingFlags.
+class RecordingDecoder
+{
+public:
+    RecordingDecoder(RecordingCodec codec, BMDPixelFormat pixelFormat, uint32_t flags = 0);  // throws std::runtime_error
+    ~RecordingDecoder();
+
+    // frame must hold RecordingFrameBytes(); throws std::runtime_error
+    void            Decode(const uint8_t* payload, size_t size, uint32_t width, uint32_t height, uint8_t* frame);
+
+    RecordingDecoder(const RecordingDecoder&) = delete;
+    RecordingDecoder& operator=(const RecordingDecoder&) = delete;
+
+private:
+    const RecordingCodec        m_codec;
+    const BMDPixelFormat        m_pixelFormat;
+    const ColorConvertKernel    m_kernel;
+    AVCodecContext*             m_context;      // for the current frame size and stream
+    AVFrame*                    m_frame;
+    AVPacket*                   m_packet;
+    const bool                  m_swscale;      // H.264 to BGRA with swscale, as playback did
+    SwsContext*                 m_scaler;
+
+    void            Open(uint32_t width, uint32_t height);
+    bool            DecodePacket(const uint8_t* data, size_t size);
+    void            DecodeUnits(const uint8_t* payload, size_t size, uint32_t width, uint32_t height);
+};
+
+// Codes the frames of a before and after recording pair on a pool of
+// worker threads, each with an encoder of its own, and appends them in
+// the order they were submitted, so the pair still indexes the same
+// frames. Only the recordings in kRecordingFFV1 are coded; the other's
+// payloads are appended as they are. Submit() never waits: the payloads
+// stay the caller's, and queue here, until done is called with their
+// context once both are appended. done is called from the workers, one
+// call at a time, in order.
+class RecordingCompressor
+{
+public:
+    struct Stats
+    {
+        uint64_t        frames;         // each one a before and an after payload
+        uint64_t        rawBytes;       // of the payloads coded
+        uint64_t        codedBytes;
+        double          cpuSeconds;     // spent coding, on all the workers
+        double          seconds;        // since the compressor started
+        size_t          maxQueued;      // frames submitted but not yet coded
+        uint64_t        errors;         // frames recorded without payloads
+        unsigned int    workers;
+    };
+
+    // in the pixel format of the recordings
+    RecordingCompressor(RecordingWriter& before, RecordingWriter& after, unsigned int workers,
+                        std::function<void(void*)> done);
+    ~RecordingCompressor();
+
+    void            Submit(const FrameRecord& record, uint32_t width, uint32_t height,
+                           const uint8_t* before, size_t beforeSize, const uint8_t* after, size_t afterSize,
+                           void* context);
+
+    // codes and appends everything submitted, then stops the workers
+    void            Finish();
+
+    RecordingCodec  Codec() const { return m_codec; }
+    Stats           GetStats() const;
+
+    RecordingCompressor(const RecordingCompressor&) = delete;
+    RecordingCompressor& operator=(const RecordingCompressor&) = delete;
+
+private:
+    struct Job
+    {
+        FrameRecord     record;
+        uint32_t        width;
+        uint32_t        height;
+        const uint8_t*  payloads[2];    // before, after
+        size_t          sizes[2];
+        void*           context;
+        uint64_t        sequence;
+    };
+
+    RecordingWriter*                m_writers[2];
+    bool                            m_coded[2];
+    const RecordingCodec            m_codec;
+    const BMDPixelFormat            m_pixelFormat;
+    std::function<void(void*)>      m_done;
+
+    mutable std::mutex              m_mutex;
+    std::condition_variable         m_submitted;
+    std::condition_variable         m_appended;
+    std::deque<Job>                 m_queue;
+    uint64_t                        m_nextSequence;
+    uint64_t                        m_nextAppend;   // whose turn it is to append
+    bool                            m_stopping;
+    Stats                           m_stats;
+    const std::chrono::steady_clock::time_point m_start;
+    std::vector<std::thread>        m_workers;
+
+    void            Work();
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef __TRACE_POINTS_HH__
+#define __TRACE_POINTS_HH__
+
+#include <cstdint>
+
+#include "trace.hh"
+
+// What each trace event in a ps4_degrader trace means. Spans carry their
+// duration in nanoseconds; the rest say what their value is.
+enum TracePoint : uint32_t
+{
+    kTraceCaptured = 0,         // frame queued for playback; value: ring depth
+    kTraceCaptureDropped,       // frame not queued (delay line full, no buffer)
+    kTraceQueued,               // time spent waiting in the capture ring
+    kTraceConvertTo,            // span: BGRA -> YUV422P
+    kTraceDegrade,              // span: submitted to the degrader until decoded
+    kTraceEncode,               // span
+    kTraceDecode,               // span
+    kTraceConvertFrom,          // span: YUV422P -> BGRA, into the output frame
+    kTraceSchedule,             // span: ScheduleVideoFrame
+    kTraceOutputExhausted,      // no free output frame to convert into; value: times so far
+    kTraceDisplayed,            // glass-to-glass latency (capture to display, hardware clock)
+    kTraceSlotOffset,           // how long after its slot started the frame was shown
+    kTraceDisplayedLate,
+    kTraceDisplayDropped,
+    kTraceRecord,               // span: a frame's before and after copied into the recorder (waits when the disk is behind)
+    kTraceRecordDepth,          // value: recorder chunk writes in flight
+    kTraceCompress,             // span: a frame's before and after coded for the recordings (-Z)
+    kTraceCompressQueue,        // value: frames waiting to be coded, this one included
+    kTracePointCount
+};
+
+static const char* const kTracePointNames[kTracePointCount] =
+{
+    "captured",
+    "capture_dropped",
+    "queued",
+    "convert_to",
+    "degrade",
+    "encode",
+    "decode",
+    "convert_from",
+    "schedule",
+    "output_exhausted",
+    "glass_to_glass",
+    "slot_offset",
+    "displayed_late",
+    "display_dropped",
+    "record",
+    "record_depth",
+    "compress",
+    "compress_queue",
+};
+
+#endif
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <memory>
@@ -6,6 +7,7 @@
 #include <mutex>
 #include <chrono>
 #include "h264_degrader.hh"
+#include "TracePoints.hh"
 
 extern "C" {
 #include <stdlib.h>
@@ -18,7 +20,17 @@ extern "C" {
 #include "libavutil/mathematics.h"
 }
 
+// The hand-vectorised kernels when the CPU has one, swscale otherwise
+ColorConvertKernel H264_degrader::bgra_convert_kernel(){
+  return ColorConvertBestKernel();
+}
+
 void H264_degrader::bgra2yuv422p(uint8_t* input, AVFrame* outputFrame, size_t width, size_t height){
+  if (convert_kernel != kColorConvertScalar) {
+    BGRAToYUV422P(convert_kernel, input, 4*width, outputFrame->data, outputFrame->linesize, width, 0, height);
+    return;
+  }
+
   uint8_t * inData[1] = { input };
   int inLinesize[1] = { 4*width };
   
@@ -26,25 +38,143 @@ void H264_degrader::bgra2yuv422p(uint8_t* input, AVFrame* outputFrame, size_t wi
 }
 
 void H264_degrader::yuv422p2bgra(AVFrame* inputFrame, uint8_t* output, size_t width, size_t height){
-  uint8_t * inData[3] = { inputFrame->data[0], inputFrame->data[1], inputFrame->data[2] };
-  int inLinesize[3] = { width, width/2, width/2 };
+  if (convert_kernel != kColorConvertScalar) {
+    YUV422PToBGRA(convert_kernel, inputFrame->data, inputFrame->linesize, output, 4*width, width, 0, height);
+    return;
+  }
+
   uint8_t * outputArray[1] = { output };
   int outLinesize[1] = { 4*width };
 
-  sws_scale(yuv422p2bgra_context, inData, inLinesize, 0, height, outputArray, outLinesize);
+  sws_scale(yuv422p2bgra_context, inputFrame->data, inputFrame->linesize, 0, height, outputArray, outLinesize);
+}
+
+// 8 bit YUV from the card is already 4:2:2, so it only changes layout
+void H264_degrader::uyvy2yuv422p(uint8_t* input, AVFrame* outputFrame, size_t width, size_t height){
+  UYVYToYUV422P(convert_kernel, input, 2*width, outputFrame->data, outputFrame->linesize, width, 0, height);
+}
+
+void H264_degrader::yuv422p2uyvy(AVFrame* inputFrame, uint8_t* output, size_t width, size_t height){
+  YUV422PToUYVY(convert_kernel, inputFrame->data, inputFrame->linesize, output, 2*width, width, 0, height);
+}
+
+// 10 bit YUV from the card is v210, which unpacks straight into yuv422p10
+void H264_degrader::v2102yuv422p10(uint8_t* input, AVFrame* outputFrame, size_t width, size_t height){
+  V210ToYUV422P10(convert_kernel, input, V210RowBytes(width), outputFrame->data, outputFrame->linesize, width, 0, height);
+}
+
+void H264_degrader::yuv422p102v210(AVFrame* inputFrame, uint8_t* output, size_t width, size_t height){
+  YUV422P10ToV210(convert_kernel, inputFrame->data, inputFrame->linesize, output, V210RowBytes(width), width, 0, height);
 }
 
-H264_degrader::H264_degrader(size_t _width, size_t _height, size_t _bitrate, size_t quantization) :
+H264_degrader::H264_degrader(size_t _width, size_t _height, size_t _bitrate, size_t quantization, size_t queue_depth, int codec_threads,
+                             AVPixelFormat pixel_format, int frames_per_second, size_t band_count, size_t band_overlap,
+                             size_t packet_delay) :
+    packet_sink(),
+    result_callback(),
+    keep_packets(false),
+    input_released(),
+    pix_fmt(pixel_format),
     width(_width),
     height(_height),
     bitrate(_bitrate),
     frame_count(0),
-    quantization(quantization)
+    quantization(quantization),
+    encoder_codec(NULL),
+    decoder_codec(NULL),
+    encoder_context(NULL),
+    decoder_context(NULL),
+    encoder_input(NULL),
+    convert_kernel(bgra_convert_kernel()),
+    submitted(queue_depth),
+    encoded(queue_depth + packet_delay),
+    degraded(queue_depth),
+    packet_delay(packet_delay),
+    held_released(0),
+    packets(),
+    packet_count(0),
+    encode_ready(),
+    decode_ready(),
+    result_ready(),
+    threads_started(),
+    stopping(false),
+    encoder_thread(),
+    decoder_thread(),
+    bands(),
+    bgra2yuv422p_context(NULL),
+    yuv422p2bgra_context(NULL)
 {
-    buffer = std::move(std::unique_ptr<uint8_t[]>((uint8_t*)aligned_alloc(32,1<<23)));
-
     avcodec_register_all();
 
+    if(band_count > 1){
+        open_bands(band_count, band_overlap, queue_depth, codec_threads, frames_per_second);
+    }else{
+        open_codecs(codec_threads, frames_per_second);
+    }
+
+    encoder_frame = av_frame_alloc();
+    if(encoder_frame == NULL) {
+        std::cout << "AVFrame not allocated: encoder" << "\n";
+        throw;
+    }
+
+    decoder_frame = av_frame_alloc();
+    if(decoder_frame == NULL) {
+        std::cout << "AVFrame not allocated: decoder" << "\n";
+        throw;
+    }
+    
+    encoder_frame->width = width;
+    encoder_frame->height = height;
+    encoder_frame->format = pix_fmt;
+    encoder_frame->pts = 0;
+
+    decoder_frame->width = width;
+    decoder_frame->height = height;
+    decoder_frame->format = pix_fmt;
+    decoder_frame->pts = 0;
+
+    if(av_frame_get_buffer(encoder_frame, 32) < 0){
+        std::cout << "AVFrame could not allocate buffer: encoder" << "\n";
+        throw;
+    }
+
+    if(av_frame_get_buffer(decoder_frame, 32) < 0){
+        std::cout << "AVFrame could not allocate buffer: decoder" << "\n";
+        throw;
+    }
+
+    packets.resize(encoded.capacity() + 1);
+    for(AVPacket *&packet : packets){
+        packet = av_packet_alloc();
+        if(packet == NULL) {
+            std::cout << "AVPacket not allocated: encoder" << "\n";
+            throw;
+        }
+    }
+
+  bgra2yuv422p_context = sws_getContext(width, height,
+				    AV_PIX_FMT_BGRA, width, height,
+				    AV_PIX_FMT_YUV422P, 0, 0, 0, 0);
+  if (bgra2yuv422p_context == NULL) {
+    std::cout << "BGRA to YUV422P context not found\n";
+    throw;
+  }
+
+
+  yuv422p2bgra_context = sws_getContext(width, height,
+			    AV_PIX_FMT_YUV422P, width, height, 
+			    AV_PIX_FMT_BGRA, 0, 0, 0, 0);
+
+  if (yuv422p2bgra_context == NULL) {
+    std::cout << "BGRA to YUV422P context not found\n";
+    throw;
+  }
+
+}
+
+// One encoder and one decoder for the whole frame
+void H264_degrader::open_codecs(int codec_threads, int frames_per_second){
     encoder_codec = avcodec_find_encoder(codec_id);
     if(encoder_codec == NULL){
         std::cout << "encoder_codec: " << codec_id << " not found!" << "\n";
@@ -77,8 +207,8 @@ H264_degrader::H264_degrader(size_t _width, size_t _height, size_t _bitrate, siz
     encoder_context->bit_rate = bitrate;
     encoder_context->bit_rate_tolerance = 1000000;
 
-    encoder_context->time_base = (AVRational){1, 20};
-    encoder_context->framerate = (AVRational){60, 1};
+    encoder_context->time_base = (AVRational){1, frames_per_second};
+    encoder_context->framerate = (AVRational){frames_per_second, 1};
     encoder_context->gop_size = 0;
     encoder_context->max_b_frames = 0;
     encoder_context->qmin = quantization;
@@ -104,6 +234,15 @@ H264_degrader::H264_degrader(size_t _width, size_t _height, size_t _bitrate, siz
     decoder_context->qcompress = encoder_context->qcompress;
     av_opt_set(decoder_context->priv_data, "preset", "fast", 0);
 
+    // Frame threading would hold each picture back in the decoder for a
+    // packet per thread, so the decoder only ever splits a frame by
+    // slices, and gives back every picture for the packet it came from
+    decoder_context->thread_type = FF_THREAD_SLICE;
+    if(codec_threads > 0){
+        encoder_context->thread_count = codec_threads;
+        decoder_context->thread_count = codec_threads;
+    }
+
     if(avcodec_open2(encoder_context, encoder_codec, NULL) < 0){
         std::cout << "could not open encoder" << "\n";;
         throw;
@@ -114,199 +253,350 @@ H264_degrader::H264_degrader(size_t _width, size_t _height, size_t _bitrate, siz
         throw;
     }
 
-    decoder_parser = av_parser_init(decoder_codec->id);
-    if(decoder_parser == NULL){
-        std::cout << "Decoder parser could not be initialized" << "\n";
+    encoder_input = av_frame_alloc();
+    if(encoder_input == NULL) {
+        std::cout << "AVFrame not allocated: encoder input" << "\n";
         throw;
     }
+}
 
-    encoder_frame = av_frame_alloc();
-    if(encoder_frame == NULL) {
-        std::cout << "AVFrame not allocated: encoder" << "\n";
-        throw;
+// Bands start on macroblock rows, so only the last one can end in a part
+// row, and each gets its share of the bitrate. Every band degrader queues
+// one more frame than we do, as it holds the one being stitched as well
+// as those in our encoded queue.
+void H264_degrader::open_bands(size_t count, size_t overlap, size_t queue_depth, int codec_threads, int frames_per_second){
+    const size_t macroblock_rows = (height + 15) / 16;
+    count = std::min(count, macroblock_rows);
+    overlap = (overlap + 1) & ~(size_t)1;
+
+    if(codec_threads <= 0){
+        codec_threads = std::max(1u, std::thread::hardware_concurrency() / (unsigned int)count);
     }
 
-    decoder_frame = av_frame_alloc();
-    if(decoder_frame == NULL) {
-        std::cout << "AVFrame not allocated: decoder" << "\n";
-        throw;
+    bands.resize(count);
+    for(size_t i = 0; i < count; i++){
+        Band &band = bands[i];
+        band.first_row = i * macroblock_rows / count * 16;
+        band.rows = std::min(height, (i + 1) * macroblock_rows / count * 16) - band.first_row;
+        band.rows_above = std::min(overlap, band.first_row);
+        const size_t rows_below = std::min(overlap, height - band.first_row - band.rows);
+
+        band.degrader.reset(new H264_degrader(width, band.rows_above + band.rows + rows_below, bitrate * band.rows / height,
+                                              quantization, queue_depth + 1, codec_threads, pix_fmt, frames_per_second));
+
+        band.windows.resize(encoded.capacity() + 1);
+        band.pictures.resize(encoded.capacity() + 1);
+        for(size_t slot = 0; slot < band.windows.size(); slot++){
+            band.windows[slot] = av_frame_alloc();
+            band.pictures[slot] = av_frame_alloc();
+            if(band.windows[slot] == NULL || band.pictures[slot] == NULL){
+                std::cout << "AVFrame not allocated: band" << "\n";
+                throw;
+            }
+        }
     }
-    
-    encoder_frame->width = width;
-    encoder_frame->height = height;
-    encoder_frame->format = pix_fmt;
-    encoder_frame->pts = 0;
-
-    decoder_frame->width = width;
-    decoder_frame->height = height;
-    decoder_frame->format = pix_fmt;
-    decoder_frame->pts = 0;
+}
 
-    if(av_frame_get_buffer(encoder_frame, 32) < 0){
-        std::cout << "AVFrame could not allocate buffer: encoder" << "\n";
-        throw;
+H264_degrader::~H264_degrader(){
+    stopping = true;
+    encode_ready.signal();
+    decode_ready.signal();
+    if(encoder_thread.joinable()){
+        encoder_thread.join();
+    }
+    if(decoder_thread.joinable()){
+        decoder_thread.join();
     }
 
-    if(av_frame_get_buffer(decoder_frame, 32) < 0){
-        std::cout << "AVFrame could not allocate buffer: decoder" << "\n";
-        throw;
+    // results nobody polled still hold their packets
+    Job unpolled;
+    while(degraded.pop(unpolled)){
+        av_packet_free(&unpolled.frame.packet);
     }
 
-    encoder_packet = av_packet_alloc();
-    if(encoder_packet == NULL) {
-        std::cout << "AVPacket not allocated: encoder" << "\n";
-        throw;
+    // the band degraders may still be working on our frames
+    for(Band &band : bands){
+        band.degrader.reset();
+        for(size_t slot = 0; slot < band.windows.size(); slot++){
+            av_frame_free(&band.windows[slot]);
+            av_frame_free(&band.pictures[slot]);
+        }
     }
 
-    decoder_packet = av_packet_alloc();
-    if(decoder_packet == NULL) {
-        std::cout << "AVPacket not allocated: decoder" << "\n";
-        throw;
+    std::lock_guard<std::mutex> guard(degrader_mutex);
+
+    avcodec_free_context(&decoder_context);
+    avcodec_free_context(&encoder_context);
+
+    av_frame_free(&decoder_frame);
+    av_frame_free(&encoder_frame);
+    av_frame_free(&encoder_input);
+
+    for(AVPacket *&packet : packets){
+        av_packet_free(&packet);
     }
 
-  bgra2yuv422p_context = sws_getContext(width, height,
-				    AV_PIX_FMT_BGRA, width, height,
-				    AV_PIX_FMT_YUV422P, 0, 0, 0, 0);
-  if (bgra2yuv422p_context == NULL) {
-    std::cout << "BGRA to YUV422P context not found\n";
-    throw;
-  }
+    sws_freeContext(bgra2yuv422p_context);
+    sws_freeContext(yuv422p2bgra_context);
+}
 
+bool H264_degrader::submit(AVFrame *inputFrame, AVFrame *outputFrame, uint64_t frame_id){
+    std::call_once(threads_started, [this](){
+        encoder_thread = std::thread(&H264_degrader::run, this, std::ref(encode_ready), &H264_degrader::encode_next);
+        decoder_thread = std::thread(&H264_degrader::run, this, std::ref(decode_ready), &H264_degrader::decode_next);
+    });
+
+    Job job;
+    job.frame.input = inputFrame;
+    job.frame.output = outputFrame;
+    job.frame.id = frame_id;
+    if(!submitted.push(job)){
+        return false;
+    }
+    encode_ready.signal();
+    return true;
+}
 
-  yuv422p2bgra_context = sws_getContext(width, height,
-			    AV_PIX_FMT_YUV422P, width, height, 
-			    AV_PIX_FMT_BGRA, 0, 0, 0, 0);
+bool H264_degrader::poll(DegradedFrame &result){
+    Job job;
+    if(!degraded.pop(job)){
+        return false;
+    }
+    result = job.frame;
 
-  if (yuv422p2bgra_context == NULL) {
-    std::cout << "BGRA to YUV422P context not found\n";
-    throw;
-  }
+    // the decoder may have been waiting for room
+    decode_ready.signal();
+    return true;
+}
 
+DegradedFrame H264_degrader::wait(){
+    DegradedFrame result;
+    while(!poll(result)){
+        result_ready.wait();
+    }
+    return result;
 }
 
-H264_degrader::~H264_degrader(){
-    std::lock_guard<std::mutex> guard(degrader_mutex);
+void H264_degrader::degrade(AVFrame *inputFrame, AVFrame *outputFrame, uint64_t frame_id){
+    if(!submit(inputFrame, outputFrame, frame_id)){
+        std::cout << "degrade: frames still in flight" << "\n";
+        throw;
+    }
+    wait();
+}
 
-    av_parser_close(decoder_parser);
+void H264_degrader::release_held(size_t count){
+    held_released += count;
+    decode_ready.signal();
+}
 
-    avcodec_free_context(&decoder_context);
-    avcodec_free_context(&encoder_context);
+// Encoder and decoder threads: wait to be woken, then work until stuck.
+// Each step returns true if it moved a frame on.
+void H264_degrader::run(EventFD &wakeup, bool (H264_degrader::*step)()){
+    while(!stopping){
+        wakeup.wait();
+        while(!stopping && (this->*step)())
+            ;
+    }
+}
 
-    av_frame_free(&decoder_frame);
-    av_frame_free(&encoder_frame);
+bool H264_degrader::encode_next(){
+    Job job;
+    if(submitted.front() == NULL || encoded.size() >= encoded.capacity()){
+        return false;
+    }
+    submitted.pop(job);
+
+    job.slot = packet_count++ % packets.size();
+    job.packet = packets[job.slot];
+    if(bands.empty()){
+        encode(job);
+    }else{
+        split(job);
+    }
 
-    av_packet_free(&decoder_packet);
-    av_packet_free(&encoder_packet);
+    if(input_released && bands.empty()){
+        input_released(job.frame.input);
+        job.frame.input = NULL;
+    }
 
-    sws_freeContext(bgra2yuv422p_context);
-    sws_freeContext(yuv422p2bgra_context);
+    encoded.push(job);      // cannot fail: only this thread fills it
+    decode_ready.signal();
+    return true;
 }
 
-void H264_degrader::degrade(AVFrame *inputFrame, AVFrame *outputFrame){
-    bool output_set = false;
+bool H264_degrader::decode_next(){
+    Job job;
+    if(encoded.front() == NULL || degraded.size() >= degraded.capacity()){
+        return false;
+    }
+
+    // the oldest packet stays until packet_delay more are held behind it
+    if(encoded.size() <= packet_delay){
+        size_t released = held_released;
+        do{
+            if(released == 0){
+                return false;
+            }
+        }while(!held_released.compare_exchange_weak(released, released - 1));
+    }
+    encoded.pop(job);
+
+    // room for the encoder to hand over another packet
+    encode_ready.signal();
+
+    if(bands.empty()){
+        decode(job);
+    }else{
+        stitch(job);
+    }
 
-    if(av_frame_make_writable(inputFrame) < 0){
-        std::cout << "Could not make the frame writable" << "\n";
+    degraded.push(job);     // cannot fail: only this thread fills it
+    result_ready.signal();
+    if(result_callback){
+        result_callback();
+    }
+    return true;
+}
+
+// With gop_size = 0 and no B-frames every frame comes out of the encoder
+// as exactly one packet holding one complete access unit, so the packet
+// goes to the decoder as it is (by reference) and the decoded picture is
+// available straight away.
+void H264_degrader::encode(Job &job){
+    // The caller's frame may be shared with other degraders, so it is never
+    // written to: the pts goes on a reference of our own
+    if(av_frame_ref(encoder_input, job.frame.input) < 0){
+        std::cout << "Could not reference the input frame" << "\n";
         throw;
     }
 
-    // encode frame
-    auto encode1 = std::chrono::high_resolution_clock::now();
-    inputFrame->pts = frame_count;
-    int ret = avcodec_send_frame(encoder_context, inputFrame);
+    const uint64_t encode_start = Trace::now();
+    encoder_input->pts = frame_count;
+    int ret = avcodec_send_frame(encoder_context, encoder_input);
+    av_frame_unref(encoder_input);
     if (ret < 0) {
         std::cout << "error sending a frame for encoding" << "\n";
         throw;
     }
-    int buffer_size = 0;
-    int count = 0;
-    while (ret >= 0) {
-        ret = avcodec_receive_packet(encoder_context, encoder_packet);
 
-        if (ret == AVERROR(EAGAIN)){
-            break;
-            std::cout << "did I make it here?\n";
+    // leaves the packet empty if the encoder held the frame back
+    ret = avcodec_receive_packet(encoder_context, job.packet);
+    if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+        std::cout << "error during encoding" << "\n";
+        throw;
+    }
+    Trace::event(kTraceEncode, job.frame.id, Trace::now() - encode_start, encode_start);
+
+    frame_count += 1;
+}
+
+void H264_degrader::decode(Job &job){
+    AVFrame *outputFrame = job.frame.output;
+    bool output_set = false;
+
+    if(job.packet->size > 0){
+        const uint64_t decode_start = Trace::now();
+
+        if(packet_sink){
+            packet_sink(job.packet);
         }
-        else if(ret == AVERROR_EOF){
-            break;
+        if(keep_packets){
+            job.frame.packet = av_packet_clone(job.packet);
         }
-        else if (ret < 0) {
-            std::cout << "error during encoding" << "\n";
+
+        int ret = avcodec_send_packet(decoder_context, job.packet);
+        av_packet_unref(job.packet);
+        if(ret < 0){
+            std::cout << "error while decoding the buffer: send_packet" << "\n";
             throw;
         }
 
-        buffer_size = encoder_packet->size;
-        assert(encoder_packet->size + AV_INPUT_BUFFER_PADDING_SIZE >= buffer_size);
-        std::memcpy(buffer.get(), encoder_packet->data, encoder_packet->size);
-        
-        if(count > 0){
-            std::cout << "error! multiple parsing passing!" << "\n";
-            throw;
+        ret = avcodec_receive_frame(decoder_context, outputFrame);
+        if (ret >= 0){
+            output_set = true;
         }
-        count += 1;
-    }
-    av_packet_unref(encoder_packet);
-    auto encode2 = std::chrono::high_resolution_clock::now();
-    auto encodetime = std::chrono::duration_cast<std::chrono::duration<double>>(encode2 - encode1);
-    std::cout << "encodetime " << encodetime.count() << "\n";
-
-
-    // decode frame
-    uint8_t *data = buffer.get();
-    int data_size = buffer_size;
-    while(data_size > 0){
-        auto parse1 = std::chrono::high_resolution_clock::now();
-        size_t ret1 = av_parser_parse2(decoder_parser,
-                                       decoder_context, 
-                                       &decoder_packet->data, 
-                                       &decoder_packet->size,
-                                       data,
-                                       data_size,
-                                       AV_NOPTS_VALUE, 
-                                       AV_NOPTS_VALUE, 
-                                       0);
-        
-        if(ret1 < 0){
-            std::cout << "error while parsing the buffer: decoding" << "\n";
+        else if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+            std::cout << "error during decoding: receive frame" << "\n";
             throw;
         }
+        Trace::event(kTraceDecode, job.frame.id, Trace::now() - decode_start, decode_start);
+    }
 
-        data += ret1;
-        data_size -= ret1;
-        auto parse2 = std::chrono::high_resolution_clock::now();
-        auto parsetime = std::chrono::duration_cast<std::chrono::duration<double>>(parse2 - parse1);
-        std::cout << "parsetime " << parsetime.count() << "\n";
-
-        auto decode1 = std::chrono::high_resolution_clock::now();
-        if(decoder_packet->size > 0){
-            if(avcodec_send_packet(decoder_context, decoder_packet) < 0){
-                std::cout << "error while decoding the buffer: send_packet" << "\n";
-                throw;                
-            }
-
-            size_t ret2 = avcodec_receive_frame(decoder_context, outputFrame);
-            if (ret2 == AVERROR(EAGAIN) || ret2 == AVERROR_EOF){
-                continue;
-            }
-            else if (ret2 < 0) {
-                std::cout << "error during decoding: receive frame" << "\n";
-                throw;
+    if(!output_set){
+        allocate(outputFrame);
+        // white, at whichever depth the frame has
+        const bool high_bit_depth = pix_fmt == AV_PIX_FMT_YUV422P10;
+        for(size_t plane = 0; plane < 3; plane++){
+            const size_t samples = plane == 0 ? width : width/2;
+            for(size_t row = 0; row < height; row++){
+                uint8_t *line = outputFrame->data[plane] + row*outputFrame->linesize[plane];
+                if(high_bit_depth){
+                    std::fill_n((uint16_t *)line, samples, plane == 0 ? 1020 : 512);
+                }else{
+                    std::memset(line, plane == 0 ? 255 : 128, samples);
+                }
             }
-            
         }
-        output_set = true;
-        auto decode2 = std::chrono::high_resolution_clock::now();
-        auto decodetime = std::chrono::duration_cast<std::chrono::duration<double>>(decode2 - decode1);
-        std::cout << "decodetime " << decodetime.count() << "\n";
     }
-    //av_packet_unref(decoder_packet);
+}
 
-    if(!output_set){
-        std::memset(outputFrame->data[0], 255, width*height);
-        std::memset(outputFrame->data[1], 128, width*height/2);
-        std::memset(outputFrame->data[2], 128, width*height/2);
+// The caller may hand in a frame whose decoded buffers it has already
+// given back
+void H264_degrader::allocate(AVFrame *outputFrame){
+    if(outputFrame->buf[0] == NULL){
+        outputFrame->format = pix_fmt;
+        outputFrame->width = width;
+        outputFrame->height = height;
+        if(av_frame_get_buffer(outputFrame, 64) < 0){
+            std::cout << "AVFrame could not allocate buffer: decoder" << "\n";
+            throw;
+        }
     }
+}
 
-    frame_count += 1;
+// Each band goes out as a reference to the whole input with its data
+// pointers moved down to the band, so nothing is copied and the input is
+// still only read.
+void H264_degrader::split(Job &job){
+    for(Band &band : bands){
+        AVFrame *window = band.windows[job.slot];
+        if(av_frame_ref(window, job.frame.input) < 0){
+            std::cout << "Could not reference the input frame" << "\n";
+            throw;
+        }
+        for(size_t plane = 0; plane < 3; plane++){
+            window->data[plane] += (band.first_row - band.rows_above) * window->linesize[plane];
+        }
+        window->height = band.degrader->height;
+
+        // cannot fail: the band degrader has room for every frame we hold
+        if(!band.degrader->submit(window, band.pictures[job.slot], job.frame.id)){
+            std::cout << "band degrader full" << "\n";
+            throw;
+        }
+    }
 }
 
+// Bands come back in the order they went out, so the next one from each
+// band degrader belongs to this frame. Each is copied in as soon as it is
+// ready, while the later bands may still be decoding.
+void H264_degrader::stitch(Job &job){
+    AVFrame *outputFrame = job.frame.output;
+    allocate(outputFrame);
+
+    const size_t bytes_per_sample = pix_fmt == AV_PIX_FMT_YUV422P10 ? 2 : 1;
+    for(Band &band : bands){
+        const DegradedFrame part = band.degrader->wait();
+        for(size_t plane = 0; plane < 3; plane++){
+            const size_t bytes = (plane == 0 ? width : width/2) * bytes_per_sample;
+            for(size_t row = 0; row < band.rows; row++){
+                std::memcpy(outputFrame->data[plane] + (band.first_row + row)*outputFrame->linesize[plane],
+                            part.output->data[plane] + (band.rows_above + row)*part.output->linesize[plane],
+                            bytes);
+            }
+        }
+        av_frame_unref(part.input);
+        av_frame_unref(part.output);
+    }
+}
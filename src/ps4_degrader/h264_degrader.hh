@@ -8,32 +8,118 @@ extern "C" {
 #include "libavutil/frame.h"
 }
 
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ColorConvert.hh"
+#include "eventfd.hh"
+#include "spsc_ring.hh"
+
+// A frame handed back by the degrader: the frame that was submitted
+// (free to reuse now) and the one holding the decoded picture. With
+// keep_packets, packet is the access unit the picture was decoded from
+// (NULL if the encoder gave none), for the caller to av_packet_free.
+struct DegradedFrame {
+    AVFrame *input;
+    AVFrame *output;
+    AVPacket *packet;
+    uint64_t id;
+
+    DegradedFrame() : input(NULL), output(NULL), packet(NULL), id(0) {}
+};
 
 class H264_degrader{
 public:    
     AVFrame *encoder_frame;
     AVFrame *decoder_frame;
     std::mutex degrader_mutex;
+
+    // if set, sees every encoded packet before it goes to the decoder
+    // (there is no single bitstream in band mode, so it is never called)
+    std::function<void(const AVPacket*)> packet_sink;
     
-    H264_degrader(size_t _width, size_t _height, size_t _bitrate, size_t quantization);
+    // if set, called from the decoder thread whenever a frame is ready to poll()
+    std::function<void()> result_callback;
+
+    // if set before the first submit(), every frame comes back with the
+    // packet it was decoded from (not in band mode, where there is none)
+    bool keep_packets;
+
+    // if set, called from the encoder thread with each input frame as soon
+    // as it is encoded, rather than handing it back with its output
+    // (DegradedFrame.input is then NULL). Not in band mode, where the
+    // bands read the input until they are done.
+    std::function<void(AVFrame*)> input_released;
+
+    // queue_depth bounds each of the queues between caller, encoder and
+    // decoder; codec_threads > 0 caps the threads libavcodec may use for
+    // each of them (0 leaves it to libavcodec). pixel_format is
+    // AV_PIX_FMT_YUV422P or, to degrade at 10 bits, AV_PIX_FMT_YUV422P10;
+    // frames_per_second is the source's, for the encoder's rate control.
+    //
+    // band_count > 1 cuts every frame into that many horizontal bands, on
+    // macroblock rows, and degrades each with a degrader of its own so the
+    // bands encode and decode on different cores at the same time; the
+    // decoder thread stitches them back together. band_overlap rows
+    // (rounded up to even) of each neighbour are coded along with a band
+    // and thrown away, so the band edges, where the encoder has nothing to
+    // predict from, do not end up in the picture. With codec_threads = 0
+    // the cores are shared out between the bands.
+    //
+    // packet_delay > 0 makes the degrader a delay line of its own: it holds
+    // that many encoded packets back, and only decodes one once another has
+    // been encoded behind it (or release_held() lets it go), so frames
+    // wait as access units of a few KB rather than as pictures. The output
+    // frames stay in the degrader for as long, so they should be ones
+    // without buffers of their own. Not in band mode.
+    H264_degrader(size_t _width, size_t _height, size_t _bitrate, size_t quantization, size_t queue_depth = 2, int codec_threads = 0,
+                  AVPixelFormat pixel_format = AV_PIX_FMT_YUV422P, int frames_per_second = 60,
+                  size_t band_count = 1, size_t band_overlap = 0, size_t packet_delay = 0);
     ~H264_degrader();
 
     void bgra2yuv422p(uint8_t* input, AVFrame* outputFrame, size_t width, size_t height);
     void yuv422p2bgra(AVFrame* inputFrame, uint8_t* output, size_t width, size_t height);
+    void uyvy2yuv422p(uint8_t* input, AVFrame* outputFrame, size_t width, size_t height);
+    void yuv422p2uyvy(AVFrame* inputFrame, uint8_t* output, size_t width, size_t height);
+    void v2102yuv422p10(uint8_t* input, AVFrame* outputFrame, size_t width, size_t height);
+    void yuv422p102v210(AVFrame* inputFrame, uint8_t* output, size_t width, size_t height);
     
-    void degrade(AVFrame *inputFrame, AVFrame *outputFrame);
+    // Asynchronous interface. The encoder and decoder each run on their own
+    // thread, so frame N+1 encodes while frame N decodes. submit() never
+    // blocks and returns false when the degrader is full; frames come back
+    // from poll() (non-blocking) or wait() in the order they went in. Only
+    // one thread may submit and one poll. The input frame is only read, so
+    // the same frame may be in several degraders at once. frame_id only
+    // labels the trace events for the frame.
+    bool submit(AVFrame *inputFrame, AVFrame *outputFrame, uint64_t frame_id);
+    bool poll(DegradedFrame &result);
+    DegradedFrame wait();
+
+    // submit() and wait(), for callers with nothing else in flight
+    void degrade(AVFrame *inputFrame, AVFrame *outputFrame, uint64_t frame_id = 0);
+
+    // With a packet delay: decode count held packets without waiting for
+    // more frames, for a degrader that is no longer given any. Any thread
+    // may call it.
+    void release_held(size_t count = 1);
+    size_t delay() const { return packet_delay; }
+
+    // what every degrader on this CPU converts BGRA with; kColorConvertScalar
+    // means swscale, which does not give the same bytes as the kernels
+    static ColorConvertKernel bgra_convert_kernel();
 
 private:
     const AVCodecID codec_id = AV_CODEC_ID_H264;
-    const AVPixelFormat pix_fmt = AV_PIX_FMT_YUV422P;
+    const AVPixelFormat pix_fmt;
 
     const size_t width;
     const size_t height;
     const size_t bitrate;
     const size_t quantization;
-    
-    std::unique_ptr<uint8_t[]> buffer;
 
     size_t frame_count;
 
@@ -43,10 +129,65 @@ private:
     AVCodecContext *encoder_context;
     AVCodecContext *decoder_context;
 
-    AVCodecParserContext *decoder_parser;
-    
-    AVPacket *encoder_packet;
-    AVPacket *decoder_packet;
+    AVFrame *encoder_input;         // the encoder's own reference to the submitted frame
+
+    const ColorConvertKernel convert_kernel;    // bgra_convert_kernel()
+
+    // a frame inside the degrader, with the packet it was encoded to
+    // (or, in band mode, the slot its bands are in)
+    struct Job {
+        DegradedFrame frame;
+        AVPacket *packet;
+        size_t slot;
+
+        Job() : frame(), packet(NULL), slot(0) {}
+    };
+
+    SPSCRing<Job> submitted;        // caller -> encoder
+    SPSCRing<Job> encoded;          // encoder -> decoder, with room for the held packets
+    SPSCRing<Job> degraded;         // decoder -> caller
+
+    const size_t packet_delay;
+    std::atomic<size_t> held_released;  // release_held() calls not yet acted on
+
+    // one more packet than the encoded queue holds, for the one being decoded
+    std::vector<AVPacket*> packets;
+    uint64_t packet_count;
+
+    EventFD encode_ready;           // something to encode, or room to put a packet
+    EventFD decode_ready;           // a packet to decode, or room to put a result
+    EventFD result_ready;           // for wait()
+
+    std::once_flag threads_started;
+    std::atomic<bool> stopping;
+    std::thread encoder_thread;
+    std::thread decoder_thread;
+
+    void run(EventFD &wakeup, bool (H264_degrader::*step)());
+    bool encode_next();
+    bool decode_next();
+    void encode(Job &job);
+    void decode(Job &job);
+
+    // Band mode: the encoder thread hands the bands of a frame out, the
+    // decoder thread collects them, in order, and stitches them together
+    struct Band {
+        std::unique_ptr<H264_degrader> degrader;
+        size_t first_row;           // the rows of the frame it gives back
+        size_t rows;
+        size_t rows_above;          // overlap coded above first_row
+        std::vector<AVFrame*> windows;      // per slot: the input, moved down to the band
+        std::vector<AVFrame*> pictures;     // per slot: the decoded band
+
+        Band() : degrader(), first_row(0), rows(0), rows_above(0), windows(), pictures() {}
+    };
+    std::vector<Band> bands;
+
+    void open_codecs(int codec_threads, int frames_per_second);
+    void open_bands(size_t count, size_t overlap, size_t queue_depth, int codec_threads, int frames_per_second);
+    void split(Job &job);
+    void stitch(Job &job);
+    void allocate(AVFrame *outputFrame);
 
     SwsContext *bgra2yuv422p_context;
     SwsContext *yuv422p2bgra_context;
@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "exception.hh"
+#include "Recording.hh"
+#include "RecordingCodec.hh"
+
+// Reads the recordings written by ps4_degrader -B and -A. Given a pair it
+// checks that they index the same frames and summarises them: frame
+// sizes, how well they were coded, how frames completed on the card and
+// their glass-to-glass latency. -x writes a run of frames to stdout, as
+// the card laid them out, eg to view with mplayer. -v checks that every
+// frame of an h264 after recording decodes back to the frame played out.
+
+static const char* CompletionName(uint32_t result)
+{
+    switch (result) {
+    case bmdOutputFrameCompleted:       return "displayed";
+    case bmdOutputFrameDisplayedLate:   return "late";
+    case bmdOutputFrameDropped:         return "dropped";
+    case bmdOutputFrameFlushed:         return "flushed";
+    default:                            return "unknown";
+    }
+}
+
+static double Percentile(const std::vector<int64_t>& sorted, double p)
+{
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)] / 1000.0;
+}
+
+static void Summarise(const RecordingReader& recording, const RecordingReader* other)
+{
+    const RecordingHeader& header = recording.Header();
+    const uint64_t frameCount = recording.FrameCount();
+    char pixelFormat[5] = { 0 };
+
+    // BMDPixelFormats are four character codes, or small numbers
+    for (int i = 0; i < 4; i++)
+        pixelFormat[i] = (char)(header.pixelFormat >> (24 - 8 * i));
+    std::cout << frameCount << " frames, pixel format "
+              << (header.pixelFormat > 0xffffff ? pixelFormat : std::to_string(header.pixelFormat))
+              << ", codec " << RecordingCodecName((RecordingCodec)header.codec)
+              << ", payloads aligned to " << header.alignment << "\n";
+    if (frameCount == 0)
+        return;
+
+    std::cout << "frame ids " << recording.Entry(0).frameId << " to " << recording.Entry(frameCount - 1).frameId << "\n";
+
+    std::vector<int64_t> latencies;
+    uint64_t completions[5] = { 0 };
+    uint64_t mismatched = 0;
+    uint64_t payloadBytes = 0, rawBytes = 0;
+
+    for (uint64_t frame = 0; frame < frameCount; frame++) {
+        const RecordingIndexEntry& entry = recording.Entry(frame);
+
+        if (frame == 0 || entry.width != recording.Entry(frame - 1).width ||
+            entry.height != recording.Entry(frame - 1).height)
+            std::cout << "  from frame " << frame << ": " << entry.width << "x" << entry.height << "\n";
+
+        payloadBytes += entry.size;
+        rawBytes += RecordingFrameBytes(header.pixelFormat, entry.width, entry.height);
+
+        completions[std::min(entry.completionResult, 4u)]++;
+        if (entry.displayHardwareTime != 0)
+            latencies.push_back(entry.displayHardwareTime - entry.captureHardwareTime);
+
+        if (other != NULL && (frame >= other->FrameCount() || other->Entry(frame).frameId != entry.frameId))
+            mismatched++;
+    }
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "payloads " << payloadBytes / 1e6 << " MB, of " << rawBytes / 1e6 << " MB of frames ("
+              << (double)rawBytes / std::max<uint64_t>(payloadBytes, 1) << ":1)\n";
+    if (other != NULL) {
+        uint64_t otherBytes = 0;
+        for (uint64_t frame = 0; frame < other->FrameCount(); frame++)
+            otherBytes += other->Entry(frame).size;
+        std::cout << "and " << otherBytes / 1e6 << " MB in the other\n";
+    }
+
+    for (uint32_t result = 0; result < 5; result++)
+        if (completions[result] > 0)
+            std::cout << completions[result] << " " << CompletionName(result) << "\n";
+
+    if (!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << "glass to glass (ms): p50 " << Percentile(latencies, 0.5)
+                  << ", p99 " << Percentile(latencies, 0.99)
+                  << ", max " << latencies.back() / 1000.0 << "\n";
+    }
+
+    if (other != NULL) {
+        if (mismatched == 0 && other->FrameCount() == frameCount)
+            std::cout << "the pair indexes the same frames\n";
+        else
+            std::cout << mismatched << " frames do not pair up (" << frameCount << " and "
+                      << other->FrameCount() << " frames)\n";
+    }
+}
+
+// An h264 payload only decodes after those before it, back to the last
+// one starting with a key unit or a new stream
+static uint64_t DecodeFrom(const RecordingReader& recording, uint64_t frame)
+{
+    if (recording.Header().codec != kRecordingH264)
+        return frame;
+
+    for (; frame > 0; frame--) {
+        const RecordingIndexEntry& entry = recording.Entry(frame);
+        RecordingUnitsHeader header;
+        RecordingUnit unit;
+        if (entry.size < sizeof(header) + sizeof(unit))
+            continue;
+        memcpy(&header, recording.Payload(frame), sizeof(header));
+        memcpy(&unit, recording.Payload(frame) + sizeof(header), sizeof(unit));
+        if (header.unitCount > 0 && (unit.flags & (kRecordingUnitKey | kRecordingUnitNewStream)))
+            break;
+    }
+    return frame;
+}
+
+static void Extract(const RecordingReader& recording, uint64_t first, uint64_t count)
+{
+    const uint64_t last = std::min(recording.FrameCount(), first + count);
+    const RecordingHeader& header = recording.Header();
+    std::unique_ptr<RecordingDecoder> decoder;
+    std::vector<uint8_t> decoded;
+
+    if (header.codec != kRecordingRaw)
+        decoder.reset(new RecordingDecoder((RecordingCodec)header.codec, header.pixelFormat, header.flags));
+
+    for (uint64_t frame = DecodeFrom(recording, std::min(first, last)); frame < last; frame++) {
+        const RecordingIndexEntry& entry = recording.Entry(frame);
+        const uint8_t* payload = recording.Payload(frame);
+        size_t left = entry.size;
+
+        // a frame that could not be coded has no payload, and comes out black
+        if (decoder) {
+            decoded.assign(RecordingFrameBytes(header.pixelFormat, entry.width, entry.height), 0);
+            if (entry.size > 0)
+                decoder->Decode(payload, entry.size, entry.width, entry.height, decoded.data());
+            payload = decoded.data();
+            left = decoded.size();
+        }
+        if (frame < first)
+            continue;
+
+        while (left > 0) {
+            const ssize_t written = SystemCall("write", write(STDOUT_FILENO, payload, left));
+            payload += written;
+            left -= written;
+        }
+    }
+}
+
+// Decodes every frame and compares it with the checksum of the frame
+// played out; returns whether they all match
+static bool Verify(const RecordingReader& recording)
+{
+    const RecordingHeader& header = recording.Header();
+    if (header.codec != kRecordingH264)
+        throw std::runtime_error("only h264 recordings hold checksums of their frames");
+
+    RecordingDecoder decoder(kRecordingH264, header.pixelFormat, header.flags);
+    std::vector<uint8_t> decoded;
+    uint64_t matched = 0, firstMismatch = UINT64_MAX;
+
+    for (uint64_t frame = 0; frame < recording.FrameCount(); frame++) {
+        const RecordingIndexEntry& entry = recording.Entry(frame);
+        RecordingUnitsHeader units;
+
+        // a frame that could not be recorded has no payload, nor a checksum
+        if (entry.size < sizeof(units)) {
+            if (firstMismatch == UINT64_MAX)
+                firstMismatch = frame;
+            continue;
+        }
+
+        decoded.assign(RecordingFrameBytes(header.pixelFormat, entry.width, entry.height), 0);
+        decoder.Decode(recording.Payload(frame), entry.size, entry.width, entry.height, decoded.data());
+        memcpy(&units, recording.Payload(frame), sizeof(units));
+
+        if (RecordingChecksum(decoded.data(), decoded.size()) == units.checksum)
+            matched++;
+        else if (firstMismatch == UINT64_MAX)
+            firstMismatch = frame;
+    }
+
+    std::cout << matched << " of " << recording.FrameCount() << " frames decode to the frame played out\n";
+    if (matched != recording.FrameCount())
+        std::cout << "the first that does not is frame " << firstMismatch << " (id "
+                  << recording.Entry(firstMismatch).frameId << ")\n";
+    return matched == recording.FrameCount();
+}
+
+int main(int argc, char **argv)
+{
+    const bool extract = argc > 1 && strcmp(argv[1], "-x") == 0;
+    const bool verify = argc > 1 && strcmp(argv[1], "-v") == 0;
+    if (extract ? argc != 4 : verify ? argc != 3 : argc < 2 || argc > 3) {
+        std::cerr << "usage: " << argv[0] << " <before recording> [<after recording>]\n"
+                  << "       " << argv[0] << " -x <first frame>[:<count>] <recording>\n"
+                  << "       " << argv[0] << " -v <h264 after recording>\n";
+        return 1;
+    }
+
+    try {
+        if (verify) {
+            RecordingReader recording(argv[2]);
+            return Verify(recording) ? 0 : 2;
+        }
+
+        if (extract) {
+            unsigned long long first = 0, count = 1;
+            if (sscanf(argv[2], "%llu:%llu", &first, &count) < 1) {
+                std::cerr << "-x takes <first frame>[:<count>]\n";
+                return 1;
+            }
+            RecordingReader recording(argv[3]);
+            Extract(recording, first, count);
+            return 0;
+        }
+
+        RecordingReader before(argv[1]);
+        std::unique_ptr<RecordingReader> after(argc == 3 ? new RecordingReader(argv[2]) : NULL);
+        Summarise(before, after.get());
+    } catch (const std::exception& e) {
+        print_exception(argv[0], e);
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,17 +1,777 @@
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <fstream>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "AVFramePool.hh"
+#include "ColorConvert.hh"
 #include "h264_degrader.hh"
+#include "exception.hh"
+#include "file.hh"
+#include "file_descriptor.hh"
 
 #define PIX(x) (x < 0 ? 0 : (x > 255 ? 255 : x))
 
+typedef std::vector<uint8_t> Picture;
+
+// Y, U and V of a decoded yuv422p frame, without the row padding
+static Picture copy_picture(const AVFrame *frame, size_t width, size_t height)
+{
+    Picture picture;
+    picture.reserve(width*height*2);
+
+    for(int plane = 0; plane < 3; plane++){
+        const size_t plane_width = plane == 0 ? width : width/2;
+        for(size_t y = 0; y < height; y++){
+            const uint8_t *row = frame->data[plane] + y*frame->linesize[plane];
+            picture.insert(picture.end(), row, row + plane_width);
+        }
+    }
+    return picture;
+}
+
+// The decode half of degrade() as it was before encoded packets went to
+// the decoder directly: the bitstream is copied out, re-split into access
+// units by the H.264 parser and decoded from those. The parser only knows
+// an access unit has ended once the next one starts, so pictures come out
+// a frame behind; decode(NULL, 0) flushes the last one.
+class ParsedDecoder
+{
+public:
+    ParsedDecoder() : context(NULL), parser(NULL), packet(NULL), frame(NULL)
+    {
+        AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+        if(codec == NULL || (context = avcodec_alloc_context3(codec)) == NULL ||
+           avcodec_open2(context, codec, NULL) < 0 ||
+           (parser = av_parser_init(codec->id)) == NULL ||
+           (packet = av_packet_alloc()) == NULL ||
+           (frame = av_frame_alloc()) == NULL){
+            throw std::runtime_error("could not set up the reference decoder");
+        }
+    }
+
+    ~ParsedDecoder()
+    {
+        av_frame_free(&frame);
+        av_packet_free(&packet);
+        av_parser_close(parser);
+        avcodec_free_context(&context);
+    }
+
+    void decode(const uint8_t *data, int size, size_t width, size_t height, std::deque<Picture> &pictures)
+    {
+        const bool flush = size == 0;
+
+        do {
+            int used = av_parser_parse2(parser, context, &packet->data, &packet->size,
+                                        data, size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+            if(used < 0){
+                throw std::runtime_error("error while parsing the buffer");
+            }
+            data += used;
+            size -= used;
+
+            if(packet->size > 0){
+                if(avcodec_send_packet(context, packet) < 0){
+                    throw std::runtime_error("error while decoding the buffer: send_packet");
+                }
+                receive(width, height, pictures);
+            }
+        } while(size > 0);
+
+        if(flush){
+            avcodec_send_packet(context, NULL);
+            receive(width, height, pictures);
+        }
+    }
+
+    ParsedDecoder(const ParsedDecoder&) = delete;
+    ParsedDecoder& operator=(const ParsedDecoder&) = delete;
+
+private:
+    void receive(size_t width, size_t height, std::deque<Picture> &pictures)
+    {
+        while(avcodec_receive_frame(context, frame) >= 0){
+            pictures.push_back(copy_picture(frame, width, height));
+            av_frame_unref(frame);
+        }
+    }
+
+    AVCodecContext *context;
+    AVCodecParserContext *parser;
+    AVPacket *packet;
+    AVFrame *frame;
+};
+
+// Run every frame of the input through degrade() and check that what it
+// decodes is bit-for-bit what the parser-based decode path gets from the
+// same packets.
+static int compare(const std::string &input_filename, size_t width, size_t height)
+{
+    const size_t frame_size = width*height*4;
+
+    std::ifstream infile(input_filename, std::ios::binary);
+    if(!infile.is_open()){
+        std::cout << "Could not open file: " << input_filename << "\n";
+        return 1;
+    }
+
+    std::unique_ptr<uint8_t[]> input_buffer(new uint8_t[frame_size]);
+    H264_degrader degrader(width, height, (1<<20), 32);
+    ParsedDecoder reference;
+
+    std::vector<uint8_t> bitstream;
+    degrader.packet_sink = [&bitstream](const AVPacket *packet){
+        bitstream.assign(packet->data, packet->data + packet->size);
+        bitstream.resize(packet->size + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+    };
+
+    std::deque<Picture> direct, parsed;
+    size_t frames = 0, compared = 0, differing = 0, differing_bytes = 0;
+
+    auto match_up = [&](){
+        while(!direct.empty() && !parsed.empty()){
+            const Picture &a = direct.front(), &b = parsed.front();
+            if(a != b){
+                size_t bytes = 0;
+                for(size_t i = 0; i < a.size() && i < b.size(); i++){
+                    bytes += a[i] != b[i];
+                }
+                std::cout << "picture " << compared << " differs in " << bytes << " bytes\n";
+                differing++;
+                differing_bytes += bytes;
+            }
+            direct.pop_front();
+            parsed.pop_front();
+            compared++;
+        }
+    };
+
+    while(infile.read((char*)input_buffer.get(), frame_size)){
+        bitstream.clear();
+        degrader.bgra2yuv422p(input_buffer.get(), degrader.encoder_frame, width, height);
+        degrader.degrade(degrader.encoder_frame, degrader.decoder_frame, frames);
+        direct.push_back(copy_picture(degrader.decoder_frame, width, height));
+
+        if(!bitstream.empty()){
+            reference.decode(bitstream.data(), bitstream.size() - AV_INPUT_BUFFER_PADDING_SIZE, width, height, parsed);
+        }
+        match_up();
+        frames++;
+    }
+    reference.decode(NULL, 0, width, height, parsed);
+    match_up();
+
+    std::cout << "compare: " << frames << " frames, " << compared << " pictures compared, "
+              << differing << " differ (" << differing_bytes << " bytes), "
+              << direct.size() + parsed.size() << " unmatched\n";
+
+    return (differing == 0 && direct.empty() && parsed.empty()) ? 0 : 1;
+}
+
+// Degrade a whole file with one degrader per worker, each worker pinned to
+// a core of its own. Every frame is intra coded, so frames do not depend
+// on each other and workers simply take the next one. Finished frames wait
+// in a window of 2 * workers slots until every frame before them has been
+// written; a worker that gets that far ahead waits for the writer.
+static int batch(const std::string &input_filename, const std::string &output_filename,
+                 size_t workers, size_t width, size_t height)
+{
+    const size_t frame_size = width*height*4;
+
+    const File input(input_filename);
+    FileDescriptor output(SystemCall("open " + output_filename,
+                                     open(output_filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0664)));
+
+    const size_t frames = input.size() / frame_size;
+    const size_t window = 2 * workers;
+    const unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<std::unique_ptr<uint8_t[]>> slots;
+    std::vector<size_t> slot_frame(window, frames);     // frames means empty
+    for(size_t i = 0; i < window; i++){
+        slots.emplace_back(new uint8_t[frame_size]);
+    }
+
+    std::atomic<size_t> next_frame(0);
+    size_t written = 0;
+    std::mutex window_mutex;
+    std::condition_variable window_cv;
+
+    auto worker = [&](size_t index){
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % cores, &cpus);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0){
+            std::cout << "worker " << index << ": could not pin to core " << index % cores << "\n";
+        }
+
+        // created after pinning so the degrader's threads stay on this core too
+        H264_degrader degrader(width, height, (1<<20), 32, 1, 1);
+
+        for(size_t frame = next_frame++; frame < frames; frame = next_frame++){
+            {
+                std::unique_lock<std::mutex> lock(window_mutex);
+                window_cv.wait(lock, [&](){ return frame < written + window; });
+            }
+
+            uint8_t *bgra = const_cast<uint8_t*>(input(frame * frame_size, frame_size).buffer());
+            degrader.bgra2yuv422p(bgra, degrader.encoder_frame, width, height);
+            degrader.degrade(degrader.encoder_frame, degrader.decoder_frame, frame);
+            degrader.yuv422p2bgra(degrader.decoder_frame, slots[frame % window].get(), width, height);
+
+            {
+                std::lock_guard<std::mutex> guard(window_mutex);
+                slot_frame[frame % window] = frame;
+            }
+            window_cv.notify_all();
+        }
+    };
+
+    std::cout << "batch: " << frames << " frames, " << workers << " workers on " << cores << " cores\n";
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < workers; i++){
+        threads.emplace_back(worker, i);
+    }
+
+    for(size_t frame = 0; frame < frames; frame++){
+        const size_t slot = frame % window;
+        {
+            std::unique_lock<std::mutex> lock(window_mutex);
+            window_cv.wait(lock, [&](){ return slot_frame[slot] == frame; });
+        }
+
+        output.write(Chunk(slots[slot].get(), frame_size));
+
+        {
+            std::lock_guard<std::mutex> guard(window_mutex);
+            slot_frame[slot] = frames;
+            written++;
+        }
+        window_cv.notify_all();
+    }
+
+    for(std::thread &thread : threads){
+        thread.join();
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - start);
+    std::cout << frames << " frames in " << elapsed.count() << " s (" << frames / elapsed.count() << " fps, "
+              << frames / elapsed.count() / 60 << "x real time at 60 fps)\n";
+    return 0;
+}
+
+// One encoder setting of a sweep, with its own output file and timings
+struct SweepSetting
+{
+    int bitrate;
+    int quantization;
+    std::unique_ptr<H264_degrader> degrader;
+    std::unique_ptr<AVFramePool> outputs;
+    std::unique_ptr<FileDescriptor> output;
+    double total_latency;
+    double max_latency;
+};
+
+// Degrade a file at several bitrate:quantization settings in one pass.
+// Each frame is read and converted to yuv422p once and the same AVFrame
+// is submitted to every setting's degrader, so all the encoders run
+// side by side on the one conversion. A collector thread per setting
+// takes its results in order, converts them back and writes
+// <prefix>_<bitrate>_<quantization>.raw; the last setting to hand a frame
+// back returns it to the input pool.
+static int sweep(const std::string &input_filename, const std::string &output_prefix,
+                 const std::vector<std::string> &specs, size_t width, size_t height)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+
+    const size_t frame_size = width*height*4;
+    const size_t frames_in_flight = 3;
+
+    const File input(input_filename);
+    const size_t frames = input.size() / frame_size;
+
+    std::vector<SweepSetting> settings;
+    for(const std::string &spec : specs){
+        int bitrate, quantization;
+        char extra;
+        if(sscanf(spec.c_str(), "%d:%d%c", &bitrate, &quantization, &extra) != 2 || bitrate <= 0 || quantization < 0){
+            throw std::runtime_error("bad setting \"" + spec + "\", expected <bitrate>:<quantization>");
+        }
+
+        const std::string output_filename = output_prefix + "_" + std::to_string(bitrate) + "_" + std::to_string(quantization) + ".raw";
+        settings.push_back(SweepSetting{bitrate, quantization,
+            std::unique_ptr<H264_degrader>(new H264_degrader(width, height, bitrate, quantization, frames_in_flight)),
+            std::unique_ptr<AVFramePool>(new AVFramePool(width, height, AV_PIX_FMT_YUV422P, frames_in_flight)),
+            std::unique_ptr<FileDescriptor>(new FileDescriptor(SystemCall("open " + output_filename,
+                open(output_filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0664)))),
+            0, 0});
+    }
+
+    AVFramePool inputs(width, height, AV_PIX_FMT_YUV422P, frames_in_flight);
+    std::vector<Clock::time_point> submit_times(frames_in_flight);
+    std::unique_ptr<std::atomic<size_t>[]> users(new std::atomic<size_t>[frames_in_flight]);
+
+    // signalled whenever a collector gives a frame back to a pool
+    std::mutex progress_mutex;
+    std::condition_variable progress_cv;
+
+    auto collect = [&](SweepSetting &setting){
+        std::unique_ptr<uint8_t[]> bgra(new uint8_t[frame_size]);
+
+        for(size_t frame = 0; frame < frames; frame++){
+            const DegradedFrame done = setting.degrader->wait();
+            const double latency = std::chrono::duration_cast<std::chrono::duration<double>>(Clock::now() - submit_times[done.id % frames_in_flight]).count();
+            setting.total_latency += latency;
+            setting.max_latency = std::max(setting.max_latency, latency);
+
+            setting.degrader->yuv422p2bgra(done.output, bgra.get(), width, height);
+            setting.output->write(Chunk(bgra.get(), frame_size));
+
+            av_frame_unref(done.output);
+            setting.outputs->Release(done.output);
+            if(--users[done.id % frames_in_flight] == 0){
+                inputs.Release(done.input);
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(progress_mutex);
+            }
+            progress_cv.notify_all();
+        }
+    };
+
+    auto acquire = [&](AVFramePool &pool){
+        AVFrame *frame = NULL;
+        std::unique_lock<std::mutex> lock(progress_mutex);
+        progress_cv.wait(lock, [&](){ return (frame = pool.Acquire()) != NULL; });
+        return frame;
+    };
+
+    std::cout << "sweep: " << frames << " frames, " << settings.size() << " settings\n";
+
+    auto start = Clock::now();
+    std::vector<std::thread> collectors;
+    for(SweepSetting &setting : settings){
+        collectors.emplace_back(collect, std::ref(setting));
+    }
+
+    double convert_time = 0;
+    for(size_t frame = 0; frame < frames; frame++){
+        AVFrame *yuv = acquire(inputs);
+
+        auto convert_start = Clock::now();
+        uint8_t *bgra = const_cast<uint8_t*>(input(frame * frame_size, frame_size).buffer());
+        settings.front().degrader->bgra2yuv422p(bgra, yuv, width, height);
+        convert_time += std::chrono::duration_cast<std::chrono::duration<double>>(Clock::now() - convert_start).count();
+
+        // an input slot is only reused once every setting has returned it
+        users[frame % frames_in_flight] = settings.size();
+        submit_times[frame % frames_in_flight] = Clock::now();
+        for(SweepSetting &setting : settings){
+            // each setting has at most frames_in_flight outputs, which is
+            // also its degrader's queue depth, so submit cannot fail here
+            if(!setting.degrader->submit(yuv, acquire(*setting.outputs), frame)){
+                throw std::runtime_error("degrader queue full");
+            }
+        }
+    }
+
+    for(std::thread &collector : collectors){
+        collector.join();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(Clock::now() - start);
+
+    for(const SweepSetting &setting : settings){
+        std::cout << "bitrate " << setting.bitrate << " quantization " << setting.quantization
+                  << ": mean " << setting.total_latency / std::max<size_t>(frames, 1) * 1000
+                  << " ms, max " << setting.max_latency * 1000 << " ms\n";
+    }
+    std::cout << "bgra2yuv422p: " << convert_time / std::max<size_t>(frames, 1) * 1000 << " ms per frame, once for "
+              << settings.size() << " settings\n";
+    std::cout << frames << " frames x " << settings.size() << " settings in " << elapsed.count() << " s ("
+              << frames / elapsed.count() << " fps, " << frames * settings.size() / elapsed.count() << " encodes/s)\n";
+    return 0;
+}
+
+// Largest difference between two buffers and how many bytes differ at all
+struct ByteDifference
+{
+    int largest;
+    size_t count;
+};
+
+static ByteDifference compare_bytes(const uint8_t *a, const uint8_t *b, size_t size)
+{
+    ByteDifference difference = {0, 0};
+    for(size_t i = 0; i < size; i++){
+        const int d = std::abs(a[i] - b[i]);
+        difference.largest = std::max(difference.largest, d);
+        difference.count += d != 0;
+    }
+    return difference;
+}
+
+// Check the colour conversion kernels against swscale, then time them.
+// The vector kernels have to give exactly the scalar kernel's bytes, and
+// every kernel has to stay within a few levels of swscale on a frame of
+// gradients and noise: swscale rounds in its own places, so bit exactness
+// is not expected there. Timing covers 720p, 1080p and 4K, both
+// directions, on one thread and with the rows split between threads.
+// v210 is only repacked, so there every kernel has to round trip 10 bit
+// noise exactly; it is timed at 1080p.
+static int convert(size_t threads)
+{
+    const int yuv_tolerance = 2;
+    const int bgra_tolerance = 3;
+    const int width = 1280, height = 720;
+    const size_t frame_size = width*height*4;
+
+    std::vector<ColorConvertKernel> kernels;
+    for(ColorConvertKernel kernel : {kColorConvertScalar, kColorConvertAVX2, kColorConvertAVX512}){
+        if(ColorConvertSupported(kernel)){
+            kernels.push_back(kernel);
+        }
+    }
+    std::cout << "best kernel: " << ColorConvertKernelName(ColorConvertBestKernel()) << "\n";
+
+    std::vector<uint8_t> bgra(frame_size);
+    uint32_t noise = 1;
+    for(int y = 0; y < height; y++){
+        for(int x = 0; x < width; x++){
+            noise = noise * 1664525 + 1013904223;
+            uint8_t *p = &bgra[(y*width + x)*4];
+            p[0] = (x * 255 / width + (noise >> 28)) & 0xff;
+            p[1] = (y * 255 / height + (noise >> 20)) & 0xff;
+            p[2] = (noise >> 24) & 0xff;
+            p[3] = 255;
+        }
+    }
+
+    SwsContext *to_yuv = sws_getContext(width, height, AV_PIX_FMT_BGRA, width, height, AV_PIX_FMT_YUV422P, 0, 0, 0, 0);
+    SwsContext *to_bgra = sws_getContext(width, height, AV_PIX_FMT_YUV422P, width, height, AV_PIX_FMT_BGRA, 0, 0, 0, 0);
+    if(to_yuv == NULL || to_bgra == NULL){
+        throw std::runtime_error("could not create the swscale contexts");
+    }
+
+    AVFramePool frames(width, height, AV_PIX_FMT_YUV422P, 2);
+    AVFrame *reference = frames.Acquire();
+    AVFrame *converted = frames.Acquire();
+    const int bgra_stride[1] = { 4*width };
+    const uint8_t *bgra_planes[1] = { bgra.data() };
+    sws_scale(to_yuv, bgra_planes, bgra_stride, 0, height, reference->data, reference->linesize);
+
+    std::vector<uint8_t> reference_bgra(frame_size), converted_bgra(frame_size), scalar_bgra(frame_size);
+    uint8_t *reference_bgra_planes[1] = { reference_bgra.data() };
+    sws_scale(to_bgra, reference->data, reference->linesize, 0, height, reference_bgra_planes, bgra_stride);
+
+    Picture scalar_yuv;     // kernels[0] is always the scalar one
+    bool passed = true;
+
+    for(ColorConvertKernel kernel : kernels){
+        BGRAToYUV422P(kernel, bgra.data(), 4*width, converted->data, converted->linesize, width, 0, height);
+        YUV422PToBGRA(kernel, reference->data, reference->linesize, converted_bgra.data(), 4*width, width, 0, height);
+
+        const Picture yuv = copy_picture(converted, width, height);
+        const Picture expected = copy_picture(reference, width, height);
+        const ByteDifference yuv_difference = compare_bytes(yuv.data(), expected.data(), yuv.size());
+        const ByteDifference bgra_difference = compare_bytes(converted_bgra.data(), reference_bgra.data(), frame_size);
+
+        bool exact = true;
+        if(kernel == kColorConvertScalar){
+            scalar_yuv = yuv;
+            scalar_bgra = converted_bgra;
+        } else {
+            exact = yuv == scalar_yuv && converted_bgra == scalar_bgra;
+        }
+
+        const bool ok = exact && yuv_difference.largest <= yuv_tolerance && bgra_difference.largest <= bgra_tolerance;
+        passed = passed && ok;
+        std::cout << ColorConvertKernelName(kernel) << ": to yuv422p max " << yuv_difference.largest << " (" << yuv_difference.count
+                  << " bytes differ), to bgra max " << bgra_difference.largest << " (" << bgra_difference.count << " bytes differ)"
+                  << (exact ? "" : ", differs from scalar") << (ok ? "" : "  FAILED") << "\n";
+    }
+
+    sws_freeContext(to_yuv);
+    sws_freeContext(to_bgra);
+    frames.Release(reference);
+    frames.Release(converted);
+
+    {
+        // planes of 16 bit samples, with a few spare bytes on each row
+        const int w = 1920, h = 1080;
+        const int strides[3] = { 2*w + 64, w + 64, w + 64 };
+        std::vector<uint8_t> planes[3], unpacked[3];
+        uint8_t *plane_data[3], *unpacked_data[3];
+        for(int i = 0; i < 3; i++){
+            planes[i].resize(strides[i] * h);
+            for(size_t j = 0; j < planes[i].size() / 2; j++){
+                noise = noise * 1664525 + 1013904223;
+                reinterpret_cast<uint16_t *>(planes[i].data())[j] = noise >> 22;
+            }
+            plane_data[i] = planes[i].data();
+        }
+
+        std::vector<uint8_t> v210(V210RowBytes(w) * h), scalar_v210;
+        for(ColorConvertKernel kernel : kernels){
+            YUV422P10ToV210(kernel, plane_data, strides, v210.data(), V210RowBytes(w), w, 0, h);
+            if(kernel == kColorConvertScalar){
+                scalar_v210 = v210;
+            }
+            for(int i = 0; i < 3; i++){
+                unpacked[i].assign(planes[i].size(), 0);
+                unpacked_data[i] = unpacked[i].data();
+            }
+            V210ToYUV422P10(kernel, v210.data(), V210RowBytes(w), unpacked_data, strides, w, 0, h);
+
+            bool exact = v210 == scalar_v210;
+            for(int i = 0; i < 3; i++){
+                const size_t row_bytes = i == 0 ? 2*w : w;
+                for(int y = 0; y < h; y++){
+                    exact = exact && std::memcmp(&planes[i][y * strides[i]], &unpacked[i][y * strides[i]], row_bytes) == 0;
+                }
+            }
+
+            const int iterations = 100;
+            auto t0 = std::chrono::high_resolution_clock::now();
+            for(int i = 0; i < iterations; i++){
+                V210ToYUV422P10(kernel, v210.data(), V210RowBytes(w), unpacked_data, strides, w, 0, h);
+            }
+            auto t1 = std::chrono::high_resolution_clock::now();
+            for(int i = 0; i < iterations; i++){
+                YUV422P10ToV210(kernel, plane_data, strides, v210.data(), V210RowBytes(w), w, 0, h);
+            }
+            auto t2 = std::chrono::high_resolution_clock::now();
+
+            passed = passed && exact;
+            std::cout << w << "x" << h << " v210 " << ColorConvertKernelName(kernel) << ": to yuv422p10 "
+                      << std::chrono::duration_cast<std::chrono::duration<double>>(t1 - t0).count() / iterations * 1000 << " ms, to v210 "
+                      << std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count() / iterations * 1000 << " ms"
+                      << (exact ? "" : "  FAILED") << "\n";
+        }
+    }
+
+    const int sizes[3][2] = { {1280, 720}, {1920, 1080}, {3840, 2160} };
+    for(const auto &size : sizes){
+        const int w = size[0], h = size[1];
+        const int iterations = 4096*2160 / (w*h) * 10;
+        std::vector<uint8_t> image(w*h*4, 128);
+        AVFramePool pool(w, h, AV_PIX_FMT_YUV422P, 1);
+        AVFrame *yuv = pool.Acquire();
+
+        SwsContext *sws_yuv = sws_getContext(w, h, AV_PIX_FMT_BGRA, w, h, AV_PIX_FMT_YUV422P, 0, 0, 0, 0);
+        SwsContext *sws_bgra = sws_getContext(w, h, AV_PIX_FMT_YUV422P, w, h, AV_PIX_FMT_BGRA, 0, 0, 0, 0);
+        uint8_t *image_planes[1] = { image.data() };
+        const int image_stride[1] = { 4*w };
+
+        auto time = [&](const std::function<void()> &to_yuv422p, const std::function<void()> &to_bgra32){
+            double to_seconds = 0, from_seconds = 0;
+            for(int i = 0; i < iterations; i++){
+                auto t0 = std::chrono::high_resolution_clock::now();
+                to_yuv422p();
+                auto t1 = std::chrono::high_resolution_clock::now();
+                to_bgra32();
+                auto t2 = std::chrono::high_resolution_clock::now();
+                to_seconds += std::chrono::duration_cast<std::chrono::duration<double>>(t1 - t0).count();
+                from_seconds += std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count();
+            }
+            std::cout << " to yuv422p " << to_seconds / iterations * 1000 << " ms, to bgra " << from_seconds / iterations * 1000 << " ms\n";
+        };
+
+        std::cout << w << "x" << h << " swscale:";
+        time([&](){ sws_scale(sws_yuv, image_planes, image_stride, 0, h, yuv->data, yuv->linesize); },
+             [&](){ sws_scale(sws_bgra, yuv->data, yuv->linesize, 0, h, image_planes, image_stride); });
+
+        for(ColorConvertKernel kernel : kernels){
+            std::cout << w << "x" << h << " " << ColorConvertKernelName(kernel) << ":";
+            time([&](){ BGRAToYUV422P(kernel, image.data(), 4*w, yuv->data, yuv->linesize, w, 0, h); },
+                 [&](){ YUV422PToBGRA(kernel, yuv->data, yuv->linesize, image.data(), 4*w, w, 0, h); });
+        }
+
+        // each thread takes a band of rows
+        auto sliced = [&](const std::function<void(int, int)> &rows){
+            std::vector<std::thread> workers;
+            for(size_t t = 0; t < threads; t++){
+                workers.emplace_back(rows, h * t / threads, h * (t + 1) / threads);
+            }
+            for(std::thread &worker : workers){
+                worker.join();
+            }
+        };
+        if(threads > 1){
+            const ColorConvertKernel kernel = ColorConvertBestKernel();
+            std::cout << w << "x" << h << " " << ColorConvertKernelName(kernel) << " on " << threads << " threads:";
+            time([&](){ sliced([&](int first, int last){ BGRAToYUV422P(kernel, image.data(), 4*w, yuv->data, yuv->linesize, w, first, last); }); },
+                 [&](){ sliced([&](int first, int last){ YUV422PToBGRA(kernel, yuv->data, yuv->linesize, image.data(), 4*w, w, first, last); }); });
+        }
+
+        sws_freeContext(sws_yuv);
+        sws_freeContext(sws_bgra);
+        pool.Release(yuv);
+    }
+
+    return passed ? 0 : 1;
+}
+
+static uint64_t total_difference(const Picture &a, const Picture &b)
+{
+    uint64_t total = 0;
+    for(size_t i = 0; i < a.size(); i++){
+        total += std::abs(a[i] - b[i]);
+    }
+    return total;
+}
+
+// Degrade every frame once whole and once cut into bands, a frame at a
+// time so that each time is one frame's latency, and write the stitched
+// frames out. Each band is coded on its own, so the two pictures are
+// close rather than identical; seams show up as the largest difference.
+// Frame N must come back as frame N: a band decoder that holds pictures
+// back hands out an earlier frame's, nearer the last whole picture than
+// this one, and fails the check.
+static int bands(const std::string &input_filename, const std::string &output_filename,
+                 size_t band_count, size_t overlap, size_t width, size_t height)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+
+    const size_t frame_size = width*height*4;
+
+    const File input(input_filename);
+    const size_t frames = input.size() / frame_size;
+    FileDescriptor output(SystemCall("open " + output_filename,
+                                     open(output_filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0664)));
+
+    H264_degrader whole(width, height, (1<<20), 32);
+    H264_degrader banded(width, height, (1<<20), 32, 2, 0, AV_PIX_FMT_YUV422P, 60, band_count, overlap);
+
+    std::unique_ptr<uint8_t[]> bgra(new uint8_t[frame_size]);
+    double whole_total = 0, whole_max = 0, banded_total = 0, banded_max = 0;
+    ByteDifference largest = {0, 0};
+    Picture previous;
+    size_t late = 0;
+
+    auto time_degrade = [&](H264_degrader &degrader, size_t frame, double &total, double &max){
+        auto start = Clock::now();
+        degrader.degrade(whole.encoder_frame, degrader.decoder_frame, frame);
+        const double latency = std::chrono::duration_cast<std::chrono::duration<double>>(Clock::now() - start).count();
+        total += latency;
+        max = std::max(max, latency);
+    };
+
+    for(size_t frame = 0; frame < frames; frame++){
+        uint8_t *source = const_cast<uint8_t*>(input(frame * frame_size, frame_size).buffer());
+        whole.bgra2yuv422p(source, whole.encoder_frame, width, height);
+
+        time_degrade(whole, frame, whole_total, whole_max);
+        time_degrade(banded, frame, banded_total, banded_max);
+
+        const Picture a = copy_picture(whole.decoder_frame, width, height);
+        const Picture b = copy_picture(banded.decoder_frame, width, height);
+        const ByteDifference difference = compare_bytes(a.data(), b.data(), a.size());
+        largest.largest = std::max(largest.largest, difference.largest);
+        largest.count += difference.count;
+        if(!previous.empty() && total_difference(b, previous) < total_difference(b, a)){
+            late++;
+        }
+        previous = a;
+
+        banded.yuv422p2bgra(banded.decoder_frame, bgra.get(), width, height);
+        output.write(Chunk(bgra.get(), frame_size));
+    }
+
+    const size_t counted = std::max<size_t>(frames, 1);
+    std::cout << "bands: " << frames << " frames, " << band_count << " bands, " << overlap << " rows overlap\n";
+    std::cout << "whole frame: mean " << whole_total / counted * 1000 << " ms, max " << whole_max * 1000 << " ms\n";
+    std::cout << "banded: mean " << banded_total / counted * 1000 << " ms, max " << banded_max * 1000 << " ms\n";
+    std::cout << "largest difference " << largest.largest << ", " << largest.count << " bytes differ\n";
+    std::cout << late << " banded frames came back late" << (late == 0 ? "" : "  FAILED") << "\n";
+    return late == 0 ? 0 : 1;
+}
+
 int main(int argc, char **argv)
 {
+    // raw files carry no geometry; 720p unless told otherwise
+    size_t width = 1280;
+    size_t height = 720;
+    if(argc >= 3 && std::string(argv[1]) == "--size"){
+        if(sscanf(argv[2], "%zux%zu", &width, &height) != 2 || width == 0 || height == 0 || width % 2 != 0){
+            std::cout << "--size takes <width>x<height>, with an even width\n";
+            return 1;
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if((argc == 2 || argc == 3) && std::string(argv[1]) == "--convert"){
+        try {
+            return convert(argc == 3 ? std::max(1, atoi(argv[2])) : std::max(1u, std::thread::hardware_concurrency()));
+        } catch (const std::exception &e) {
+            print_exception(argv[0], e);
+            return 1;
+        }
+    }
+
+    if(argc >= 5 && std::string(argv[1]) == "--sweep"){
+        try {
+            return sweep(argv[2], argv[3], std::vector<std::string>(argv + 4, argv + argc), width, height);
+        } catch (const std::exception &e) {
+            print_exception(argv[0], e);
+            return 1;
+        }
+    }
+
+    if(argc == 5 && std::string(argv[1]) == "--batch"){
+        try {
+            return batch(argv[3], argv[4], std::max(1, atoi(argv[2])), width, height);
+        } catch (const std::exception &e) {
+            print_exception(argv[0], e);
+            return 1;
+        }
+    }
+
+    if(argc == 5 && std::string(argv[1]) == "--bands"){
+        size_t band_count = 0, overlap = 0;
+        if(sscanf(argv[2], "%zu:%zu", &band_count, &overlap) < 1 || band_count == 0){
+            std::cout << "--bands takes <bands>[:<overlap rows>]\n";
+            return 1;
+        }
+        try {
+            return bands(argv[3], argv[4], band_count, overlap, width, height);
+        } catch (const std::exception &e) {
+            print_exception(argv[0], e);
+            return 1;
+        }
+    }
+
+    if(argc == 3 && std::string(argv[1]) == "--compare"){
+        return compare(argv[2], width, height);
+    }
+
     if(argc != 3){
-        std::cout << "usage: " << argv[0] << " <input.raw> <ouptut.raw>\n";
+        std::cout << "usage: " << argv[0] << " [--size <width>x<height>] <input.raw> <ouptut.raw>\n";
+        std::cout << "       " << argv[0] << " [--size <width>x<height>] --compare <input.raw>\n";
+        std::cout << "       " << argv[0] << " [--size <width>x<height>] --batch <workers> <input.raw> <output.raw>\n";
+        std::cout << "       " << argv[0] << " [--size <width>x<height>] --sweep <input.raw> <output_prefix> <bitrate>:<quantization>...\n";
+        std::cout << "       " << argv[0] << " [--size <width>x<height>] --bands <bands>[:<overlap rows>] <input.raw> <output.raw>\n";
+        std::cout << "       " << argv[0] << " --convert [threads]\n";
         return 0;
     }
 
@@ -21,8 +781,6 @@ int main(int argc, char **argv)
     std::cout << "input: " << input_filename << "\n";
     std::cout << "ouput: " << output_filename << "\n";    
 
-    const size_t width = 1280;
-    const size_t height = 720;
     const size_t bytes_per_pixel = 4;
     const size_t frame_size = width*height*bytes_per_pixel;
 
@@ -41,44 +799,65 @@ int main(int argc, char **argv)
     std::shared_ptr<uint8_t> input_buffer(new uint8_t[frame_size]);
     std::shared_ptr<uint8_t> output_buffer(new uint8_t[frame_size]);
 
-    std::shared_ptr<uint8_t> y_buffer1(new uint8_t[frame_size/4]);
-    std::shared_ptr<uint8_t> u_buffer1(new uint8_t[frame_size/8]);
-    std::shared_ptr<uint8_t> v_buffer1(new uint8_t[frame_size/8]);
-    std::shared_ptr<uint8_t> y_buffer2(new uint8_t[frame_size/4]);
-    std::shared_ptr<uint8_t> u_buffer2(new uint8_t[frame_size/8]);
-    std::shared_ptr<uint8_t> v_buffer2(new uint8_t[frame_size/8]);
-    
-    uint8_t *yuv_input[] = {y_buffer1.get(), u_buffer1.get(), v_buffer1.get()};
-    uint8_t *yuv_output[] = {y_buffer2.get(), u_buffer2.get(), v_buffer2.get()};
+    // Frames are submitted to the degrader without waiting for the one
+    // before, so encoding frame N+1 overlaps decoding frame N; results
+    // come back in order and are written as they arrive.
+    const size_t frames_in_flight = 4;
+    H264_degrader degrader(width, height, (1<<20), 32, frames_in_flight);
+    AVFramePool inputs(width, height, AV_PIX_FMT_YUV422P, frames_in_flight);
+    AVFramePool outputs(width, height, AV_PIX_FMT_YUV422P, frames_in_flight);
 
-    H264_degrader degrader(width, height, (1<<20), 32);
+    std::deque<std::chrono::high_resolution_clock::time_point> submit_times;
+    size_t frames = 0;
 
-    while(!infile.eof()){
-        infile.read((char*)input_buffer.get(), frame_size);
-        
-        // convert to yuv422p
-        auto bgra2yuv_t1 = std::chrono::high_resolution_clock::now();
-        degrader.bgra2yuv422p(input_buffer.get(), degrader.encoder_frame, width, height);
-        auto bgra2yuv_t2 = std::chrono::high_resolution_clock::now();
-        auto bgra2yuv_time = std::chrono::duration_cast<std::chrono::duration<double>>(bgra2yuv_t2 - bgra2yuv_t1);
-        std::cout << "bgra2yuv_time " << bgra2yuv_time.count() << "\n";
-        
-        // degrade
-        auto degrade_t1 = std::chrono::high_resolution_clock::now();
-        degrader.degrade(degrader.encoder_frame, degrader.decoder_frame);
-        auto degrade_t2 = std::chrono::high_resolution_clock::now(); 
-        auto degrade_time = std::chrono::duration_cast<std::chrono::duration<double>>(degrade_t2 - degrade_t1);
+    auto write_next = [&](){
+        const DegradedFrame done = degrader.wait();
+        auto degrade_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - submit_times.front());
+        submit_times.pop_front();
         std::cout << degrade_time.count() << "\n";
 
         // convert to bgra and output
         auto yuv2bgra_t1 = std::chrono::high_resolution_clock::now();
-        degrader.yuv422p2bgra(degrader.encoder_frame, output_buffer.get(), width, height);
+        degrader.yuv422p2bgra(done.output, output_buffer.get(), width, height);
         auto yuv2bgra_t2 = std::chrono::high_resolution_clock::now();
         auto yuv2bgra_time = std::chrono::duration_cast<std::chrono::duration<double>>(yuv2bgra_t2 - yuv2bgra_t1);
         std::cout << "yuv2bgra_time " << yuv2bgra_time.count() << "\n";
 
         outfile.write((char*)output_buffer.get(), frame_size);
+
+        av_frame_unref(done.output);
+        outputs.Release(done.output);
+        inputs.Release(done.input);
+    };
+
+    auto start = std::chrono::high_resolution_clock::now();
+    while(infile.read((char*)input_buffer.get(), frame_size)){
+        AVFrame *input = inputs.Acquire();
+        if(input == NULL){
+            write_next();
+            input = inputs.Acquire();
+        }
+        AVFrame *output = outputs.Acquire();
+
+        // convert to yuv422p
+        auto bgra2yuv_t1 = std::chrono::high_resolution_clock::now();
+        degrader.bgra2yuv422p(input_buffer.get(), input, width, height);
+        auto bgra2yuv_t2 = std::chrono::high_resolution_clock::now();
+        auto bgra2yuv_time = std::chrono::duration_cast<std::chrono::duration<double>>(bgra2yuv_t2 - bgra2yuv_t1);
+        std::cout << "bgra2yuv_time " << bgra2yuv_time.count() << "\n";
+
+        // degrade
+        submit_times.push_back(std::chrono::high_resolution_clock::now());
+        while(!degrader.submit(input, output, frames)){
+            write_next();
+        }
+        frames++;
+    }
+    while(!submit_times.empty()){
+        write_next();
     }
+    auto elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - start);
+    std::cout << frames << " frames in " << elapsed.count() << " s (" << frames / elapsed.count() << " fps)\n";
 
     return 0;
 }
@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <vector>
+
+#include "file.hh"
+#include "exception.hh"
+#include "TracePoints.hh"
+
+// Reads a trace written by ps4_degrader -t and prints, per trace point,
+// the distribution of its durations, followed by the slowest frames with
+// their per-stage breakdown.
+
+static const size_t worst_frame_count = 10;
+
+// points whose value is a duration (everything else is just counted)
+static bool IsTiming(uint32_t point)
+{
+    switch (point) {
+    case kTraceQueued:
+    case kTraceConvertTo:
+    case kTraceDegrade:
+    case kTraceEncode:
+    case kTraceDecode:
+    case kTraceConvertFrom:
+    case kTraceSchedule:
+    case kTraceDisplayed:
+    case kTraceSlotOffset:
+    case kTraceRecord:
+    case kTraceCompress:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static double Percentile(const std::vector<int64_t>& sorted, double p)
+{
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc != 2){
+        std::cout << "usage: " << argv[0] << " <trace file>\n";
+        return 1;
+    }
+
+    try {
+        File file(argv[1]);
+        const Chunk& chunk = file.chunk();
+
+        TraceFileHeader header;
+        if (chunk.size() < sizeof(header)) {
+            std::cout << "Not a trace file: " << argv[1] << "\n";
+            return 1;
+        }
+        memcpy(&header, chunk.buffer(), sizeof(header));
+        if (memcmp(header.magic, trace_file_magic, sizeof(header.magic)) != 0 ||
+            header.event_size != sizeof(TraceEvent)) {
+            std::cout << "Not a trace file (or from another version): " << argv[1] << "\n";
+            return 1;
+        }
+
+        const size_t event_count = (chunk.size() - sizeof(header)) / sizeof(TraceEvent);
+        const uint8_t* events = chunk.buffer() + sizeof(header);
+
+        std::vector<std::vector<int64_t>> values(kTracePointCount);
+        std::map<uint64_t, std::vector<int64_t>> frames;   // frame id -> per-point time
+
+        for (size_t i = 0; i < event_count; i++) {
+            TraceEvent event;
+            memcpy(&event, events + i * sizeof(TraceEvent), sizeof(event));
+            if (event.point >= kTracePointCount)
+                continue;
+
+            values[event.point].push_back(event.value);
+            if (IsTiming(event.point)) {
+                std::vector<int64_t>& frame = frames[event.frame_id];
+                frame.resize(kTracePointCount);
+                frame[event.point] += event.value;     // with bands, each band encodes and decodes it
+            }
+        }
+
+        std::cout << event_count << " events, " << frames.size() << " frames\n\n";
+        std::cout << std::left << std::setw(18) << "point" << std::right
+                  << std::setw(10) << "count"
+                  << std::setw(12) << "p50 (us)"
+                  << std::setw(12) << "p99 (us)"
+                  << std::setw(12) << "p99.9 (us)"
+                  << std::setw(12) << "max (us)" << "\n";
+        std::cout << std::fixed << std::setprecision(1);
+
+        for (uint32_t point = 0; point < kTracePointCount; point++) {
+            std::vector<int64_t>& v = values[point];
+            if (v.empty())
+                continue;
+
+            std::cout << std::left << std::setw(18) << kTracePointNames[point] << std::right
+                      << std::setw(10) << v.size();
+            if (IsTiming(point)) {
+                std::sort(v.begin(), v.end());
+                std::cout << std::setw(12) << Percentile(v, 0.5)
+                          << std::setw(12) << Percentile(v, 0.99)
+                          << std::setw(12) << Percentile(v, 0.999)
+                          << std::setw(12) << v.back() / 1000.0;
+            }
+            std::cout << "\n";
+        }
+
+        // Worst frames by glass-to-glass latency, or by degrade time when
+        // the trace has no display events (e.g. it was cut short)
+        const uint32_t rank_by = values[kTraceDisplayed].empty() ? kTraceDegrade : kTraceDisplayed;
+        std::vector<std::pair<int64_t, uint64_t>> ranked;
+        for (const auto& frame : frames)
+            ranked.push_back(std::make_pair(frame.second[rank_by], frame.first));
+        std::sort(ranked.rbegin(), ranked.rend());
+        if (ranked.size() > worst_frame_count)
+            ranked.resize(worst_frame_count);
+
+        std::cout << "\nworst frames by " << kTracePointNames[rank_by] << " (us):\n";
+        for (const auto& entry : ranked) {
+            const std::vector<int64_t>& frame = frames[entry.second];
+            std::cout << "  frame " << std::setw(8) << entry.second << ":";
+            for (uint32_t point = 0; point < kTracePointCount; point++) {
+                if (IsTiming(point) && frame[point] != 0)
+                    std::cout << " " << kTracePointNames[point] << "=" << frame[point] / 1000.0;
+            }
+            std::cout << "\n";
+        }
+    } catch (const std::exception& e) {
+        print_exception(argv[0], e);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include "epoll.hh"
+#include "exception.hh"
+
+using namespace std;
+
+EPoll::EPoll()
+  : fd_( SystemCall( "epoll_create1", epoll_create1( EPOLL_CLOEXEC ) ) ),
+    callbacks_()
+{
+}
+
+void EPoll::add( FileDescriptor & fd, function<void()> && callback )
+{
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = callbacks_.size();
+
+  SystemCall( "epoll_ctl", epoll_ctl( fd_.fd_num(), EPOLL_CTL_ADD, fd.fd_num(), &event ) );
+  callbacks_.emplace_back( move( callback ) );
+}
+
+int EPoll::wait( const int timeout_ms )
+{
+  static const int max_events = 16;
+  epoll_event events[ max_events ];
+
+  const int ready = epoll_wait( fd_.fd_num(), events, max_events, timeout_ms );
+  if ( ready < 0 ) {
+    if ( errno == EINTR ) {
+      return 0;
+    }
+    throw unix_error( "epoll_wait" );
+  }
+
+  for ( int i = 0; i < ready; i++ ) {
+    callbacks_.at( events[ i ].data.u64 )();
+  }
+
+  return ready;
+}
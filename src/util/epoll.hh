@@ -0,0 +1,31 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef EPOLL_HH
+#define EPOLL_HH
+
+#include <sys/epoll.h>
+#include <functional>
+#include <vector>
+
+#include "file_descriptor.hh"
+
+/* minimal epoll loop: register file descriptors with a callback each, then
+   call wait() to run the callbacks of whichever became ready */
+
+class EPoll
+{
+private:
+  FileDescriptor fd_;
+  std::vector< std::function<void()> > callbacks_;
+
+public:
+  EPoll();
+
+  /* callback runs (from wait()) whenever fd is readable */
+  void add( FileDescriptor & fd, std::function<void()> && callback );
+
+  /* wait up to timeout_ms (-1 forever) and dispatch; returns number handled */
+  int wait( const int timeout_ms = -1 );
+};
+
+#endif /* EPOLL_HH */
@@ -0,0 +1,52 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include "eventfd.hh"
+#include "exception.hh"
+
+using namespace std;
+
+EventFD::EventFD( const bool nonblocking )
+  : fd_( SystemCall( "eventfd", eventfd( 0, EFD_CLOEXEC | (nonblocking ? EFD_NONBLOCK : 0) ) ) )
+{
+}
+
+void EventFD::signal( const uint64_t count )
+{
+  SystemCall( "eventfd write", ::write( fd_.fd_num(), &count, sizeof( count ) ) );
+}
+
+uint64_t EventFD::wait( void )
+{
+  uint64_t count = 0;
+
+  while ( true ) {
+    const ssize_t ret = ::read( fd_.fd_num(), &count, sizeof( count ) );
+    if ( ret == sizeof( count ) ) {
+      return count;
+    } else if ( ret < 0 and errno == EAGAIN ) {
+      /* nonblocking eventfd: wait for it to become readable */
+      pollfd pfd = { fd_.fd_num(), POLLIN, 0 };
+      SystemCall( "poll", poll( &pfd, 1, -1 ) );
+    } else if ( ret < 0 and errno != EINTR ) {
+      throw unix_error( "eventfd read" );
+    }
+  }
+}
+
+uint64_t EventFD::drain( void )
+{
+  uint64_t count = 0;
+  pollfd pfd = { fd_.fd_num(), POLLIN, 0 };
+
+  if ( SystemCall( "poll", poll( &pfd, 1, 0 ) ) == 0 ) {
+    return 0;
+  }
+
+  SystemCall( "eventfd read", ::read( fd_.fd_num(), &count, sizeof( count ) ) );
+  return count;
+}
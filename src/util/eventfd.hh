@@ -0,0 +1,28 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef EVENTFD_HH
+#define EVENTFD_HH
+
+#include <cstdint>
+
+#include "file_descriptor.hh"
+
+/* wrapper class for a Linux eventfd: a counter one thread bumps to wake
+   another, which can block on it directly or watch it with epoll */
+
+class EventFD
+{
+private:
+  FileDescriptor fd_;
+
+public:
+  EventFD( const bool nonblocking = false );
+
+  FileDescriptor & fd( void ) { return fd_; }
+
+  void signal( const uint64_t count = 1 ); /* add to the counter, waking any waiter */
+  uint64_t wait( void ); /* block until the counter is nonzero, then read and reset it */
+  uint64_t drain( void ); /* read and reset the counter without blocking (0 if unset) */
+};
+
+#endif /* EVENTFD_HH */
@@ -0,0 +1,121 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include <sys/mman.h>
+#include <cassert>
+#include <stdexcept>
+
+#include "frame_pool.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static const size_t page_size = 4096;
+static const size_t huge_page_size = 2 * 1024 * 1024;
+static const uint32_t empty_index = UINT32_MAX;
+
+static size_t round_up( const size_t value, const size_t multiple )
+{
+  return ( ( value + multiple - 1 ) / multiple ) * multiple;
+}
+
+/* try huge pages first, then fall back to (transparently huge) normal pages */
+static MMap_Region map_frames( const size_t length, bool & huge_pages )
+{
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+
+  if ( huge_pages ) {
+    try {
+      return MMap_Region( length, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1 );
+    } catch ( const unix_error & e ) {
+      print_exception( "FramePool (falling back to normal pages)", e );
+      huge_pages = false;
+    }
+  }
+
+  MMap_Region region( length, PROT_READ | PROT_WRITE, flags, -1 );
+  madvise( region.addr(), length, MADV_HUGEPAGE );
+  return region;
+}
+
+FramePool::FramePool( const size_t frame_size, const uint32_t capacity,
+                      const bool huge_pages, const bool lock_memory )
+  : frame_size_( frame_size ),
+    stride_( round_up( frame_size, page_size ) ),
+    capacity_( capacity ),
+    length_( round_up( stride_ * capacity, huge_pages ? huge_page_size : page_size ) ),
+    huge_pages_( huge_pages ),
+    region_( map_frames( length_, huge_pages_ ) ),
+    next_( new atomic<uint32_t>[ capacity ] ),
+    head_( 0 ),
+    available_( capacity ),
+    acquired_count_( 0 ),
+    exhausted_count_( 0 )
+{
+  if ( capacity == 0 or capacity == empty_index ) {
+    throw runtime_error( "FramePool: invalid capacity" );
+  }
+
+  for ( uint32_t i = 0; i < capacity; i++ ) {
+    next_[ i ].store( i + 1 < capacity ? i + 1 : empty_index, memory_order_relaxed );
+  }
+
+  if ( lock_memory and mlock( region_.addr(), length_ ) < 0 ) {
+    print_exception( "FramePool", unix_error( "mlock" ) );
+  }
+}
+
+uint32_t FramePool::index_of( const uint8_t * frame ) const
+{
+  assert( owns( frame ) );
+  return ( frame - region_.addr() ) / stride_;
+}
+
+bool FramePool::owns( const uint8_t * frame ) const
+{
+  return frame >= region_.addr()
+    and frame < region_.addr() + stride_ * capacity_
+    and ( frame - region_.addr() ) % stride_ == 0;
+}
+
+uint8_t * FramePool::acquire( void )
+{
+  uint64_t head = head_.load( memory_order_acquire );
+
+  while ( true ) {
+    const uint32_t index = head & 0xffffffff;
+    if ( index == empty_index ) {
+      exhausted_count_.fetch_add( 1, memory_order_relaxed );
+      return nullptr;
+    }
+
+    const uint64_t tag = ( head >> 32 ) + 1;
+    const uint64_t new_head = ( tag << 32 ) | next_[ index ].load( memory_order_relaxed );
+
+    if ( head_.compare_exchange_weak( head, new_head, memory_order_acq_rel, memory_order_acquire ) ) {
+      available_.fetch_sub( 1, memory_order_relaxed );
+      acquired_count_.fetch_add( 1, memory_order_relaxed );
+      return region_.addr() + index * stride_;
+    }
+  }
+}
+
+void FramePool::release( uint8_t * frame )
+{
+  if ( frame == nullptr ) {
+    return;
+  }
+
+  const uint32_t index = index_of( frame );
+  uint64_t head = head_.load( memory_order_relaxed );
+
+  while ( true ) {
+    next_[ index ].store( head & 0xffffffff, memory_order_relaxed );
+
+    const uint64_t tag = ( head >> 32 ) + 1;
+    if ( head_.compare_exchange_weak( head, ( tag << 32 ) | index,
+                                      memory_order_release, memory_order_relaxed ) ) {
+      available_.fetch_add( 1, memory_order_relaxed );
+      return;
+    }
+  }
+}
@@ -0,0 +1,67 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef FRAME_POOL_HH
+#define FRAME_POOL_HH
+
+/* fixed set of equally sized, page-aligned frame buffers carved out of one
+   anonymous mapping (optionally on 2 MB huge pages and mlocked).
+
+   acquire() and release() are lock-free and never touch the heap, so any
+   thread -- including a driver callback -- may borrow and return frames.
+   acquire() returns nullptr when every frame is in use. */
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "mmap_region.hh"
+
+class FramePool
+{
+private:
+  size_t frame_size_;
+  size_t stride_;
+  uint32_t capacity_;
+  size_t length_;
+  bool huge_pages_;
+  MMap_Region region_;
+
+  /* free list: a Treiber stack of frame indices. head_ packs a generation
+     tag in the upper 32 bits so a stale compare-and-swap cannot succeed */
+  std::unique_ptr<std::atomic<uint32_t>[]> next_;
+  std::atomic<uint64_t> head_;
+
+  std::atomic<uint32_t> available_;
+  std::atomic<uint64_t> acquired_count_;
+  std::atomic<uint64_t> exhausted_count_;
+
+  uint32_t index_of( const uint8_t * frame ) const;
+
+public:
+  FramePool( const size_t frame_size, const uint32_t capacity,
+             const bool huge_pages = false, const bool lock_memory = false );
+
+  uint8_t * acquire( void );
+  void release( uint8_t * frame );
+
+  size_t frame_size( void ) const { return frame_size_; }
+  uint32_t capacity( void ) const { return capacity_; }
+  uint32_t available( void ) const { return available_.load( std::memory_order_relaxed ); }
+  bool huge_pages( void ) const { return huge_pages_; }
+
+  /* first address and length of the backing mapping (e.g. to register it) */
+  uint8_t * base( void ) const { return region_.addr(); }
+  size_t length( void ) const { return length_; }
+
+  /* does this frame belong to the pool? */
+  bool owns( const uint8_t * frame ) const;
+
+  uint64_t acquired_count( void ) const { return acquired_count_.load( std::memory_order_relaxed ); }
+  uint64_t exhausted_count( void ) const { return exhausted_count_.load( std::memory_order_relaxed ); }
+
+  /* Disallow copying */
+  FramePool( const FramePool & other ) = delete;
+  FramePool & operator=( const FramePool & other ) = delete;
+};
+
+#endif /* FRAME_POOL_HH */
@@ -0,0 +1,154 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "io_uring.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static int io_uring_setup( const unsigned int entries, io_uring_params & params )
+{
+  memset( &params, 0, sizeof( params ) );
+  return syscall( __NR_io_uring_setup, entries, &params );
+}
+
+static int io_uring_enter( const int fd, const unsigned int to_submit,
+                           const unsigned int min_complete, const unsigned int flags )
+{
+  while ( true ) {
+    const int ret = syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0 );
+    if ( ret >= 0 or errno != EINTR ) {
+      return SystemCall( "io_uring_enter", ret );
+    }
+  }
+}
+
+static const int ring_prot = PROT_READ | PROT_WRITE;
+static const int ring_flags = MAP_SHARED | MAP_POPULATE;
+
+template <typename T>
+static T * at( const MMap_Region & region, const uint32_t offset )
+{
+  return reinterpret_cast<T *>( region.addr() + offset );
+}
+
+IOUring::IOUring( const unsigned int entries )
+  : params_(),
+    fd_( SystemCall( "io_uring_setup", io_uring_setup( entries, params_ ) ) ),
+    sq_ring_( params_.sq_off.array + params_.sq_entries * sizeof( uint32_t ),
+              ring_prot, ring_flags, fd_.fd_num(), IORING_OFF_SQ_RING ),
+    cq_ring_( params_.cq_off.cqes + params_.cq_entries * sizeof( io_uring_cqe ),
+              ring_prot, ring_flags, fd_.fd_num(), IORING_OFF_CQ_RING ),
+    sqes_region_( params_.sq_entries * sizeof( io_uring_sqe ),
+                  ring_prot, ring_flags, fd_.fd_num(), IORING_OFF_SQES ),
+    sq_head_( at<uint32_t>( sq_ring_, params_.sq_off.head ) ),
+    sq_tail_( at<uint32_t>( sq_ring_, params_.sq_off.tail ) ),
+    sq_mask_( *at<uint32_t>( sq_ring_, params_.sq_off.ring_mask ) ),
+    sq_array_( at<uint32_t>( sq_ring_, params_.sq_off.array ) ),
+    sqes_( at<io_uring_sqe>( sqes_region_, 0 ) ),
+    sq_queued_( 0 ),
+    cq_head_( at<uint32_t>( cq_ring_, params_.cq_off.head ) ),
+    cq_tail_( at<uint32_t>( cq_ring_, params_.cq_off.tail ) ),
+    cq_mask_( *at<uint32_t>( cq_ring_, params_.cq_off.ring_mask ) ),
+    cqes_( at<io_uring_cqe>( cq_ring_, params_.cq_off.cqes ) )
+{
+}
+
+void IOUring::register_buffers( const vector<iovec> & buffers )
+{
+  SystemCall( "io_uring_register buffers",
+              syscall( __NR_io_uring_register, fd_.fd_num(), IORING_REGISTER_BUFFERS,
+                       buffers.data(), buffers.size() ) );
+}
+
+io_uring_sqe & IOUring::next_sqe( void )
+{
+  const uint32_t tail = *sq_tail_;
+
+  if ( tail - __atomic_load_n( sq_head_, __ATOMIC_ACQUIRE ) >= params_.sq_entries ) {
+    throw runtime_error( "io_uring: submission queue full" );
+  }
+
+  const uint32_t index = tail & sq_mask_;
+  io_uring_sqe & sqe = sqes_[ index ];
+  memset( &sqe, 0, sizeof( sqe ) );
+  sq_array_[ index ] = index;
+  return sqe;
+}
+
+/* the kernel sees an entry only once the tail moves past it */
+void IOUring::publish( void )
+{
+  __atomic_store_n( sq_tail_, *sq_tail_ + 1, __ATOMIC_RELEASE );
+  sq_queued_++;
+}
+
+void IOUring::write_fixed( const int fd, const void * data, const uint32_t length,
+                           const uint64_t offset, const uint16_t buffer_index,
+                           const uint64_t user_data )
+{
+  io_uring_sqe & sqe = next_sqe();
+  sqe.opcode = IORING_OP_WRITE_FIXED;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uintptr_t>( data );
+  sqe.len = length;
+  sqe.off = offset;
+  sqe.buf_index = buffer_index;
+  sqe.user_data = user_data;
+
+  publish();
+}
+
+void IOUring::write( const int fd, const void * data, const uint32_t length,
+                     const uint64_t offset, const uint64_t user_data )
+{
+  io_uring_sqe & sqe = next_sqe();
+  sqe.opcode = IORING_OP_WRITE;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uintptr_t>( data );
+  sqe.len = length;
+  sqe.off = offset;
+  sqe.user_data = user_data;
+
+  publish();
+}
+
+void IOUring::nop( const uint64_t user_data )
+{
+  io_uring_sqe & sqe = next_sqe();
+  sqe.opcode = IORING_OP_NOP;
+  sqe.user_data = user_data;
+
+  publish();
+}
+
+void IOUring::submit( void )
+{
+  while ( sq_queued_ > 0 ) {
+    sq_queued_ -= io_uring_enter( fd_.fd_num(), sq_queued_, 0, 0 );
+  }
+}
+
+IOUring::Completion IOUring::wait( void )
+{
+  while ( true ) {
+    const uint32_t head = *cq_head_;
+
+    if ( head != __atomic_load_n( cq_tail_, __ATOMIC_ACQUIRE ) ) {
+      const io_uring_cqe & cqe = cqes_[ head & cq_mask_ ];
+      const Completion completion = { cqe.user_data, cqe.res };
+
+      /* the slot is the kernel's again once the head moves past it */
+      __atomic_store_n( cq_head_, head + 1, __ATOMIC_RELEASE );
+      return completion;
+    }
+
+    io_uring_enter( fd_.fd_num(), 0, 1, IORING_ENTER_GETEVENTS );
+  }
+}
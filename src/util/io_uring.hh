@@ -0,0 +1,83 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef IO_URING_HH
+#define IO_URING_HH
+
+/* minimal io_uring, straight on the system calls (no liburing).
+
+   One thread may queue requests (write_fixed(), nop(), submit()) while
+   another reaps their completions (wait()); neither side takes a lock.
+   Requests are submitted as they are queued, so the submission queue
+   only needs room for the requests queued between two submit() calls. */
+
+#include <cstdint>
+#include <vector>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "file_descriptor.hh"
+#include "mmap_region.hh"
+
+class IOUring
+{
+private:
+  io_uring_params params_;
+  FileDescriptor fd_;
+
+  MMap_Region sq_ring_;
+  MMap_Region cq_ring_;
+  MMap_Region sqes_region_;
+
+  /* submission ring: we own the tail, the kernel the head */
+  uint32_t * sq_head_;
+  uint32_t * sq_tail_;
+  uint32_t sq_mask_;
+  uint32_t * sq_array_;
+  io_uring_sqe * sqes_;
+  uint32_t sq_queued_;    /* entries queued since the last submit() */
+
+  /* completion ring: the kernel owns the tail, we the head */
+  uint32_t * cq_head_;
+  uint32_t * cq_tail_;
+  uint32_t cq_mask_;
+  io_uring_cqe * cqes_;
+
+  io_uring_sqe & next_sqe( void );
+  void publish( void );
+
+public:
+  IOUring( const unsigned int entries );
+
+  /* make buffers usable by write_fixed(), by index */
+  void register_buffers( const std::vector<iovec> & buffers );
+
+  /* queue a write from (part of) registered buffer buffer_index */
+  void write_fixed( const int fd, const void * data, const uint32_t length,
+                    const uint64_t offset, const uint16_t buffer_index,
+                    const uint64_t user_data );
+
+  /* queue a write from any memory */
+  void write( const int fd, const void * data, const uint32_t length,
+              const uint64_t offset, const uint64_t user_data );
+
+  /* queue a request that does nothing but complete */
+  void nop( const uint64_t user_data );
+
+  /* hand everything queued to the kernel */
+  void submit( void );
+
+  struct Completion
+  {
+    uint64_t user_data;
+    int32_t result;     /* bytes written, or -errno */
+  };
+
+  /* block until a request completes */
+  Completion wait( void );
+
+  /* Disallow copying */
+  IOUring( const IOUring & other ) = delete;
+  IOUring & operator=( const IOUring & other ) = delete;
+};
+
+#endif /* IO_URING_HH */
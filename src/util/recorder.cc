@@ -0,0 +1,357 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "recorder.hh"
+#include "exception.hh"
+
+using namespace std;
+
+/* offsets and lengths of every write are multiples of this, which
+   covers the logical block size O_DIRECT needs */
+static const size_t alignment = 4096;
+
+/* user_data of the request that stops the reaping thread */
+static const uint64_t stop_request = UINT64_MAX;
+
+static size_t round_up( const size_t value, const size_t multiple )
+{
+  return ( ( value + multiple - 1 ) / multiple ) * multiple;
+}
+
+Recorder::Engine Recorder::engine_from_name( const string & name )
+{
+  if ( name == "buffered" ) {
+    return Engine::BUFFERED;
+  } else if ( name == "direct" ) {
+    return Engine::DIRECT;
+  } else if ( name == "io_uring" ) {
+    return Engine::IO_URING;
+  }
+
+  throw runtime_error( "unknown recorder engine: " + name );
+}
+
+const char * Recorder::engine_name( const Engine engine )
+{
+  switch ( engine ) {
+  case Engine::BUFFERED: return "buffered";
+  case Engine::DIRECT: return "direct";
+  case Engine::IO_URING: return "io_uring";
+  }
+
+  return "unknown";
+}
+
+Recorder::Recorder( const Engine engine, const vector<int> & fds,
+                    const unsigned int queue_depth, const size_t chunk_size )
+  : engine_( engine ),
+    chunk_size_( round_up( chunk_size, alignment ) ),
+    /* one chunk filling per stream, and queue_depth being written */
+    region_( chunk_size_ * ( fds.size() + max( queue_depth, 1u ) ), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1 ),
+    chunks_(),
+    streams_(),
+    mutex_(),
+    freed_(),
+    submitted_(),
+    free_(),
+    pending_(),
+    stopping_( false ),
+    stats_(),
+    start_( chrono::steady_clock::now() ),
+    ring_(),
+    fixed_buffers_( false ),
+    threads_(),
+    finished_( false )
+{
+  const size_t chunk_count = fds.size() + max( queue_depth, 1u );
+
+  for ( size_t i = 0; i < chunk_count; i++ ) {
+    chunks_.push_back( Chunk { region_.addr() + i * chunk_size_, 0, 0, 0 } );
+  }
+  for ( Chunk & chunk : chunks_ ) {
+    free_.push_back( &chunk );
+  }
+  stats_.chunk_count = chunk_count;
+
+  for ( const int fd : fds ) {
+    const int flags = SystemCall( "fcntl", fcntl( fd, F_GETFL ) );
+    streams_.push_back( Stream { fd, flags, 0, nullptr } );
+
+    if ( engine_ != Engine::BUFFERED ) {
+      SystemCall( "fcntl O_DIRECT", fcntl( fd, F_SETFL, flags | O_DIRECT ) );
+    }
+  }
+
+  if ( engine_ == Engine::IO_URING ) {
+    /* room for every chunk and the stop request */
+    ring_.reset( new IOUring( chunk_count + 1 ) );
+
+    vector<iovec> buffers;
+    for ( const Chunk & chunk : chunks_ ) {
+      buffers.push_back( iovec { chunk.data, chunk_size_ } );
+    }
+
+    /* pinning them can fail under a low RLIMIT_MEMLOCK; plain writes
+       from the same chunks still work */
+    try {
+      ring_->register_buffers( buffers );
+      fixed_buffers_ = true;
+    } catch ( const unix_error & e ) {
+      print_exception( "Recorder (writing without fixed buffers)", e );
+    }
+
+    threads_.emplace_back( &Recorder::reap_loop, this );
+  } else {
+    const unsigned int writers = engine_ == Engine::DIRECT ? max( queue_depth, 1u ) : 1;
+    for ( unsigned int i = 0; i < writers; i++ ) {
+      threads_.emplace_back( &Recorder::write_loop, this );
+    }
+  }
+}
+
+Recorder::~Recorder()
+{
+  try {
+    finish();
+  } catch ( const exception & e ) {
+    print_exception( "Recorder", e );
+  }
+}
+
+void Recorder::append( const size_t stream, const uint8_t * data, size_t length )
+{
+  Stream & s = streams_.at( stream );
+
+  while ( length > 0 ) {
+    if ( s.filling == nullptr ) {
+      s.filling = acquire();
+      s.filling->stream = stream;
+      s.filling->offset = s.length;     /* every earlier chunk was filled */
+      s.filling->length = 0;
+    }
+
+    Chunk & chunk = *s.filling;
+    const size_t amount = min( length, chunk_size_ - chunk.length );
+    memcpy( chunk.data + chunk.length, data, amount );
+    chunk.length += amount;
+    s.length += amount;
+    data += amount;
+    length -= amount;
+
+    if ( chunk.length == chunk_size_ ) {
+      s.filling = nullptr;
+      submit( &chunk );
+    }
+  }
+}
+
+void Recorder::finish( void )
+{
+  if ( finished_ ) {
+    return;
+  }
+  finished_ = true;
+
+  /* the partly filled chunks go out padded to the alignment */
+  for ( Stream & s : streams_ ) {
+    if ( s.filling != nullptr ) {
+      Chunk & chunk = *s.filling;
+      memset( chunk.data + chunk.length, 0, round_up( chunk.length, alignment ) - chunk.length );
+      s.filling = nullptr;
+      submit( &chunk );
+    }
+  }
+
+  {
+    unique_lock<mutex> lock( mutex_ );
+    freed_.wait( lock, [this]() { return free_.size() == chunks_.size(); } );
+    stopping_ = true;
+  }
+  submitted_.notify_all();
+
+  if ( ring_ ) {
+    ring_->nop( stop_request );
+    ring_->submit();
+  }
+
+  for ( thread & t : threads_ ) {
+    t.join();
+  }
+  threads_.clear();
+
+  for ( const Stream & s : streams_ ) {
+    SystemCall( "ftruncate", ftruncate( s.fd, s.length ) );
+    SystemCall( "fcntl", fcntl( s.fd, F_SETFL, s.flags ) );
+  }
+}
+
+Recorder::Stats Recorder::stats( void ) const
+{
+  lock_guard<mutex> lock( mutex_ );
+  Stats stats = stats_;
+  stats.seconds = chrono::duration<double>( chrono::steady_clock::now() - start_ ).count();
+  return stats;
+}
+
+Recorder::Chunk * Recorder::acquire( void )
+{
+  unique_lock<mutex> lock( mutex_ );
+
+  if ( free_.empty() ) {
+    stats_.stalls++;
+    freed_.wait( lock, [this]() { return not free_.empty(); } );
+  }
+
+  Chunk * chunk = free_.back();
+  free_.pop_back();
+  return chunk;
+}
+
+void Recorder::submit( Chunk * chunk )
+{
+  {
+    lock_guard<mutex> lock( mutex_ );
+    stats_.in_flight++;
+    stats_.max_in_flight = max( stats_.max_in_flight, stats_.in_flight );
+
+    if ( not ring_ ) {
+      pending_.push_back( chunk );
+    }
+  }
+
+  if ( not ring_ ) {
+    submitted_.notify_one();
+    return;
+  }
+
+  /* only the appending thread touches the submission queue */
+  const int fd = streams_[ chunk->stream ].fd;
+  const uint32_t length = round_up( chunk->length, alignment );
+  const uint64_t index = chunk - chunks_.data();
+  if ( fixed_buffers_ ) {
+    ring_->write_fixed( fd, chunk->data, length, chunk->offset, index, index );
+  } else {
+    ring_->write( fd, chunk->data, length, chunk->offset, index );
+  }
+  ring_->submit();
+}
+
+void Recorder::complete( Chunk * chunk, const string & error )
+{
+  {
+    lock_guard<mutex> lock( mutex_ );
+    stats_.in_flight--;
+
+    if ( error.empty() ) {
+      stats_.bytes_written += chunk->length;
+    } else if ( stats_.errors++ == 0 ) {
+      /* the first says why; the rest are only counted */
+      cerr << "Recorder: " << error << endl;
+    }
+
+    free_.push_back( chunk );
+  }
+  freed_.notify_one();
+}
+
+/* write the rest of a chunk from done on, padded to the alignment */
+void Recorder::write_chunk( const Chunk & chunk, size_t done )
+{
+  const int fd = streams_[ chunk.stream ].fd;
+  const size_t length = round_up( chunk.length, alignment );
+
+  while ( done < length ) {
+    const ssize_t ret = pwrite( fd, chunk.data + done, length - done, chunk.offset + done );
+    if ( ret < 0 and errno == EINTR ) {
+      continue;
+    }
+    done += SystemCall( "pwrite", ret );
+  }
+}
+
+/* start writeback of the chunk just written, rather than in a burst
+   when the kernel gets round to it, and drop the one before it (written
+   back by now, or waited for) from the page cache */
+void Recorder::drop_behind( const int fd, const uint64_t offset )
+{
+  sync_file_range( fd, offset, chunk_size_, SYNC_FILE_RANGE_WRITE );
+
+  if ( offset >= chunk_size_ ) {
+    const uint64_t previous = offset - chunk_size_;
+    sync_file_range( fd, previous, chunk_size_,
+                     SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER );
+    posix_fadvise( fd, previous, chunk_size_, POSIX_FADV_DONTNEED );
+  }
+}
+
+void Recorder::write_loop( void )
+{
+  while ( true ) {
+    Chunk * chunk;
+    {
+      unique_lock<mutex> lock( mutex_ );
+      submitted_.wait( lock, [this]() { return not pending_.empty() or stopping_; } );
+      if ( pending_.empty() ) {
+        return;
+      }
+      chunk = pending_.front();
+      pending_.pop_front();
+    }
+
+    /* the chunk may be reused as soon as it is complete */
+    const int fd = streams_[ chunk->stream ].fd;
+    const uint64_t offset = chunk->offset;
+
+    string error;
+    try {
+      write_chunk( *chunk, 0 );
+    } catch ( const exception & e ) {
+      error = e.what();
+    }
+    complete( chunk, error );
+
+    if ( engine_ == Engine::BUFFERED and error.empty() ) {
+      drop_behind( fd, offset );
+    }
+  }
+}
+
+void Recorder::reap_loop( void )
+{
+  while ( true ) {
+    const IOUring::Completion completion = ring_->wait();
+    if ( completion.user_data == stop_request ) {
+      return;
+    }
+
+    /* the chunk was handed over through the kernel, which orders
+       nothing as far as the rest of the program can tell: take the
+       lock submit() released to see what was written into it */
+    Chunk * chunk;
+    {
+      lock_guard<mutex> lock( mutex_ );
+      chunk = &chunks_.at( completion.user_data );
+    }
+
+    string error;
+    if ( completion.result < 0 ) {
+      error = string( "io_uring write: " ) + strerror( -completion.result );
+    } else {
+      /* a short write is rare; finish it off here */
+      try {
+        write_chunk( *chunk, completion.result );
+      } catch ( const exception & e ) {
+        error = e.what();
+      }
+    }
+    complete( chunk, error );
+  }
+}
@@ -0,0 +1,129 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef RECORDER_HH
+#define RECORDER_HH
+
+/* appends to a set of files (streams) while an engine writes them out
+   behind the caller's back.
+
+   append() copies into fixed-size, page-aligned chunks. A chunk is
+   written at its own place in its file once it fills, so writes may
+   complete in any order, and goes back to the free list when written.
+   The chunks are all the buffering there is: when none is free append()
+   waits for one, so a slow disk holds up the caller instead of growing
+   memory. Chunk offsets and lengths stay page multiples (the last chunk
+   is padded, and the file cut back in finish()), so engines can write
+   with O_DIRECT and keep the recording out of the page cache.
+
+   Engines:
+     buffered   pwrite from one thread through the page cache, starting
+                writeback as each chunk is written and dropping the chunk
+                before it from the cache
+     direct     O_DIRECT pwrite from queue_depth threads
+     io_uring   O_DIRECT writes of the chunks, registered as fixed
+                buffers, through one ring; a single thread reaps them
+
+   One thread at a time may append(); stats() may be called from any. */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "io_uring.hh"
+#include "mmap_region.hh"
+
+class Recorder
+{
+public:
+  enum class Engine { BUFFERED, DIRECT, IO_URING };
+
+  static Engine engine_from_name( const std::string & name );
+  static const char * engine_name( const Engine engine );
+
+  struct Stats
+  {
+    uint64_t bytes_written;
+    double seconds;               /* since the recorder started */
+    unsigned int in_flight;       /* chunks being written now */
+    unsigned int max_in_flight;
+    unsigned int chunk_count;
+    uint64_t stalls;              /* times append() waited for a chunk */
+    uint64_t errors;              /* chunks that could not be written */
+  };
+
+private:
+  struct Chunk
+  {
+    uint8_t * data;
+    size_t stream;
+    uint64_t offset;              /* in its stream's file */
+    size_t length;                /* bytes appended into it */
+  };
+
+  struct Stream
+  {
+    int fd;
+    int flags;                    /* as given, restored by finish() */
+    uint64_t length;              /* bytes appended */
+    Chunk * filling;
+  };
+
+  const Engine engine_;
+  const size_t chunk_size_;
+  MMap_Region region_;
+  std::vector<Chunk> chunks_;
+  std::vector<Stream> streams_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable freed_;
+  std::condition_variable submitted_;
+  std::vector<Chunk *> free_;
+  std::deque<Chunk *> pending_;   /* for the write threads */
+  bool stopping_;
+  Stats stats_;
+  const std::chrono::steady_clock::time_point start_;
+
+  std::unique_ptr<IOUring> ring_;
+  bool fixed_buffers_;
+  std::vector<std::thread> threads_;
+  bool finished_;
+
+  Chunk * acquire( void );
+  void submit( Chunk * chunk );
+  void complete( Chunk * chunk, const std::string & error );
+  void write_chunk( const Chunk & chunk, size_t done );
+  void drop_behind( const int fd, const uint64_t offset );
+  void write_loop( void );
+  void reap_loop( void );
+
+public:
+  /* writes the files (whose descriptors stay the caller's) from offset
+     0, with chunks for queue_depth writes besides the one each stream
+     is filling */
+  Recorder( const Engine engine, const std::vector<int> & fds,
+            const unsigned int queue_depth = 8, const size_t chunk_size = 4 << 20 );
+
+  /* finishes, if the caller has not */
+  ~Recorder();
+
+  void append( const size_t stream, const uint8_t * data, size_t length );
+
+  /* writes out what is buffered and waits for it, then trims each file
+     to what was appended. No append() after this. */
+  void finish( void );
+
+  Engine engine( void ) const { return engine_; }
+  Stats stats( void ) const;
+
+  /* Disallow copying */
+  Recorder( const Recorder & other ) = delete;
+  Recorder & operator=( const Recorder & other ) = delete;
+};
+
+#endif /* RECORDER_HH */
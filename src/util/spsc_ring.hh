@@ -0,0 +1,124 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef SPSC_RING_HH
+#define SPSC_RING_HH
+
+/* bounded single-producer/single-consumer ring.
+
+   push() may only be called from one thread and pop()/front() from one
+   other thread; neither ever blocks or allocates. size() is wait-free and
+   may be read from any thread. The producer and consumer indices live on
+   separate cache lines so the two sides do not false-share. */
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+template <typename T>
+class SPSCRing
+{
+private:
+  static constexpr size_t cache_line_size = 64;
+
+  static size_t round_up_pow2( const size_t n )
+  {
+    size_t ret = 1;
+    while ( ret < n ) { ret <<= 1; }
+    return ret;
+  }
+
+  const size_t capacity_;
+  const size_t mask_;
+  std::unique_ptr<T[]> slots_;
+
+  char pad0_[ cache_line_size ];
+
+  /* consumer side: next slot to read, and its view of tail_ */
+  std::atomic<uint64_t> head_;
+  uint64_t cached_tail_;
+
+  char pad1_[ cache_line_size ];
+
+  /* producer side: next slot to write, and its view of head_ */
+  std::atomic<uint64_t> tail_;
+  uint64_t cached_head_;
+
+  char pad2_[ cache_line_size ];
+
+public:
+  SPSCRing( const size_t capacity )
+    : capacity_( round_up_pow2( capacity ) ),
+      mask_( capacity_ - 1 ),
+      slots_( new T[ capacity_ ] ),
+      pad0_(), head_( 0 ), cached_tail_( 0 ),
+      pad1_(), tail_( 0 ), cached_head_( 0 ),
+      pad2_()
+  {
+    if ( capacity == 0 ) {
+      throw std::runtime_error( "SPSCRing: capacity must be positive" );
+    }
+  }
+
+  /* producer: returns false (and leaves the ring untouched) when full */
+  bool push( const T & value )
+  {
+    const uint64_t tail = tail_.load( std::memory_order_relaxed );
+
+    if ( tail - cached_head_ >= capacity_ ) {
+      cached_head_ = head_.load( std::memory_order_acquire );
+      if ( tail - cached_head_ >= capacity_ ) {
+        return false;
+      }
+    }
+
+    slots_[ tail & mask_ ] = value;
+    tail_.store( tail + 1, std::memory_order_release );
+    return true;
+  }
+
+  /* consumer: oldest element, or nullptr when empty */
+  T * front( void )
+  {
+    const uint64_t head = head_.load( std::memory_order_relaxed );
+
+    if ( head == cached_tail_ ) {
+      cached_tail_ = tail_.load( std::memory_order_acquire );
+      if ( head == cached_tail_ ) {
+        return nullptr;
+      }
+    }
+
+    return &slots_[ head & mask_ ];
+  }
+
+  /* consumer: returns false when empty */
+  bool pop( T & value )
+  {
+    T * const slot = front();
+    if ( slot == nullptr ) {
+      return false;
+    }
+
+    value = *slot;
+    head_.store( head_.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+    return true;
+  }
+
+  /* any thread: number of queued elements (a snapshot) */
+  size_t size( void ) const
+  {
+    const uint64_t head = head_.load( std::memory_order_acquire );
+    const uint64_t tail = tail_.load( std::memory_order_acquire );
+    return tail > head ? tail - head : 0;
+  }
+
+  bool empty( void ) const { return size() == 0; }
+  size_t capacity( void ) const { return capacity_; }
+
+  /* Disallow copying */
+  SPSCRing( const SPSCRing & other ) = delete;
+  SPSCRing & operator=( const SPSCRing & other ) = delete;
+};
+
+#endif /* SPSC_RING_HH */
@@ -0,0 +1,142 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include <fcntl.h>
+#include <cstring>
+#include <vector>
+
+#include "trace.hh"
+#include "exception.hh"
+
+using namespace std;
+
+atomic<Trace *> Trace::active_ { nullptr };
+atomic<uint64_t> Trace::next_generation_ { 1 };
+
+/* each thread's ring, valid while generation matches the live Trace */
+static thread_local uint64_t thread_generation = 0;
+static thread_local SPSCRing<TraceEvent> * thread_ring = nullptr;
+static thread_local uint32_t thread_index = 0;
+
+Trace::Trace( const string & filename, const size_t events_per_thread )
+  : generation_( next_generation_++ ),
+    events_per_thread_( events_per_thread ),
+    fd_( SystemCall( "open " + filename,
+                     open( filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664 ) ) ),
+    register_mutex_(),
+    rings_(),
+    ring_count_( 0 ),
+    dropped_( 0 ),
+    drain_mutex_(),
+    drain_cv_(),
+    stopping_( false ),
+    drainer_()
+{
+  TraceFileHeader header;
+  memcpy( header.magic, trace_file_magic, sizeof( header.magic ) );
+  header.version = 1;
+  header.event_size = sizeof( TraceEvent );
+  fd_.write( Chunk( reinterpret_cast<const uint8_t *>( &header ), sizeof( header ) ) );
+
+  Trace * expected = nullptr;
+  if ( not active_.compare_exchange_strong( expected, this ) ) {
+    throw runtime_error( "Trace: another trace is already running" );
+  }
+
+  drainer_ = thread( [&] () { drain_loop(); } );
+}
+
+Trace::~Trace()
+{
+  active_.store( nullptr );
+
+  {
+    unique_lock<mutex> lock( drain_mutex_ );
+    stopping_ = true;
+  }
+  drain_cv_.notify_all();
+  drainer_.join();
+
+  try {
+    drain();
+  } catch ( const exception & e ) {
+    print_exception( "trace", e );
+  }
+}
+
+SPSCRing<TraceEvent> * Trace::ring_for_this_thread( void )
+{
+  if ( thread_generation == generation_ ) {
+    return thread_ring;
+  }
+
+  /* first event from this thread: give it a ring */
+  lock_guard<mutex> lock( register_mutex_ );
+
+  const unsigned int index = ring_count_.load();
+  if ( index == max_threads ) {
+    return nullptr;
+  }
+
+  rings_[ index ].reset( new SPSCRing<TraceEvent>( events_per_thread_ ) );
+  ring_count_.store( index + 1, memory_order_release );
+
+  thread_generation = generation_;
+  thread_ring = rings_[ index ].get();
+  thread_index = index;
+  return thread_ring;
+}
+
+void Trace::event( const uint32_t point, const uint64_t frame_id,
+                   const int64_t value, const uint64_t timestamp )
+{
+  Trace * const trace = active_.load( memory_order_acquire );
+  if ( trace == nullptr ) {
+    return;
+  }
+
+  SPSCRing<TraceEvent> * const ring = trace->ring_for_this_thread();
+  if ( ring == nullptr or
+       not ring->push( TraceEvent { timestamp ? timestamp : now(), frame_id, point, thread_index, value } ) ) {
+    trace->dropped_.fetch_add( 1, memory_order_relaxed );
+  }
+}
+
+void Trace::drain( void )
+{
+  static const size_t batch_size = 4096;
+  vector<TraceEvent> batch;
+  batch.reserve( batch_size );
+
+  const unsigned int count = ring_count_.load( memory_order_acquire );
+  for ( unsigned int i = 0; i < count; i++ ) {
+    TraceEvent event;
+    while ( rings_[ i ]->pop( event ) ) {
+      batch.push_back( event );
+      if ( batch.size() == batch_size ) {
+        fd_.write( Chunk( reinterpret_cast<const uint8_t *>( batch.data() ),
+                          batch.size() * sizeof( TraceEvent ) ) );
+        batch.clear();
+      }
+    }
+  }
+
+  if ( not batch.empty() ) {
+    fd_.write( Chunk( reinterpret_cast<const uint8_t *>( batch.data() ),
+                      batch.size() * sizeof( TraceEvent ) ) );
+  }
+}
+
+void Trace::drain_loop( void )
+{
+  try {
+    unique_lock<mutex> lock( drain_mutex_ );
+    while ( not stopping_ ) {
+      drain_cv_.wait_for( lock, chrono::milliseconds( 20 ) );
+      lock.unlock();
+      drain();
+      lock.lock();
+    }
+  } catch ( const exception & e ) {
+    print_exception( "trace", e );
+  }
+}
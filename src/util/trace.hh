@@ -0,0 +1,130 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef TRACE_HH
+#define TRACE_HH
+
+/* low-overhead binary event trace.
+
+   Each thread that records an event gets its own SPSCRing of fixed-size
+   events (registered on its first event), so recording is a clock read
+   and a ring push: no locks, no allocation, no formatting. A background
+   thread drains every ring to the trace file. When a ring is full the
+   event is dropped and counted rather than blocking the traced thread.
+
+   The file is a TraceFileHeader followed by TraceEvents in drain order
+   (ordered per thread, not globally). Trace points are small integers
+   whose meaning is up to the program. */
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <time.h>
+
+#include "file_descriptor.hh"
+#include "spsc_ring.hh"
+
+struct TraceEvent
+{
+  uint64_t timestamp;   /* CLOCK_MONOTONIC nanoseconds */
+  uint64_t frame_id;
+  uint32_t point;
+  uint32_t thread;      /* which thread's ring it came from */
+  int64_t value;        /* a duration in nanoseconds for spans */
+};
+
+struct TraceFileHeader
+{
+  char magic[ 8 ];
+  uint32_t version;
+  uint32_t event_size;
+};
+
+static constexpr char trace_file_magic[ 8 ] = { 'E', 'O', 'T', 'R', 'A', 'C', 'E', '\0' };
+
+class Trace
+{
+private:
+  static constexpr unsigned int max_threads = 64;
+
+  static std::atomic<Trace *> active_;
+  static std::atomic<uint64_t> next_generation_;
+
+  const uint64_t generation_;
+  const size_t events_per_thread_;
+
+  FileDescriptor fd_;
+
+  std::mutex register_mutex_;
+  std::unique_ptr<SPSCRing<TraceEvent>> rings_[ max_threads ];
+  std::atomic<unsigned int> ring_count_;
+  std::atomic<uint64_t> dropped_;
+
+  std::mutex drain_mutex_;
+  std::condition_variable drain_cv_;
+  bool stopping_;
+  std::thread drainer_;
+
+  SPSCRing<TraceEvent> * ring_for_this_thread( void );
+  void drain_loop( void );
+  void drain( void );
+
+public:
+  /* starts tracing to filename; only one Trace may be live at a time */
+  Trace( const std::string & filename, const size_t events_per_thread = 1 << 16 );
+
+  /* writes out everything still buffered. Traced threads must have
+     stopped recording before this runs. */
+  ~Trace();
+
+  static uint64_t now( void )
+  {
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return uint64_t( ts.tv_sec ) * 1000000000 + ts.tv_nsec;
+  }
+
+  /* record an event; a no-op when no Trace is live. A zero timestamp
+     means now, and the clock is only read when tracing. */
+  static void event( const uint32_t point, const uint64_t frame_id,
+                     const int64_t value = 0, const uint64_t timestamp = 0 );
+
+  static bool enabled( void ) { return active_.load( std::memory_order_relaxed ) != nullptr; }
+
+  uint64_t dropped( void ) const { return dropped_.load(); }
+
+  /* Disallow copying */
+  Trace( const Trace & other ) = delete;
+  Trace & operator=( const Trace & other ) = delete;
+};
+
+/* records how long its scope took as one event, stamped at its start */
+class TraceSpan
+{
+private:
+  const uint32_t point_;
+  const uint64_t frame_id_;
+  const uint64_t start_;
+
+public:
+  TraceSpan( const uint32_t point, const uint64_t frame_id )
+    : point_( point ), frame_id_( frame_id ),
+      start_( Trace::enabled() ? Trace::now() : 0 )
+  {}
+
+  ~TraceSpan()
+  {
+    if ( start_ ) {
+      Trace::event( point_, frame_id_, Trace::now() - start_, start_ );
+    }
+  }
+
+  /* Disallow copying */
+  TraceSpan( const TraceSpan & other ) = delete;
+  TraceSpan & operator=( const TraceSpan & other ) = delete;
+};
+
+#endif /* TRACE_HH */
@@ -0,0 +1,56 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstring>
+
+#include "unix_socket.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static sockaddr_un unix_address( const string & path )
+{
+    sockaddr_un address;
+    memset( &address, 0, sizeof( address ) );
+    address.sun_family = AF_UNIX;
+
+    if ( path.size() >= sizeof( address.sun_path ) ) {
+        throw runtime_error( "socket path too long: " + path );
+    }
+    memcpy( address.sun_path, path.c_str(), path.size() );
+
+    return address;
+}
+
+UnixListener::UnixListener( const string & path )
+    : path_( path ),
+      fd_( SystemCall( "socket", socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) )
+{
+    const sockaddr_un address = unix_address( path_ );
+
+    /* a socket left behind by an earlier run */
+    unlink( path_.c_str() );
+
+    SystemCall( "bind " + path_, bind( fd_.fd_num(), (const sockaddr *)&address, sizeof( address ) ) );
+    SystemCall( "listen", listen( fd_.fd_num(), 4 ) );
+}
+
+UnixListener::~UnixListener()
+{
+    unlink( path_.c_str() );
+}
+
+FileDescriptor UnixListener::accept( const int timeout_ms )
+{
+    FileDescriptor connection( SystemCall( "accept", accept4( fd_.fd_num(), nullptr, nullptr, SOCK_CLOEXEC ) ) );
+
+    timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = ( timeout_ms % 1000 ) * 1000;
+    SystemCall( "setsockopt", setsockopt( connection.fd_num(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) ) );
+    SystemCall( "setsockopt", setsockopt( connection.fd_num(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) ) );
+
+    return connection;
+}
@@ -0,0 +1,33 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef UNIX_SOCKET_HH
+#define UNIX_SOCKET_HH
+
+#include <string>
+
+#include "file_descriptor.hh"
+
+/* listening UNIX stream socket: watch fd() with epoll and accept() the
+   connections as they come in */
+
+class UnixListener
+{
+private:
+    std::string path_;
+    FileDescriptor fd_;
+
+public:
+    UnixListener( const std::string & path ); /* replaces whatever is at path */
+    ~UnixListener(); /* unlinks path */
+
+    FileDescriptor & fd( void ) { return fd_; }
+
+    /* reads and writes on the connection give up after timeout_ms, so a
+       client that stalls cannot hold up the caller for long */
+    FileDescriptor accept( const int timeout_ms );
+
+    UnixListener( const UnixListener & other ) = delete;
+    UnixListener & operator=( const UnixListener & other ) = delete;
+};
+
+#endif /* UNIX_SOCKET_HH */
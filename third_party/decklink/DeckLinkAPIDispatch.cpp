@@ -26,10 +26,12 @@
 **/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <dlfcn.h>
 
 #include "DeckLinkAPI.h"
+#include "DeckLinkAPIMock.h"
 
 #define kDeckLinkAPI_Name "libDeckLinkAPI.so"
 #define KDeckLinkPreviewAPI_Name "libDeckLinkPreviewAPI.so"
@@ -101,6 +103,9 @@ bool		IsDeckLinkAPIPresent (void)
 
 IDeckLinkIterator*		CreateDeckLinkIteratorInstance (void)
 {
+	if (getenv("DECKLINK_MOCK") != NULL)
+		return CreateMockDeckLinkIteratorInstance();
+
 	pthread_once(&gDeckLinkOnceControl, InitDeckLinkAPI);
 	
 	if (gCreateIteratorFunc == NULL)
@@ -0,0 +1,1325 @@
+/*
+** Simulated DeckLink input and output devices; see DeckLinkAPIMock.h.
+**
+** All timing comes from one clock: CLOCK_MONOTONIC nanoseconds since the
+** first time the mock was used. Vsync k of a mode falls at
+** k * frameDuration / timeScale seconds on that clock, so input and output
+** in the same mode tick together the way they do on a card locked to one
+** reference.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "DeckLinkAPIMock.h"
+
+static const int64_t	kNanosecondsPerSecond = 1000000000;
+
+/* Clock */
+
+static int64_t	MonotonicNanoseconds (void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * kNanosecondsPerSecond + ts.tv_nsec;
+}
+
+static int64_t	MockClockOrigin (void)
+{
+	static const int64_t	origin = MonotonicNanoseconds();
+	return origin;
+}
+
+// Hardware reference clock in nanoseconds
+static int64_t	MockClockNow (void)
+{
+	return MonotonicNanoseconds() - MockClockOrigin();
+}
+
+static void		MockClockSleepUntil (int64_t time)
+{
+	const int64_t		deadline = MockClockOrigin() + time;
+	struct timespec		ts;
+
+	ts.tv_sec = deadline / kNanosecondsPerSecond;
+	ts.tv_nsec = deadline % kNanosecondsPerSecond;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static int64_t	Rescale (int64_t value, int64_t fromScale, int64_t toScale)
+{
+	return (int64_t)((__int128)value * toScale / fromScale);
+}
+
+/* Display modes */
+
+struct MockModeInfo
+{
+	BMDDisplayMode			mode;
+	const char*				name;
+	long					width;
+	long					height;
+	BMDTimeValue			frameDuration;
+	BMDTimeScale			timeScale;
+	BMDFieldDominance		fieldDominance;
+	BMDDisplayModeFlags		flags;
+
+	int64_t		VsyncTime (int64_t index) const
+	{
+		return Rescale(index * frameDuration, timeScale, kNanosecondsPerSecond);
+	}
+
+	// index of the last vsync at or before time
+	int64_t		VsyncIndex (int64_t time) const
+	{
+		return (int64_t)((__int128)time * timeScale / ((__int128)frameDuration * kNanosecondsPerSecond));
+	}
+
+	int64_t		FrameNanoseconds (void) const
+	{
+		return Rescale(frameDuration, timeScale, kNanosecondsPerSecond);
+	}
+};
+
+// Same order for input and output; callers pick modes by index, and
+// Playback expects index 14 to be 720p60.
+static const MockModeInfo	kMockModes[] =
+{
+	{ bmdModeNTSC,			"NTSC",			720,	486,	1001,	30000,	bmdLowerFieldFirst,		bmdDisplayModeColorspaceRec601 },
+	{ bmdModeNTSC2398,		"NTSC 23.98",	720,	486,	1001,	24000,	bmdLowerFieldFirst,		bmdDisplayModeColorspaceRec601 },
+	{ bmdModePAL,			"PAL",			720,	576,	1000,	25000,	bmdUpperFieldFirst,		bmdDisplayModeColorspaceRec601 },
+	{ bmdModeNTSCp,			"NTSC Progressive",	720,	486,	1001,	60000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec601 },
+	{ bmdModePALp,			"PAL Progressive",	720,	576,	1000,	50000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec601 },
+	{ bmdModeHD1080p2398,	"1080p23.98",	1920,	1080,	1001,	24000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD1080p24,		"1080p24",		1920,	1080,	1000,	24000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD1080p25,		"1080p25",		1920,	1080,	1000,	25000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD1080p2997,	"1080p29.97",	1920,	1080,	1001,	30000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD1080p30,		"1080p30",		1920,	1080,	1000,	30000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD1080i50,		"1080i50",		1920,	1080,	1000,	25000,	bmdUpperFieldFirst,		bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD1080i5994,	"1080i59.94",	1920,	1080,	1001,	30000,	bmdUpperFieldFirst,		bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD1080i6000,	"1080i60",		1920,	1080,	1000,	30000,	bmdUpperFieldFirst,		bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD720p50,		"720p50",		1280,	720,	1000,	50000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD720p60,		"720p60",		1280,	720,	1000,	60000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD720p5994,	"720p59.94",	1280,	720,	1001,	60000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD1080p50,		"1080p50",		1920,	1080,	1000,	50000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD1080p5994,	"1080p59.94",	1920,	1080,	1001,	60000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec709 },
+	{ bmdModeHD1080p6000,	"1080p60",		1920,	1080,	1000,	60000,	bmdProgressiveFrame,	bmdDisplayModeColorspaceRec709 },
+};
+
+static const size_t		kMockModeCount = sizeof(kMockModes) / sizeof(kMockModes[0]);
+
+static const MockModeInfo*	FindMockMode (BMDDisplayMode mode)
+{
+	for (size_t i = 0; i < kMockModeCount; i++)
+	{
+		if (kMockModes[i].mode == mode)
+			return &kMockModes[i];
+	}
+	return NULL;
+}
+
+static bool		IsMockPixelFormat (BMDPixelFormat pixelFormat)
+{
+	return pixelFormat == bmdFormat8BitYUV || pixelFormat == bmdFormat10BitYUV ||
+		   pixelFormat == bmdFormat8BitARGB || pixelFormat == bmdFormat8BitBGRA;
+}
+
+static long		MockRowBytes (BMDPixelFormat pixelFormat, long width)
+{
+	switch (pixelFormat)
+	{
+		case bmdFormat8BitYUV:
+			return width * 2;
+		case bmdFormat10BitYUV:
+			return ((width + 47) / 48) * 128;
+		default:
+			return width * 4;
+	}
+}
+
+static bool		SameIID (REFIID a, REFIID b)
+{
+	return memcmp(&a, &b, sizeof(REFIID)) == 0;
+}
+
+/* Reference counting shared by every mock object */
+
+template <class Interface>
+class MockUnknown : public Interface
+{
+public:
+	MockUnknown () : m_refCount(1) {}
+
+	virtual HRESULT STDMETHODCALLTYPE	QueryInterface (REFIID, LPVOID *ppv)
+	{
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+
+	virtual ULONG STDMETHODCALLTYPE		AddRef (void)
+	{
+		return ++m_refCount;
+	}
+
+	virtual ULONG STDMETHODCALLTYPE		Release (void)
+	{
+		ULONG	newRefValue = --m_refCount;
+		if (newRefValue == 0)
+			delete this;
+		return newRefValue;
+	}
+
+protected:
+	virtual ~MockUnknown () {}
+
+private:
+	std::atomic<ULONG>	m_refCount;
+};
+
+/* Display modes */
+
+class MockDisplayMode : public MockUnknown<IDeckLinkDisplayMode>
+{
+public:
+	MockDisplayMode (const MockModeInfo* info) : m_info(info) {}
+
+	virtual HRESULT				GetName (const char **name) { *name = strdup(m_info->name); return S_OK; }
+	virtual BMDDisplayMode		GetDisplayMode (void) { return m_info->mode; }
+	virtual long				GetWidth (void) { return m_info->width; }
+	virtual long				GetHeight (void) { return m_info->height; }
+	virtual HRESULT				GetFrameRate (BMDTimeValue *frameDuration, BMDTimeScale *timeScale)
+	{
+		*frameDuration = m_info->frameDuration;
+		*timeScale = m_info->timeScale;
+		return S_OK;
+	}
+	virtual BMDFieldDominance	GetFieldDominance (void) { return m_info->fieldDominance; }
+	virtual BMDDisplayModeFlags	GetFlags (void) { return m_info->flags; }
+
+private:
+	const MockModeInfo*		m_info;
+};
+
+class MockDisplayModeIterator : public MockUnknown<IDeckLinkDisplayModeIterator>
+{
+public:
+	MockDisplayModeIterator () : m_index(0) {}
+
+	virtual HRESULT		Next (IDeckLinkDisplayMode **deckLinkDisplayMode)
+	{
+		if (m_index >= kMockModeCount)
+		{
+			*deckLinkDisplayMode = NULL;
+			return S_FALSE;
+		}
+		*deckLinkDisplayMode = new MockDisplayMode(&kMockModes[m_index++]);
+		return S_OK;
+	}
+
+private:
+	size_t		m_index;
+};
+
+static HRESULT	MockDoesSupportVideoMode (BMDDisplayMode displayMode, BMDPixelFormat pixelFormat, BMDDisplayModeSupport *result, IDeckLinkDisplayMode **resultDisplayMode)
+{
+	const MockModeInfo*		info = FindMockMode(displayMode);
+
+	*result = (info != NULL && IsMockPixelFormat(pixelFormat)) ? bmdDisplayModeSupported : bmdDisplayModeNotSupported;
+	if (resultDisplayMode != NULL)
+		*resultDisplayMode = (info != NULL) ? new MockDisplayMode(info) : NULL;
+	return S_OK;
+}
+
+/* Frames */
+
+// Buffers for input frames when the application does not install its own
+// allocator. Like the driver's, they are recycled rather than freed.
+class MockMemoryAllocator : public MockUnknown<IDeckLinkMemoryAllocator>
+{
+public:
+	MockMemoryAllocator () : m_mutex(), m_size(0), m_free() {}
+
+	virtual HRESULT		AllocateBuffer (uint32_t bufferSize, void **allocatedBuffer)
+	{
+		std::lock_guard<std::mutex>	guard(m_mutex);
+
+		if (bufferSize != m_size)
+		{
+			FreeAll();
+			m_size = bufferSize;
+		}
+		if (!m_free.empty())
+		{
+			*allocatedBuffer = m_free.back();
+			m_free.pop_back();
+			return S_OK;
+		}
+		if (posix_memalign(allocatedBuffer, 64, bufferSize) != 0)
+			return E_OUTOFMEMORY;
+		return S_OK;
+	}
+
+	virtual HRESULT		ReleaseBuffer (void *buffer)
+	{
+		std::lock_guard<std::mutex>	guard(m_mutex);
+		m_free.push_back(buffer);
+		return S_OK;
+	}
+
+	virtual HRESULT		Commit (void) { return S_OK; }
+	virtual HRESULT		Decommit (void) { return S_OK; }
+
+protected:
+	virtual ~MockMemoryAllocator () { FreeAll(); }
+
+private:
+	void	FreeAll (void)
+	{
+		for (size_t i = 0; i < m_free.size(); i++)
+			free(m_free[i]);
+		m_free.clear();
+	}
+
+	std::mutex				m_mutex;
+	uint32_t				m_size;
+	std::vector<void*>		m_free;
+};
+
+class MockVideoFrame : public MockUnknown<IDeckLinkMutableVideoFrame>
+{
+public:
+	MockVideoFrame (long width, long height, long rowBytes, BMDPixelFormat pixelFormat, BMDFrameFlags flags, void* bytes) :
+		m_width(width), m_height(height), m_rowBytes(rowBytes), m_pixelFormat(pixelFormat), m_flags(flags), m_bytes(bytes) {}
+
+	virtual long				GetWidth (void) { return m_width; }
+	virtual long				GetHeight (void) { return m_height; }
+	virtual long				GetRowBytes (void) { return m_rowBytes; }
+	virtual BMDPixelFormat		GetPixelFormat (void) { return m_pixelFormat; }
+	virtual BMDFrameFlags		GetFlags (void) { return m_flags; }
+	virtual HRESULT				GetBytes (void **buffer) { *buffer = m_bytes; return S_OK; }
+
+	virtual HRESULT				GetTimecode (BMDTimecodeFormat, IDeckLinkTimecode **timecode) { *timecode = NULL; return S_FALSE; }
+	virtual HRESULT				GetAncillaryData (IDeckLinkVideoFrameAncillary **ancillary) { *ancillary = NULL; return S_FALSE; }
+
+	virtual HRESULT				SetFlags (BMDFrameFlags newFlags) { m_flags = newFlags; return S_OK; }
+	virtual HRESULT				SetTimecode (BMDTimecodeFormat, IDeckLinkTimecode *) { return E_NOTIMPL; }
+	virtual HRESULT				SetTimecodeFromComponents (BMDTimecodeFormat, uint8_t, uint8_t, uint8_t, uint8_t, BMDTimecodeFlags) { return E_NOTIMPL; }
+	virtual HRESULT				SetAncillaryData (IDeckLinkVideoFrameAncillary *) { return E_NOTIMPL; }
+	virtual HRESULT				SetTimecodeUserBits (BMDTimecodeFormat, BMDTimecodeUserBits) { return E_NOTIMPL; }
+
+protected:
+	virtual ~MockVideoFrame () { free(m_bytes); }
+
+private:
+	long				m_width;
+	long				m_height;
+	long				m_rowBytes;
+	BMDPixelFormat		m_pixelFormat;
+	BMDFrameFlags		m_flags;
+	void*				m_bytes;
+};
+
+class MockInputFrame : public MockUnknown<IDeckLinkVideoInputFrame>
+{
+public:
+	MockInputFrame (const MockModeInfo* mode, BMDPixelFormat pixelFormat, IDeckLinkMemoryAllocator* allocator, void* bytes,
+					int64_t hardwareTime, int64_t streamTime) :
+		m_mode(mode), m_pixelFormat(pixelFormat), m_allocator(allocator), m_bytes(bytes),
+		m_hardwareTime(hardwareTime), m_streamTime(streamTime)
+	{
+		m_allocator->AddRef();
+	}
+
+	virtual long				GetWidth (void) { return m_mode->width; }
+	virtual long				GetHeight (void) { return m_mode->height; }
+	virtual long				GetRowBytes (void) { return MockRowBytes(m_pixelFormat, m_mode->width); }
+	virtual BMDPixelFormat		GetPixelFormat (void) { return m_pixelFormat; }
+	virtual BMDFrameFlags		GetFlags (void) { return bmdFrameFlagDefault; }
+	virtual HRESULT				GetBytes (void **buffer) { *buffer = m_bytes; return S_OK; }
+
+	virtual HRESULT				GetTimecode (BMDTimecodeFormat, IDeckLinkTimecode **timecode) { *timecode = NULL; return S_FALSE; }
+	virtual HRESULT				GetAncillaryData (IDeckLinkVideoFrameAncillary **ancillary) { *ancillary = NULL; return S_FALSE; }
+
+	virtual HRESULT				GetStreamTime (BMDTimeValue *frameTime, BMDTimeValue *frameDuration, BMDTimeScale timeScale)
+	{
+		if (timeScale <= 0)
+			return E_INVALIDARG;
+		*frameTime = Rescale(m_streamTime, kNanosecondsPerSecond, timeScale);
+		*frameDuration = Rescale(m_mode->frameDuration, m_mode->timeScale, timeScale);
+		return S_OK;
+	}
+
+	virtual HRESULT				GetHardwareReferenceTimestamp (BMDTimeScale timeScale, BMDTimeValue *frameTime, BMDTimeValue *frameDuration)
+	{
+		if (timeScale <= 0)
+			return E_INVALIDARG;
+		*frameTime = Rescale(m_hardwareTime, kNanosecondsPerSecond, timeScale);
+		*frameDuration = Rescale(m_mode->frameDuration, m_mode->timeScale, timeScale);
+		return S_OK;
+	}
+
+protected:
+	virtual ~MockInputFrame ()
+	{
+		m_allocator->ReleaseBuffer(m_bytes);
+		m_allocator->Release();
+	}
+
+private:
+	const MockModeInfo*			m_mode;
+	BMDPixelFormat				m_pixelFormat;
+	IDeckLinkMemoryAllocator*	m_allocator;
+	void*						m_bytes;
+	int64_t						m_hardwareTime;		// start of the vsync the frame was captured in
+	int64_t						m_streamTime;
+};
+
+/* Input frame contents */
+
+// Either frames from a raw file (mapped and played in a loop) or colour
+// bars with a white bar moving across, so successive frames differ.
+class MockFrameSource
+{
+public:
+	MockFrameSource () : m_frameBytes(0), m_rowBytes(0), m_width(0), m_height(0), m_pixelFormat(0), m_base(), m_file(NULL), m_fileSize(0), m_fileFrames(0) {}
+	~MockFrameSource () { Close(); }
+
+	void	Open (const MockModeInfo* mode, BMDPixelFormat pixelFormat)
+	{
+		const char*		filename = getenv("DECKLINK_MOCK_INPUT");
+
+		Close();
+		m_rowBytes = MockRowBytes(pixelFormat, mode->width);
+		m_width = mode->width;
+		m_height = mode->height;
+		m_frameBytes = (size_t)m_rowBytes * m_height;
+		m_pixelFormat = pixelFormat;
+
+		if (filename != NULL && OpenFile(filename))
+			return;
+		DrawBars(mode->width);
+	}
+
+	void	Close (void)
+	{
+		if (m_file != NULL)
+			munmap(m_file, m_fileSize);
+		m_file = NULL;
+		m_fileSize = 0;
+		m_fileFrames = 0;
+	}
+
+	size_t	FrameBytes (void) const { return m_frameBytes; }
+
+	void	Fill (uint8_t* bytes, uint64_t frameNumber)
+	{
+		if (m_file != NULL)
+		{
+			memcpy(bytes, m_file + (frameNumber % m_fileFrames) * m_frameBytes, m_frameBytes);
+			return;
+		}
+
+		memcpy(bytes, m_base.data(), m_frameBytes);
+
+		// 16 pixel white bar, 8 pixels further right every frame
+		const long	x = (long)((frameNumber * 8) % (uint64_t)(m_width - 16)) & ~1L;
+
+		for (long y = 0; y < m_height; y++)
+		{
+			uint8_t*	row = bytes + y * m_rowBytes;
+			if (m_pixelFormat == bmdFormat8BitBGRA || m_pixelFormat == bmdFormat8BitARGB)
+				memset(row + x * 4, 0xFF, 16 * 4);
+			else if (m_pixelFormat == bmdFormat8BitYUV)
+			{
+				for (long i = x; i < x + 16; i += 2)
+				{
+					row[i * 2 + 0] = 128;
+					row[i * 2 + 1] = 235;
+					row[i * 2 + 2] = 128;
+					row[i * 2 + 3] = 235;
+				}
+			}
+			else if (m_pixelFormat == bmdFormat10BitYUV)
+			{
+				for (long i = x; i < x + 16; i++)
+				{
+					SetV210Sample(row, i * 2, 512);
+					SetV210Sample(row, i * 2 + 1, 940);
+				}
+			}
+		}
+	}
+
+private:
+	bool	OpenFile (const char* filename)
+	{
+		struct stat		st;
+		int				fd = open(filename, O_RDONLY);
+
+		if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < m_frameBytes)
+		{
+			fprintf(stderr, "Mock input: cannot use %s (%s), generating bars instead\n", filename,
+					fd < 0 ? strerror(errno) : "shorter than one frame");
+			if (fd >= 0)
+				close(fd);
+			return false;
+		}
+
+		void*	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED)
+		{
+			fprintf(stderr, "Mock input: cannot map %s (%s), generating bars instead\n", filename, strerror(errno));
+			return false;
+		}
+
+		m_file = (uint8_t*)data;
+		m_fileSize = st.st_size;
+		m_fileFrames = m_fileSize / m_frameBytes;
+		return true;
+	}
+
+	// v210 stores the samples in UYVY order, three to each 32 bit word
+	// and twelve to each group of four words
+	static void	SetV210Sample (uint8_t* row, long sample, uint32_t value)
+	{
+		uint32_t*	word = (uint32_t*)row + sample / 12 * 4 + sample % 12 / 3;
+		const int	shift = sample % 3 * 10;
+
+		*word = (*word & ~(0x3FFu << shift)) | (value << shift);
+	}
+
+	void	DrawBars (long width)
+	{
+		// 75% bars: white, yellow, cyan, green, magenta, red, blue, black
+		static const uint8_t	kBars[8][3] =
+		{
+			{ 191, 191, 191 }, { 191, 191, 0 }, { 0, 191, 191 }, { 0, 191, 0 },
+			{ 191, 0, 191 }, { 191, 0, 0 }, { 0, 0, 191 }, { 0, 0, 0 },
+		};
+
+		m_base.assign(m_frameBytes, 0);
+
+		for (long x = 0; x < width; x++)
+		{
+			const uint8_t*	rgb = kBars[x * 8 / width];
+			const int		r = rgb[0], g = rgb[1], b = rgb[2];
+
+			if (m_pixelFormat == bmdFormat8BitBGRA)
+			{
+				uint8_t*	p = &m_base[x * 4];
+				p[0] = b; p[1] = g; p[2] = r; p[3] = 0xFF;
+			}
+			else if (m_pixelFormat == bmdFormat8BitARGB)
+			{
+				uint8_t*	p = &m_base[x * 4];
+				p[0] = 0xFF; p[1] = r; p[2] = g; p[3] = b;
+			}
+			else if (m_pixelFormat == bmdFormat8BitYUV)
+			{
+				// BT.709, video range; U on even pixels and V on odd ones
+				uint8_t*	p = &m_base[x * 2];
+				p[1] = (uint8_t)(16 + (47 * r + 157 * g + 16 * b) / 256);
+				if ((x & 1) == 0)
+					p[0] = (uint8_t)(128 + (-26 * r - 87 * g + 112 * b) / 256);
+				else
+					p[0] = (uint8_t)(128 + (112 * r - 102 * g - 10 * b) / 256);
+			}
+			else if (m_pixelFormat == bmdFormat10BitYUV)
+			{
+				// as above, at 10 bits
+				SetV210Sample(&m_base[0], x * 2 + 1, 64 + (47 * r + 157 * g + 16 * b) / 64);
+				if ((x & 1) == 0)
+					SetV210Sample(&m_base[0], x * 2, 512 + (-26 * r - 87 * g + 112 * b) / 64);
+				else
+					SetV210Sample(&m_base[0], x * 2, 512 + (112 * r - 102 * g - 10 * b) / 64);
+			}
+		}
+
+		for (long y = 1; y < m_height; y++)
+			memcpy(&m_base[y * m_rowBytes], &m_base[0], m_rowBytes);
+	}
+
+	size_t					m_frameBytes;
+	long					m_rowBytes;
+	long					m_width;
+	long					m_height;
+	BMDPixelFormat			m_pixelFormat;
+	std::vector<uint8_t>	m_base;
+	uint8_t*				m_file;
+	size_t					m_fileSize;
+	size_t					m_fileFrames;
+
+	MockFrameSource (const MockFrameSource&) = delete;
+	MockFrameSource& operator= (const MockFrameSource&) = delete;
+};
+
+/* Input */
+
+// The callback is not reference counted: the application keeps it alive
+// for as long as the input is enabled, as it must for the real driver.
+class MockInput : public MockUnknown<IDeckLinkInput>
+{
+public:
+	MockInput () :
+		m_mutex(), m_mode(NULL), m_pixelFormat(bmdFormat8BitYUV), m_inputFlags(bmdVideoInputFlagDefault), m_callback(NULL),
+		m_allocator(new MockMemoryAllocator()), m_source(), m_thread(), m_running(false), m_firstIndex(0), m_frameCount(0),
+		m_missedCount(0), m_droppedCount(0), m_formatChanges(), m_nextFormatChange(0)
+	{
+		const char*		changes = getenv("DECKLINK_MOCK_FORMAT_CHANGES");
+		unsigned long	frame, index;
+		int				length;
+
+		while (changes != NULL && sscanf(changes, "%lu:%lu%n", &frame, &index, &length) == 2)
+		{
+			if (index < kMockModeCount)
+				m_formatChanges.push_back(std::make_pair((uint64_t)frame, &kMockModes[index]));
+			changes += length;
+			if (*changes != ',')
+				break;
+			changes++;
+		}
+	}
+
+	virtual HRESULT		DoesSupportVideoMode (BMDDisplayMode displayMode, BMDPixelFormat pixelFormat, BMDVideoInputFlags, BMDDisplayModeSupport *result, IDeckLinkDisplayMode **resultDisplayMode)
+	{
+		return MockDoesSupportVideoMode(displayMode, pixelFormat, result, resultDisplayMode);
+	}
+
+	virtual HRESULT		GetDisplayModeIterator (IDeckLinkDisplayModeIterator **iterator)
+	{
+		*iterator = new MockDisplayModeIterator();
+		return S_OK;
+	}
+
+	virtual HRESULT		SetScreenPreviewCallback (IDeckLinkScreenPreviewCallback *) { return E_NOTIMPL; }
+
+	virtual HRESULT		EnableVideoInput (BMDDisplayMode displayMode, BMDPixelFormat pixelFormat, BMDVideoInputFlags flags)
+	{
+		const MockModeInfo*		mode = FindMockMode(displayMode);
+
+		if (mode == NULL || !IsMockPixelFormat(pixelFormat) || m_running)
+			return E_INVALIDARG;
+
+		m_mode = mode;
+		m_pixelFormat = pixelFormat;
+		m_inputFlags = flags;
+		m_source.Open(mode, pixelFormat);
+		return S_OK;
+	}
+
+	virtual HRESULT		DisableVideoInput (void)
+	{
+		if (m_mode == NULL)
+			return S_OK;
+
+		StopStreams();
+		fprintf(stderr, "Mock input: %llu frames, %llu vsyncs missed, %llu dropped\n",
+				(unsigned long long)m_frameCount, (unsigned long long)m_missedCount, (unsigned long long)m_droppedCount);
+		m_source.Close();
+		m_mode = NULL;
+		return S_OK;
+	}
+
+	virtual HRESULT		GetAvailableVideoFrameCount (uint32_t *availableFrameCount) { *availableFrameCount = 0; return S_OK; }
+
+	virtual HRESULT		SetVideoInputFrameMemoryAllocator (IDeckLinkMemoryAllocator *theAllocator)
+	{
+		if (m_running)
+			return E_FAIL;
+
+		if (theAllocator == NULL)
+			theAllocator = new MockMemoryAllocator();
+		else
+			theAllocator->AddRef();
+
+		m_allocator->Decommit();
+		m_allocator->Release();
+		m_allocator = theAllocator;
+		m_allocator->Commit();
+		return S_OK;
+	}
+
+	virtual HRESULT		EnableAudioInput (BMDAudioSampleRate, BMDAudioSampleType, uint32_t) { return E_NOTIMPL; }
+	virtual HRESULT		DisableAudioInput (void) { return S_OK; }
+	virtual HRESULT		GetAvailableAudioSampleFrameCount (uint32_t *availableSampleFrameCount) { *availableSampleFrameCount = 0; return S_OK; }
+
+	virtual HRESULT		StartStreams (void)
+	{
+		if (m_mode == NULL)
+			return E_FAIL;
+		if (m_running)
+			return S_OK;
+
+		m_running = true;
+		m_firstIndex = m_mode->VsyncIndex(MockClockNow()) + 1;
+		m_thread = std::thread(&MockInput::CaptureThread, this);
+		return S_OK;
+	}
+
+	virtual HRESULT		StopStreams (void)
+	{
+		m_running = false;
+		if (m_thread.joinable())
+			m_thread.join();
+		return S_OK;
+	}
+
+	virtual HRESULT		PauseStreams (void) { return StopStreams(); }
+	virtual HRESULT		FlushStreams (void) { return S_OK; }
+
+	virtual HRESULT		SetCallback (IDeckLinkInputCallback *theCallback)
+	{
+		std::lock_guard<std::mutex>	guard(m_mutex);
+		m_callback = theCallback;
+		return S_OK;
+	}
+
+	virtual HRESULT		GetHardwareReferenceClock (BMDTimeScale desiredTimeScale, BMDTimeValue *hardwareTime, BMDTimeValue *timeInFrame, BMDTimeValue *ticksPerFrame)
+	{
+		return GetModeClock(m_mode, desiredTimeScale, hardwareTime, timeInFrame, ticksPerFrame);
+	}
+
+	static HRESULT		GetModeClock (const MockModeInfo* mode, BMDTimeScale desiredTimeScale, BMDTimeValue *hardwareTime, BMDTimeValue *timeInFrame, BMDTimeValue *ticksPerFrame)
+	{
+		const int64_t	now = MockClockNow();
+
+		if (mode == NULL || desiredTimeScale <= 0)
+			return E_FAIL;
+
+		*hardwareTime = Rescale(now, kNanosecondsPerSecond, desiredTimeScale);
+		*timeInFrame = Rescale(now - mode->VsyncTime(mode->VsyncIndex(now)), kNanosecondsPerSecond, desiredTimeScale);
+		*ticksPerFrame = Rescale(mode->frameDuration, mode->timeScale, desiredTimeScale);
+		return S_OK;
+	}
+
+protected:
+	virtual ~MockInput ()
+	{
+		StopStreams();
+		m_allocator->Release();
+	}
+
+private:
+	// A frame is handed over at the vsync that ends it, stamped with the
+	// one that started it. Vsyncs the thread slept through are skipped
+	// (and counted) rather than delivered in a burst.
+	void	CaptureThread (void)
+	{
+		int64_t		index = m_firstIndex;
+
+		while (m_running)
+		{
+			MockClockSleepUntil(m_mode->VsyncTime(index));
+			if (!m_running)
+				break;
+
+			DeliverFrame(index - 1);
+
+			const int64_t	current = m_mode->VsyncIndex(MockClockNow());
+			if (current > index)
+			{
+				m_missedCount += current - index;
+				index = current;
+			}
+			index++;
+		}
+	}
+
+	void	DeliverFrame (int64_t index)
+	{
+		void*	bytes = NULL;
+
+		if (m_allocator->AllocateBuffer((uint32_t)m_source.FrameBytes(), &bytes) != S_OK || bytes == NULL)
+		{
+			m_droppedCount++;
+			return;
+		}
+
+		m_source.Fill((uint8_t*)bytes, m_frameCount);
+		MockInputFrame*		frame = new MockInputFrame(m_mode, m_pixelFormat, m_allocator, bytes,
+													   m_mode->VsyncTime(index), m_mode->VsyncTime(index) - m_mode->VsyncTime(m_firstIndex - 1));
+		m_frameCount++;
+
+		{
+			std::lock_guard<std::mutex>	guard(m_mutex);
+			if (m_callback != NULL)
+				m_callback->VideoInputFrameArrived(frame, NULL);
+		}
+
+		frame->Release();
+		DetectFormatChange();
+	}
+
+	// Like the driver, only reports the new mode; frames keep coming in
+	// the old one until the application enables the input again
+	void	DetectFormatChange (void)
+	{
+		if (m_nextFormatChange >= m_formatChanges.size() || m_frameCount < m_formatChanges[m_nextFormatChange].first)
+			return;
+
+		const MockModeInfo*		mode = m_formatChanges[m_nextFormatChange++].second;
+		if (!(m_inputFlags & bmdVideoInputEnableFormatDetection) || mode == m_mode)
+			return;
+
+		MockDisplayMode*	displayMode = new MockDisplayMode(mode);
+		{
+			std::lock_guard<std::mutex>	guard(m_mutex);
+			if (m_callback != NULL)
+				m_callback->VideoInputFormatChanged(bmdVideoInputDisplayModeChanged, displayMode, bmdDetectedVideoInputYCbCr422);
+		}
+		displayMode->Release();
+	}
+
+	std::mutex					m_mutex;			// guards m_callback
+	const MockModeInfo*			m_mode;
+	BMDPixelFormat				m_pixelFormat;
+	BMDVideoInputFlags			m_inputFlags;
+	IDeckLinkInputCallback*		m_callback;
+	IDeckLinkMemoryAllocator*	m_allocator;
+	MockFrameSource				m_source;
+	std::thread					m_thread;
+	std::atomic<bool>			m_running;
+	int64_t						m_firstIndex;
+	uint64_t					m_frameCount;
+	uint64_t					m_missedCount;
+	uint64_t					m_droppedCount;
+	std::vector<std::pair<uint64_t, const MockModeInfo*> >	m_formatChanges;	// from DECKLINK_MOCK_FORMAT_CHANGES
+	size_t						m_nextFormatChange;
+
+	MockInput (const MockInput&) = delete;
+	MockInput& operator= (const MockInput&) = delete;
+};
+
+/* Output */
+
+// Scheduled frames wait in display-time order. At every vsync the newest
+// frame that is due goes on screen (late if its slot has already passed),
+// anything older that is also due is dropped, and the frame it replaces is
+// completed. A frame whose duration runs out with nothing to replace it is
+// completed too and the screen simply repeats it. Completion callbacks are
+// made from the scan-out thread without the lock held, like the driver's.
+class MockOutput : public MockUnknown<IDeckLinkOutput>
+{
+public:
+	MockOutput () :
+		m_mutex(), m_mode(NULL), m_callback(NULL), m_pending(), m_shown(), m_hasShown(false), m_displayTimes(),
+		m_thread(), m_running(false), m_firstIndex(0), m_streamOffset(0), m_log(NULL),
+		m_scheduledCount(0), m_leadMin(0), m_leadMax(0), m_leadTotal(0), m_leadCount(0),
+		m_completedCount(0), m_lateCount(0), m_droppedCount(0), m_flushedCount(0) {}
+
+	virtual HRESULT		DoesSupportVideoMode (BMDDisplayMode displayMode, BMDPixelFormat pixelFormat, BMDVideoOutputFlags, BMDDisplayModeSupport *result, IDeckLinkDisplayMode **resultDisplayMode)
+	{
+		return MockDoesSupportVideoMode(displayMode, pixelFormat, result, resultDisplayMode);
+	}
+
+	virtual HRESULT		GetDisplayModeIterator (IDeckLinkDisplayModeIterator **iterator)
+	{
+		*iterator = new MockDisplayModeIterator();
+		return S_OK;
+	}
+
+	virtual HRESULT		SetScreenPreviewCallback (IDeckLinkScreenPreviewCallback *) { return E_NOTIMPL; }
+
+	virtual HRESULT		EnableVideoOutput (BMDDisplayMode displayMode, BMDVideoOutputFlags)
+	{
+		const MockModeInfo*		mode = FindMockMode(displayMode);
+		const char*				logFilename = getenv("DECKLINK_MOCK_LOG");
+
+		if (mode == NULL || m_running)
+			return E_INVALIDARG;
+
+		m_mode = mode;
+		if (logFilename != NULL && m_log == NULL)
+		{
+			m_log = fopen(logFilename, "w");
+			if (m_log == NULL)
+				fprintf(stderr, "Mock output: cannot open %s (%s)\n", logFilename, strerror(errno));
+			else
+				fprintf(m_log, "scheduled_at_ns,target_ns,shown_ns,result\n");
+		}
+		return S_OK;
+	}
+
+	virtual HRESULT		DisableVideoOutput (void)
+	{
+		if (m_mode == NULL)
+			return S_OK;
+
+		StopScheduledPlayback(0, NULL, 0);
+
+		fprintf(stderr, "Mock output: %llu scheduled (lead min/avg/max %.2f/%.2f/%.2f ms), %llu completed, %llu late, %llu dropped, %llu flushed\n",
+				(unsigned long long)m_scheduledCount,
+				m_leadMin / 1e6, m_leadCount ? (double)m_leadTotal / m_leadCount / 1e6 : 0.0, m_leadMax / 1e6,
+				(unsigned long long)m_completedCount, (unsigned long long)m_lateCount,
+				(unsigned long long)m_droppedCount, (unsigned long long)m_flushedCount);
+
+		if (m_log != NULL)
+			fclose(m_log);
+		m_log = NULL;
+		m_mode = NULL;
+		return S_OK;
+	}
+
+	virtual HRESULT		SetVideoOutputFrameMemoryAllocator (IDeckLinkMemoryAllocator *) { return E_NOTIMPL; }
+
+	virtual HRESULT		CreateVideoFrame (int32_t width, int32_t height, int32_t rowBytes, BMDPixelFormat pixelFormat, BMDFrameFlags flags, IDeckLinkMutableVideoFrame **outFrame)
+	{
+		void*	bytes = NULL;
+
+		*outFrame = NULL;
+		if (width <= 0 || height <= 0 || rowBytes < MockRowBytes(pixelFormat, width))
+			return E_INVALIDARG;
+		if (posix_memalign(&bytes, 64, (size_t)rowBytes * height) != 0)
+			return E_OUTOFMEMORY;
+
+		*outFrame = new MockVideoFrame(width, height, rowBytes, pixelFormat, flags, bytes);
+		return S_OK;
+	}
+
+	virtual HRESULT		CreateAncillaryData (BMDPixelFormat, IDeckLinkVideoFrameAncillary **outBuffer) { *outBuffer = NULL; return E_NOTIMPL; }
+
+	virtual HRESULT		DisplayVideoFrameSync (IDeckLinkVideoFrame *) { return E_NOTIMPL; }
+
+	virtual HRESULT		ScheduleVideoFrame (IDeckLinkVideoFrame *theFrame, BMDTimeValue displayTime, BMDTimeValue displayDuration, BMDTimeScale timeScale)
+	{
+		ScheduledFrame		entry;
+
+		if (theFrame == NULL || timeScale <= 0 || m_mode == NULL)
+			return E_INVALIDARG;
+
+		entry.frame = theFrame;
+		entry.displayTime = Rescale(displayTime, timeScale, kNanosecondsPerSecond);
+		entry.duration = Rescale(displayDuration, timeScale, kNanosecondsPerSecond);
+		entry.scheduledAt = MockClockNow();
+		entry.shownAt = -1;
+		entry.result = bmdOutputFrameCompleted;
+
+		std::lock_guard<std::mutex>	guard(m_mutex);
+
+		theFrame->AddRef();
+		m_displayTimes.erase(theFrame);
+		m_pending.insert(std::make_pair(entry.displayTime, entry));
+		m_scheduledCount++;
+
+		if (m_running)
+		{
+			const int64_t	lead = TargetTime(entry) - entry.scheduledAt;
+			if (m_leadCount == 0 || lead < m_leadMin)
+				m_leadMin = lead;
+			if (m_leadCount == 0 || lead > m_leadMax)
+				m_leadMax = lead;
+			m_leadTotal += lead;
+			m_leadCount++;
+		}
+		return S_OK;
+	}
+
+	virtual HRESULT		SetScheduledFrameCompletionCallback (IDeckLinkVideoOutputCallback *theCallback)
+	{
+		std::lock_guard<std::mutex>	guard(m_mutex);
+		m_callback = theCallback;
+		return S_OK;
+	}
+
+	virtual HRESULT		GetBufferedVideoFrameCount (uint32_t *bufferedFrameCount)
+	{
+		std::lock_guard<std::mutex>	guard(m_mutex);
+		*bufferedFrameCount = (uint32_t)m_pending.size();
+		return S_OK;
+	}
+
+	virtual HRESULT		EnableAudioOutput (BMDAudioSampleRate, BMDAudioSampleType, uint32_t, BMDAudioOutputStreamType) { return E_NOTIMPL; }
+	virtual HRESULT		DisableAudioOutput (void) { return S_OK; }
+	virtual HRESULT		WriteAudioSamplesSync (void *, uint32_t, uint32_t *) { return E_NOTIMPL; }
+	virtual HRESULT		BeginAudioPreroll (void) { return E_NOTIMPL; }
+	virtual HRESULT		EndAudioPreroll (void) { return E_NOTIMPL; }
+	virtual HRESULT		ScheduleAudioSamples (void *, uint32_t, BMDTimeValue, BMDTimeScale, uint32_t *) { return E_NOTIMPL; }
+	virtual HRESULT		GetBufferedAudioSampleFrameCount (uint32_t *bufferedSampleFrameCount) { *bufferedSampleFrameCount = 0; return S_OK; }
+	virtual HRESULT		FlushBufferedAudioSamples (void) { return S_OK; }
+	virtual HRESULT		SetAudioCallback (IDeckLinkAudioOutputCallback *) { return E_NOTIMPL; }
+
+	// Stream time playbackStartTime is the vsync currently being scanned
+	// out; the first frame can go on screen at the next one.
+	virtual HRESULT		StartScheduledPlayback (BMDTimeValue playbackStartTime, BMDTimeScale timeScale, double)
+	{
+		if (m_mode == NULL || timeScale <= 0)
+			return E_INVALIDARG;
+		if (m_running)
+			return S_OK;
+
+		std::lock_guard<std::mutex>	guard(m_mutex);
+		m_firstIndex = m_mode->VsyncIndex(MockClockNow());
+		m_streamOffset = Rescale(playbackStartTime, timeScale, kNanosecondsPerSecond);
+		m_running = true;
+		m_thread = std::thread(&MockOutput::ScanOutThread, this);
+		return S_OK;
+	}
+
+	// Stops straight away whatever stopPlaybackAtTime says: frames still
+	// waiting come back flushed and the one on screen completed.
+	virtual HRESULT		StopScheduledPlayback (BMDTimeValue, BMDTimeValue *actualStopTime, BMDTimeScale timeScale)
+	{
+		std::vector<ScheduledFrame>		done;
+		IDeckLinkVideoOutputCallback*	callback;
+		const bool						wasRunning = m_running;
+
+		if (actualStopTime != NULL && timeScale > 0)
+			*actualStopTime = wasRunning ? Rescale(StreamTime(MockClockNow()), kNanosecondsPerSecond, timeScale) : 0;
+
+		m_running = false;
+		if (m_thread.joinable())
+			m_thread.join();
+
+		{
+			std::lock_guard<std::mutex>	guard(m_mutex);
+
+			for (std::multimap<int64_t, ScheduledFrame>::iterator it = m_pending.begin(); it != m_pending.end(); ++it)
+			{
+				it->second.result = bmdOutputFrameFlushed;
+				Finish(it->second, done);
+			}
+			m_pending.clear();
+
+			if (m_hasShown)
+				Finish(m_shown, done);
+			m_hasShown = false;
+			callback = m_callback;
+		}
+
+		Complete(callback, done);
+		if (wasRunning && callback != NULL)
+			callback->ScheduledPlaybackHasStopped();
+		return S_OK;
+	}
+
+	virtual HRESULT		IsScheduledPlaybackRunning (bool *active) { *active = m_running; return S_OK; }
+
+	virtual HRESULT		GetScheduledStreamTime (BMDTimeScale desiredTimeScale, BMDTimeValue *streamTime, double *playbackSpeed)
+	{
+		if (desiredTimeScale <= 0)
+			return E_INVALIDARG;
+
+		*streamTime = m_running ? Rescale(StreamTime(MockClockNow()), kNanosecondsPerSecond, desiredTimeScale) : 0;
+		*playbackSpeed = m_running ? 1.0 : 0.0;
+		return S_OK;
+	}
+
+	virtual HRESULT		GetReferenceStatus (BMDReferenceStatus *referenceStatus) { *referenceStatus = bmdReferenceNotSupportedByHardware; return S_OK; }
+
+	virtual HRESULT		GetHardwareReferenceClock (BMDTimeScale desiredTimeScale, BMDTimeValue *hardwareTime, BMDTimeValue *timeInFrame, BMDTimeValue *ticksPerFrame)
+	{
+		return MockInput::GetModeClock(m_mode, desiredTimeScale, hardwareTime, timeInFrame, ticksPerFrame);
+	}
+
+	// The vsync at which the frame went on screen
+	virtual HRESULT		GetFrameCompletionReferenceTimestamp (IDeckLinkVideoFrame *theFrame, BMDTimeScale desiredTimeScale, BMDTimeValue *frameCompletionTimestamp)
+	{
+		std::lock_guard<std::mutex>	guard(m_mutex);
+		std::map<IDeckLinkVideoFrame*, int64_t>::iterator	it = m_displayTimes.find(theFrame);
+
+		if (it == m_displayTimes.end() || desiredTimeScale <= 0)
+			return E_FAIL;
+
+		*frameCompletionTimestamp = Rescale(it->second, kNanosecondsPerSecond, desiredTimeScale);
+		return S_OK;
+	}
+
+protected:
+	virtual ~MockOutput ()
+	{
+		m_running = false;
+		if (m_thread.joinable())
+			m_thread.join();
+
+		for (std::multimap<int64_t, ScheduledFrame>::iterator it = m_pending.begin(); it != m_pending.end(); ++it)
+			it->second.frame->Release();
+		if (m_hasShown)
+			m_shown.frame->Release();
+		if (m_log != NULL)
+			fclose(m_log);
+	}
+
+private:
+	// All times in nanoseconds; displayTime and duration are stream time,
+	// the rest hardware time
+	struct ScheduledFrame
+	{
+		IDeckLinkVideoFrame*			frame;
+		int64_t							displayTime;
+		int64_t							duration;
+		int64_t							scheduledAt;
+		int64_t							shownAt;
+		BMDOutputFrameCompletionResult	result;
+
+		ScheduledFrame () : frame(NULL), displayTime(0), duration(0), scheduledAt(0), shownAt(-1), result(bmdOutputFrameCompleted) {}
+	};
+
+	int64_t		StreamTime (int64_t hardwareTime) const
+	{
+		return m_streamOffset + hardwareTime - m_mode->VsyncTime(m_firstIndex);
+	}
+
+	int64_t		TargetTime (const ScheduledFrame& entry) const
+	{
+		return entry.displayTime - m_streamOffset + m_mode->VsyncTime(m_firstIndex);
+	}
+
+	void	ScanOutThread (void)
+	{
+		int64_t		index = m_firstIndex + 1;
+
+		while (m_running)
+		{
+			MockClockSleepUntil(m_mode->VsyncTime(index));
+			if (!m_running)
+				break;
+
+			ScanOut(index);
+
+			const int64_t	current = m_mode->VsyncIndex(MockClockNow());
+			if (current > index)
+				index = current;
+			index++;
+		}
+	}
+
+	void	ScanOut (int64_t index)
+	{
+		std::vector<ScheduledFrame>		done;
+		IDeckLinkVideoOutputCallback*	callback;
+
+		{
+			std::lock_guard<std::mutex>	guard(m_mutex);
+
+			const int64_t	vsync = m_mode->VsyncTime(index);
+			const int64_t	now = StreamTime(vsync);
+			const int64_t	tolerance = m_mode->FrameNanoseconds() / 2;
+
+			std::multimap<int64_t, ScheduledFrame>::iterator	due = m_pending.upper_bound(now + tolerance);
+
+			if (due != m_pending.begin())
+			{
+				std::multimap<int64_t, ScheduledFrame>::iterator	newest = due;
+				--newest;
+
+				for (std::multimap<int64_t, ScheduledFrame>::iterator it = m_pending.begin(); it != newest; ++it)
+				{
+					it->second.result = bmdOutputFrameDropped;
+					Finish(it->second, done);
+				}
+
+				if (m_hasShown)
+					Finish(m_shown, done);
+
+				m_shown = newest->second;
+				m_shown.shownAt = vsync;
+				m_shown.result = (m_shown.displayTime >= now - tolerance) ? bmdOutputFrameCompleted : bmdOutputFrameDisplayedLate;
+				m_hasShown = true;
+				m_displayTimes[m_shown.frame] = vsync;
+
+				m_pending.erase(m_pending.begin(), due);
+			}
+			else if (m_hasShown && m_shown.displayTime + m_shown.duration <= now + tolerance)
+			{
+				Finish(m_shown, done);
+				m_hasShown = false;
+			}
+
+			callback = m_callback;
+		}
+
+		Complete(callback, done);
+	}
+
+	// Count and log a frame leaving the schedule; called with the lock held
+	void	Finish (const ScheduledFrame& entry, std::vector<ScheduledFrame>& done)
+	{
+		switch (entry.result)
+		{
+			case bmdOutputFrameDisplayedLate:
+				m_lateCount++;
+				break;
+			case bmdOutputFrameDropped:
+				m_droppedCount++;
+				break;
+			case bmdOutputFrameFlushed:
+				m_flushedCount++;
+				break;
+			default:
+				break;
+		}
+		m_completedCount++;
+
+		if (m_log != NULL)
+			fprintf(m_log, "%lld,%lld,%lld,%u\n", (long long)entry.scheduledAt, (long long)TargetTime(entry),
+					(long long)entry.shownAt, (unsigned)entry.result);
+
+		done.push_back(entry);
+	}
+
+	static void		Complete (IDeckLinkVideoOutputCallback* callback, std::vector<ScheduledFrame>& done)
+	{
+		for (size_t i = 0; i < done.size(); i++)
+		{
+			if (callback != NULL)
+				callback->ScheduledFrameCompleted(done[i].frame, done[i].result);
+			done[i].frame->Release();
+		}
+	}
+
+	std::mutex									m_mutex;
+	const MockModeInfo*							m_mode;
+	IDeckLinkVideoOutputCallback*				m_callback;
+	std::multimap<int64_t, ScheduledFrame>		m_pending;			// by stream display time
+	ScheduledFrame								m_shown;
+	bool										m_hasShown;
+	std::map<IDeckLinkVideoFrame*, int64_t>		m_displayTimes;		// vsync each frame last went on screen at
+	std::thread									m_thread;
+	std::atomic<bool>							m_running;
+	int64_t										m_firstIndex;		// vsync at which playback started
+	int64_t										m_streamOffset;
+	FILE*										m_log;
+
+	uint64_t									m_scheduledCount;
+	int64_t										m_leadMin;
+	int64_t										m_leadMax;
+	int64_t										m_leadTotal;
+	uint64_t									m_leadCount;
+	uint64_t									m_completedCount;
+	uint64_t									m_lateCount;
+	uint64_t									m_droppedCount;
+	uint64_t									m_flushedCount;
+
+	MockOutput (const MockOutput&) = delete;
+	MockOutput& operator= (const MockOutput&) = delete;
+};
+
+/* Device */
+
+class MockConfiguration : public MockUnknown<IDeckLinkConfiguration>
+{
+public:
+	virtual HRESULT		SetFlag (BMDDeckLinkConfigurationID, bool) { return S_OK; }
+	virtual HRESULT		GetFlag (BMDDeckLinkConfigurationID, bool *value) { *value = false; return S_OK; }
+	virtual HRESULT		SetInt (BMDDeckLinkConfigurationID, int64_t) { return S_OK; }
+	virtual HRESULT		GetInt (BMDDeckLinkConfigurationID, int64_t *value) { *value = 0; return S_OK; }
+	virtual HRESULT		SetFloat (BMDDeckLinkConfigurationID, double) { return S_OK; }
+	virtual HRESULT		GetFloat (BMDDeckLinkConfigurationID, double *value) { *value = 0; return S_OK; }
+	virtual HRESULT		SetString (BMDDeckLinkConfigurationID, const char *) { return S_OK; }
+	virtual HRESULT		GetString (BMDDeckLinkConfigurationID, const char **value) { *value = strdup(""); return S_OK; }
+	virtual HRESULT		WriteConfigurationToPreferences (void) { return S_OK; }
+};
+
+class MockAttributes : public MockUnknown<IDeckLinkAttributes>
+{
+public:
+	virtual HRESULT		GetFlag (BMDDeckLinkAttributeID id, bool *value) { *value = (id == BMDDeckLinkSupportsInputFormatDetection); return S_OK; }
+	virtual HRESULT		GetInt (BMDDeckLinkAttributeID, int64_t *) { return E_NOTIMPL; }
+	virtual HRESULT		GetFloat (BMDDeckLinkAttributeID, double *) { return E_NOTIMPL; }
+	virtual HRESULT		GetString (BMDDeckLinkAttributeID, const char **) { return E_NOTIMPL; }
+};
+
+class MockDeckLink : public MockUnknown<IDeckLink>
+{
+public:
+	MockDeckLink () : m_mutex(), m_input(NULL), m_output(NULL) {}
+
+	virtual HRESULT STDMETHODCALLTYPE	QueryInterface (REFIID iid, LPVOID *ppv)
+	{
+		std::lock_guard<std::mutex>	guard(m_mutex);
+
+		*ppv = NULL;
+		if (SameIID(iid, IID_IDeckLinkInput))
+		{
+			if (m_input == NULL)
+				m_input = new MockInput();
+			m_input->AddRef();
+			*ppv = static_cast<IDeckLinkInput*>(m_input);
+		}
+		else if (SameIID(iid, IID_IDeckLinkOutput))
+		{
+			if (m_output == NULL)
+				m_output = new MockOutput();
+			m_output->AddRef();
+			*ppv = static_cast<IDeckLinkOutput*>(m_output);
+		}
+		else if (SameIID(iid, IID_IDeckLinkConfiguration))
+			*ppv = static_cast<IDeckLinkConfiguration*>(new MockConfiguration());
+		else if (SameIID(iid, IID_IDeckLinkAttributes))
+			*ppv = static_cast<IDeckLinkAttributes*>(new MockAttributes());
+		else if (SameIID(iid, IID_IUnknown))
+		{
+			AddRef();
+			*ppv = static_cast<IDeckLink*>(this);
+		}
+		else
+			return E_NOINTERFACE;
+
+		return S_OK;
+	}
+
+	virtual HRESULT		GetModelName (const char **modelName) { *modelName = strdup("DeckLink Mock"); return S_OK; }
+	virtual HRESULT		GetDisplayName (const char **displayName) { *displayName = strdup("DeckLink Mock"); return S_OK; }
+
+protected:
+	virtual ~MockDeckLink ()
+	{
+		if (m_input != NULL)
+			m_input->Release();
+		if (m_output != NULL)
+			m_output->Release();
+	}
+
+private:
+	std::mutex		m_mutex;
+	MockInput*		m_input;
+	MockOutput*		m_output;
+
+	MockDeckLink (const MockDeckLink&) = delete;
+	MockDeckLink& operator= (const MockDeckLink&) = delete;
+};
+
+class MockDeckLinkIterator : public MockUnknown<IDeckLinkIterator>
+{
+public:
+	MockDeckLinkIterator () : m_done(false) {}
+
+	virtual HRESULT		Next (IDeckLink **deckLinkInstance)
+	{
+		if (m_done)
+		{
+			*deckLinkInstance = NULL;
+			return S_FALSE;
+		}
+		m_done = true;
+		*deckLinkInstance = new MockDeckLink();
+		return S_OK;
+	}
+
+private:
+	bool	m_done;
+};
+
+IDeckLinkIterator*	CreateMockDeckLinkIteratorInstance (void)
+{
+	MockClockOrigin();
+	return new MockDeckLinkIterator();
+}
@@ -0,0 +1,29 @@
+/*
+** Simulated DeckLink device for running without capture hardware.
+**
+** CreateDeckLinkIteratorInstance() hands out this iterator instead of the
+** driver's when DECKLINK_MOCK is set in the environment. It enumerates one
+** device whose IDeckLinkInput delivers frames on a 60 Hz (or whatever the
+** enabled mode says) vsync grid and whose IDeckLinkOutput scans scheduled
+** frames out on the same grid, calling ScheduledFrameCompleted the way the
+** card does.
+**
+**   DECKLINK_MOCK_INPUT=<file>   raw frames in the capture pixel format,
+**                                played in a loop (default: colour bars
+**                                with a moving white bar)
+**   DECKLINK_MOCK_LOG=<file>     one CSV line per completed output frame
+**   DECKLINK_MOCK_FORMAT_CHANGES=<frame>:<mode index>[,...]
+**                                with format detection enabled, report the
+**                                source switching to that mode (an index
+**                                into the display mode list) once that many
+**                                frames have been delivered
+**/
+
+#ifndef __DECKLINK_API_MOCK_H__
+#define __DECKLINK_API_MOCK_H__
+
+#include "DeckLinkAPI.h"
+
+IDeckLinkIterator*	CreateMockDeckLinkIteratorInstance (void);
+
+#endif